@@ -0,0 +1,30 @@
+# branch-heavy: two branches a round on bits of a linear congruential
+# generator, so neither goes the same way for long, four million rounds
+;loop
+;even
+;next
+;skip
+:main
+	or 12345 0 r1
+	or 0 0 r0
+:loop
+	mul r1 1103515245 r1
+	add r1 12345 r1
+	shr r1 16 r2
+	and r2 1 r3
+	cmp r3 0
+	je :even
+	add r4 1 r4
+	jmp :next
+:even
+	add r5 1 r5
+:next
+	and r2 2 r3
+	cmp r3 0
+	jne :skip
+	xor r6 r2 r6
+:skip
+	add r0 1 r0
+	cmp r0 4000000
+	jl :loop
+	hlt
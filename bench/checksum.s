@@ -0,0 +1,38 @@
+# streaming: reads its input through exp0 a megabyte at a time, sums each
+# chunk a word at a time into a and b, mod 2^32, as Fletcher's checksum
+# does, and writes the two sums out with exp1. The buffer is page-aligned,
+# so a regular file maps straight into it; starting with r7 set moves it r7
+# words along, which has every chunk copied in instead.
+;next
+;loop
+;done
+:main
+	alloc 263168 r6
+	add r6 1023 r6
+	shr r6 10 r6
+	shl r6 10 r6
+	add r6 r7 r6
+	or 0 0 r0
+	or 0 0 r1
+:next
+	exp0 r6 262144 r5
+	cmp r5 0
+	je :done
+	add r5 3 r5
+	shr r5 2 r5
+	add r5 r6 r5
+	or r6 0 r2
+:loop
+	add r0 @r2 r0
+	add r1 r0 r1
+	add r2 1 r2
+	cmp r2 r5
+	jl :loop
+	jmp :next
+:done
+	or r0 0 @r6
+	add r6 1 r3
+	or r1 0 @r3
+	exp1 r6 8
+	exp2
+	hlt
@@ -0,0 +1,38 @@
+# heap-heavy: builds a 1000-node linked list with alloc, walks it through
+# heap derefs, and frees it, 2500 times over
+;outer
+;build
+;walk
+;free
+:main
+	or 0 0 r7
+:outer
+	or 0 0 r1
+	or 0 0 r0
+:build
+	alloc 2 r2
+	or r0 0 @r2
+	add r2 1 r3
+	or r1 0 @r3
+	or r2 0 r1
+	add r0 1 r0
+	cmp r0 1000
+	jl :build
+	or r1 0 r2
+:walk
+	add r4 @r2 r4
+	add r2 1 r3
+	or @r3 0 r2
+	cmp r2 0
+	jne :walk
+:free
+	add r1 1 r3
+	or @r3 0 r2
+	free 2 r1
+	or r2 0 r1
+	cmp r1 0
+	jne :free
+	add r7 1 r7
+	cmp r7 2500
+	jl :outer
+	hlt
@@ -0,0 +1,17 @@
+# loop-heavy arithmetic: a linear congruential generator mixed into a sum,
+# five million times round one loop
+;loop
+:main
+	or 0 0 r0
+	or 1 0 r1
+:loop
+	mul r1 1103515245 r1
+	add r1 12345 r1
+	shr r1 3 r2
+	xor r2 r0 r2
+	add r3 r2 r3
+	and r3 65535 r4
+	add r0 1 r0
+	cmp r0 5000000
+	jl :loop
+	hlt
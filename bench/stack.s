@@ -0,0 +1,29 @@
+# stack-heavy: a recursive sum 50000 calls deep, pushing and popping two
+# words a level, 75 times over
+;outer
+;sum
+;sum.rec
+:main
+	or 0 0 r7
+:outer
+	or 50000 0 r1
+	call :sum
+	add r7 1 r7
+	cmp r7 75
+	jl :outer
+	hlt
+
+:sum
+	cmp r1 0
+	jne :sum.rec
+	or 0 0 r0
+	ret
+:sum.rec
+	push r1
+	push r7
+	sub r1 1 r1
+	call :sum
+	pop r7
+	pop r1
+	add r0 r1 r0
+	ret
@@ -0,0 +1,35 @@
+# streaming with next to no work: reads its input through exp0 a megabyte at
+# a time, touching a word in each page, and writes out how many bytes it
+# took, as exp4 has it. Like checksum.s, r7 moves the buffer off its page.
+;next
+;loop
+;done
+:main
+	alloc 263168 r6
+	add r6 1023 r6
+	shr r6 10 r6
+	shl r6 10 r6
+	add r6 r7 r6
+	or 0 0 r0
+:next
+	exp0 r6 262144 r5
+	cmp r5 0
+	je :done
+	add r5 3 r5
+	shr r5 2 r5
+	add r5 r6 r5
+	or r6 0 r2
+:loop
+	add r0 @r2 r0
+	add r2 1024 r2
+	cmp r2 r5
+	jl :loop
+	jmp :next
+:done
+	exp4 r3 r4
+	or r3 0 @r6
+	add r6 1 r2
+	or r4 0 @r2
+	exp1 r6 8
+	exp2
+	hlt
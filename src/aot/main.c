@@ -0,0 +1,552 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "common/inst.h"
+#include "common/object.h"
+
+// translates an object file into C, with a label per instruction, registers
+// as locals and branches as gotos. Decoding goes through the same
+// rvm_inst_to_struct and rvm_inst_check_valid as the VM.
+
+// flags of each word of the program
+#define WORD_START 1 // first word of an instruction
+#define WORD_ENTRY 2 // first word of an entry instruction
+
+// src/common/alloc.h, embedded at build time
+extern const char rvm_alloc_source[];
+
+static uint32_t *file; // the whole object file
+static const uint32_t *program;
+static uint32_t program_size; // in words
+static uint32_t program_entry;
+static uint8_t *word_flags;
+
+static void read_program(const char *filename);
+static void scan(void);
+static void translate(FILE *out);
+static uint32_t translate_inst(FILE *out, uint32_t pc);
+static void emit_operands(FILE *out, const rvm_inst *inst,
+    const uint32_t *value, char operand[3][32]);
+static void emit_heap_check(FILE *out, int i);
+static void emit_branch(FILE *out, uint32_t pc, const rvm_inst *inst,
+    const uint32_t *value, const char *operand, const char *cond);
+static void emit_push(FILE *out, const char *value);
+static void emit_underflow_check(FILE *out);
+
+int main(int argc, char *argv[]) {
+    if(argc != 3) {
+        printf("usage: %s input-object-filename output-c-filename\n",
+            argv[0]);
+        return 1;
+    }
+
+    read_program(argv[1]);
+
+    FILE *out = fopen(argv[2], "wt");
+    if(out == NULL) {
+        printf("Couldn't open output file!\n");
+        return 1;
+    }
+
+    scan();
+    translate(out);
+
+    fclose(out);
+    free(word_flags);
+    free(file);
+
+    return 0;
+}
+
+static void read_program(const char *filename) {
+    FILE *in = fopen(filename, "rb");
+    if(in == NULL) {
+        printf("Couldn't open input file!\n");
+        exit(1);
+    }
+
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    if(size < 0) {
+        printf("Couldn't read input file!\n");
+        exit(1);
+    }
+
+    // one extra word, so that an empty program still allocates.
+    file = malloc(size + 4);
+    if(!file) {
+        printf("Couldn't allocate program.\n");
+        exit(1);
+    }
+    if(fread(file, 1, size, in) != (size_t)size) {
+        printf("Couldn't read input file!\n");
+        exit(1);
+    }
+    fclose(in);
+
+    rvm_object obj;
+    switch(rvm_object_parse(file, size, &obj)) {
+    case RVM_OBJECT_OK:
+        break;
+    case RVM_OBJECT_SIZE:
+        printf("Program size must be multiple of 4!\n");
+        exit(1);
+    case RVM_OBJECT_VERSION_MISMATCH:
+        printf("Object file is from a later version!\n");
+        exit(1);
+    default:
+        printf("Invalid object file!\n");
+        exit(1);
+    }
+    program = obj.code;
+    program_size = obj.size;
+    program_entry = obj.entry;
+    word_flags = calloc(program_size + 1, 1);
+    if(!word_flags) {
+        printf("Couldn't allocate program.\n");
+        exit(1);
+    }
+}
+
+// finds instruction starts and entries, the same way the VM decodes.
+static void scan(void) {
+    uint32_t pc = 0;
+    while(pc < program_size) {
+        rvm_inst inst;
+        rvm_inst_to_struct(program[pc], &inst);
+
+        word_flags[pc] = WORD_START;
+        if(inst.type == RVM_INST_ENTRY) word_flags[pc] |= WORD_ENTRY;
+
+        pc += rvm_inst_length(program[pc]);
+    }
+}
+
+static const char prologue[] =
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <stdint.h>\n"
+    "#include <stdbool.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "// stack and heap sizes in bytes, as vm -S and -H\n"
+    "#ifndef RVM_AOT_STACK_SIZE\n"
+    "#define RVM_AOT_STACK_SIZE (64u << 20)\n"
+    "#endif\n"
+    "#ifndef RVM_AOT_HEAP_SIZE\n"
+    "#define RVM_AOT_HEAP_SIZE (1u << 30)\n"
+    "#endif\n"
+    "// vm rounds the stack up to whole pages\n"
+    "#define RVM_AOT_STACK_LIMIT \\\n"
+    "    (((uint64_t)RVM_AOT_STACK_SIZE + 0xfff) & ~(uint64_t)0xfff)\n"
+    "\n";
+
+// after the allocator source
+static const char runtime[] =
+    "\n"
+    "typedef struct rvm_aot_state {\n"
+    "    uint32_t pc, sp;\n"
+    "    uint32_t regs[8];\n"
+    "    bool zflag;\n"
+    "    bool nflag;\n"
+    "} rvm_aot_state;\n"
+    "\n"
+    "typedef struct rvm_aot_mem {\n"
+    "    uint32_t *contents;\n"
+    "    uint64_t size;\n"
+    "} rvm_aot_mem;\n"
+    "\n"
+    "static void add_page(rvm_aot_mem *mem) __attribute__((unused));\n"
+    "static void add_page(rvm_aot_mem *mem) {\n"
+    "    if(mem->size >= RVM_AOT_STACK_LIMIT) {\n"
+    "        printf(\"Stack overflow!\\n\");\n"
+    "        exit(1);\n"
+    "    }\n"
+    "    mem->contents = realloc(mem->contents, mem->size += 0x1000);\n"
+    "    if(!mem->contents) {\n"
+    "        printf(\"Couldn't resize memory.\\n\");\n"
+    "        exit(1);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static void fault(const char *message) __attribute__((noreturn));\n"
+    "static void fault(const char *message) {\n"
+    "    printf(\"%s\\n\", message);\n"
+    "    exit(1);\n"
+    "}\n"
+    "\n"
+    "// runs the program from its entry, with empty stack and heap; the\n"
+    "// registers and flags are taken from state, and all of it is written\n"
+    "// back on hlt.\n"
+    "void rvm_aot_run(rvm_aot_state *state) {\n"
+    "    rvm_aot_mem stack = {NULL, 0};\n"
+    "    rvm_alloc heap;\n"
+    "    uint32_t *heap_words = calloc(RVM_AOT_HEAP_SIZE / 4, 4);\n"
+    "    if(!heap_words) fault(\"Couldn't allocate heap.\");\n"
+    "    rvm_alloc_init(&heap, heap_words, RVM_AOT_HEAP_SIZE / 4);\n"
+    "    uint32_t sp = 0;\n"
+    "    bool zf = state->zflag, nf = state->nflag;\n"
+    "    uint32_t r0 = state->regs[0], r1 = state->regs[1];\n"
+    "    uint32_t r2 = state->regs[2], r3 = state->regs[3];\n"
+    "    uint32_t r4 = state->regs[4], r5 = state->regs[5];\n"
+    "    uint32_t r6 = state->regs[6], r7 = state->regs[7];\n"
+    "\n";
+
+static const char epilogue[] =
+    "f_end: __attribute__((unused));\n"
+    "    fault(\"Tried to execute past end of program.\");\n"
+    "f_badjump: __attribute__((unused));\n"
+    "    fault(\"Jumped to non-entry instruction!\");\n"
+    "f_badret: __attribute__((unused));\n"
+    "    fault(\"Returned into the middle of an instruction!\");\n"
+    "halt: __attribute__((unused));\n"
+    "    state->sp = sp;\n"
+    "    state->zflag = zf;\n"
+    "    state->nflag = nf;\n"
+    "    state->regs[0] = r0; state->regs[1] = r1;\n"
+    "    state->regs[2] = r2; state->regs[3] = r3;\n"
+    "    state->regs[4] = r4; state->regs[5] = r5;\n"
+    "    state->regs[6] = r6; state->regs[7] = r7;\n"
+    "    free(stack.contents);\n"
+    "    free(heap_words);\n"
+    "}\n"
+    "\n"
+    "#ifndef RVM_AOT_NO_MAIN\n"
+    "int main(void) {\n"
+    "    rvm_aot_state cpu;\n"
+    "    memset(&cpu, 0, sizeof(cpu));\n"
+    "    rvm_aot_run(&cpu);\n"
+    "\n"
+    "    printf(\"\\tCPU state:\\n\");\n"
+    "    printf(\"\\t\\tPC: %x\\n\", cpu.pc);\n"
+    "    printf(\"\\t\\tSP: %x\\n\", cpu.sp);\n"
+    "    printf(\"\\t\\tFlags: %s %s\\n\", cpu.zflag?\"ZF\":\"\",\n"
+    "        cpu.nflag?\"NF\":\"\");\n"
+    "    printf(\"\\t\\tRegisters:\\n\");\n"
+    "    printf(\"\\t\\t\\t%08x %08x %08x %08x\\n\", cpu.regs[0],\n"
+    "        cpu.regs[1], cpu.regs[2], cpu.regs[3]);\n"
+    "    printf(\"\\t\\t\\t%08x %08x %08x %08x\\n\", cpu.regs[4],\n"
+    "        cpu.regs[5], cpu.regs[6], cpu.regs[7]);\n"
+    "    return 0;\n"
+    "}\n"
+    "#endif\n";
+
+static void translate(FILE *out) {
+    bool dynamic_jump = false, dynamic_return = false;
+    for(uint32_t pc = 0; pc < program_size; pc ++) {
+        if(!(word_flags[pc] & WORD_START)) continue;
+        rvm_inst inst;
+        rvm_inst_to_struct(program[pc], &inst);
+        if(inst.type == RVM_INST_RET) dynamic_return = true;
+        if(inst.type >= RVM_INST_JMP && inst.type <= RVM_INST_CALL
+            && inst.optype[0] != RVM_OP_VALUE_SCONST
+            && inst.optype[0] != RVM_OP_VALUE_LCONST) dynamic_jump = true;
+    }
+
+    fputs(prologue, out);
+    fputs(rvm_alloc_source, out);
+    fputs(runtime, out);
+
+    // computed branches may only land on entries, and returns on the start of
+    // any instruction.
+    if(dynamic_jump) {
+        fprintf(out, "    static const void *const jumps[0x%x] = {\n",
+            program_size);
+        for(uint32_t pc = 0; pc < program_size; pc ++) {
+            if(word_flags[pc] & WORD_ENTRY)
+                fprintf(out, "        &&L_%x,\n", pc);
+            else fprintf(out, "        &&f_badjump,\n");
+        }
+        fprintf(out, "    };\n");
+    }
+    if(dynamic_return) {
+        fprintf(out, "    static const void *const returns[0x%x] = {\n",
+            program_size);
+        for(uint32_t pc = 0; pc < program_size; pc ++) {
+            if(word_flags[pc] & WORD_START)
+                fprintf(out, "        &&L_%x,\n", pc);
+            else fprintf(out, "        &&f_badret,\n");
+        }
+        fprintf(out, "    };\n");
+    }
+    fprintf(out, "\n");
+    if(program_entry != 0) {
+        if(!(word_flags[program_entry] & WORD_START)) {
+            printf("Entry point is inside an instruction!\n");
+            exit(1);
+        }
+        fprintf(out, "    goto L_%x;\n", program_entry);
+    }
+
+    uint32_t pc = 0;
+    while(pc < program_size) pc = translate_inst(out, pc);
+    // falling off the end
+    fprintf(out, "    goto f_end;\n");
+
+    fputs(epilogue, out);
+}
+
+// emits the instruction at pc, returning the address of the next one.
+static uint32_t translate_inst(FILE *out, uint32_t pc) {
+    rvm_inst inst;
+    rvm_inst_to_struct(program[pc], &inst);
+    fprintf(out, "L_%x: __attribute__((unused));\n", pc);
+
+    uint32_t value[3];
+    uint32_t next_pc = pc + 1;
+    for(int i = 0; i < 3; i ++) {
+        value[i] = inst.opval[i];
+        if(inst.optype[i] % 3 != 1) continue;
+        if(next_pc >= program_size) {
+            fprintf(out, "    fault(\"Instruction extends past end of "
+                "program\");\n");
+            return program_size;
+        }
+        value[i] = program[next_pc ++];
+    }
+
+    if(rvm_inst_check_valid(&inst)) {
+        fprintf(out, "    fault(\"Invalid %s instruction!\");\n",
+            rvm_inst_type_strings[inst.type]);
+        return next_pc;
+    }
+
+    static const char *const arith[RVM_INST_COUNT] = {
+        [RVM_INST_ADD] = "+",
+        [RVM_INST_SUB] = "-",
+        [RVM_INST_MUL] = "*",
+        [RVM_INST_DIV] = "/",
+        [RVM_INST_OR] = "|",
+        [RVM_INST_AND] = "&",
+        [RVM_INST_XOR] = "^",
+        [RVM_INST_SHL] = "<<",
+        [RVM_INST_SHR] = ">>",
+    };
+
+    char op[3][32];
+    fprintf(out, "    {\n");
+    emit_operands(out, &inst, value, op);
+
+    switch(inst.type) {
+    case RVM_INST_HLT:
+        fprintf(out, "        state->pc = 0x%x;\n", next_pc);
+        fprintf(out, "        goto halt;\n");
+        break;
+    case RVM_INST_ADD:
+    case RVM_INST_SUB:
+    case RVM_INST_MUL:
+    case RVM_INST_DIV:
+    case RVM_INST_OR:
+    case RVM_INST_AND:
+    case RVM_INST_XOR:
+    case RVM_INST_SHL:
+    case RVM_INST_SHR: {
+        // shift counts are masked the way x86 does, which is what the
+        // interpreter ends up with; a constant shift of 32 or more would be
+        // folded differently otherwise.
+        const char *mask = "";
+        if(inst.type == RVM_INST_SHL || inst.type == RVM_INST_SHR)
+            mask = " & 31";
+        if(inst.type == RVM_INST_DIV) {
+            fprintf(out, "        if(!%s)\n", op[1]);
+            fprintf(out, "            fault(\"Division by zero!\");\n");
+        }
+        if(inst.optype[2] != RVM_OP_ABSENT) {
+            fprintf(out, "        %s = %s %s (%s%s);\n", op[2], op[0],
+                arith[inst.type], op[1], mask);
+        }
+        else {
+            fprintf(out, "        %s %s= (%s%s);\n", op[0], arith[inst.type],
+                op[1], mask);
+        }
+        break;
+    }
+    case RVM_INST_NOT:
+        if(inst.optype[1] != RVM_OP_ABSENT)
+            fprintf(out, "        %s = ~%s;\n", op[1], op[0]);
+        else fprintf(out, "        %s = ~%s;\n", op[0], op[0]);
+        break;
+    case RVM_INST_CMP:
+        fprintf(out, "        uint32_t result = %s - %s;\n", op[0], op[1]);
+        fprintf(out, "        zf = result == 0;\n");
+        fprintf(out, "        nf = (result & (1u<<31)) != 0;\n");
+        break;
+    case RVM_INST_ENTRY: // naught to do.
+        break;
+    case RVM_INST_JMP:
+        emit_branch(out, pc, &inst, value, op[0], NULL);
+        break;
+    case RVM_INST_JE:
+        emit_branch(out, pc, &inst, value, op[0], "zf");
+        break;
+    case RVM_INST_JL:
+        emit_branch(out, pc, &inst, value, op[0], "nf");
+        break;
+    case RVM_INST_JLE:
+        emit_branch(out, pc, &inst, value, op[0], "nf || zf");
+        break;
+    case RVM_INST_JNE:
+        emit_branch(out, pc, &inst, value, op[0], "!zf");
+        break;
+    case RVM_INST_JNL:
+        emit_branch(out, pc, &inst, value, op[0], "!nf");
+        break;
+    case RVM_INST_JNLE:
+        emit_branch(out, pc, &inst, value, op[0], "!nf && !zf");
+        break;
+    case RVM_INST_CALL: {
+        // the target operand is read before the push moves sp.
+        if(inst.optype[0] != RVM_OP_VALUE_SCONST
+            && inst.optype[0] != RVM_OP_VALUE_LCONST)
+            fprintf(out, "        uint32_t callee = %s;\n", op[0]);
+        char ret[32];
+        snprintf(ret, sizeof(ret), "0x%xu", next_pc);
+        emit_push(out, ret);
+        emit_branch(out, pc, &inst, value, "callee", NULL);
+        break;
+    }
+    case RVM_INST_RET:
+        emit_underflow_check(out);
+        fprintf(out, "        uint32_t target = stack.contents[-- sp];\n");
+        fprintf(out, "        if(target >= 0x%xu) goto f_end;\n",
+            program_size);
+        fprintf(out, "        goto *returns[target];\n");
+        break;
+    case RVM_INST_PUSH:
+        emit_push(out, op[0]);
+        break;
+    case RVM_INST_POP:
+        emit_underflow_check(out);
+        fprintf(out, "        %s = stack.contents[-- sp];\n", op[0]);
+        break;
+    case RVM_INST_SWAP:
+        fprintf(out, "        uint32_t t = %s;\n", op[0]);
+        fprintf(out, "        %s = %s;\n", op[0], op[1]);
+        fprintf(out, "        %s = t;\n", op[1]);
+        break;
+    case RVM_INST_ALLOC:
+        fprintf(out, "        if(!(%s = rvm_alloc_block(&heap, %s)))\n",
+            op[1], op[0]);
+        fprintf(out, "            fault(\"Out of heap memory!\");\n");
+        break;
+    case RVM_INST_FREE:
+        fprintf(out, "        if(rvm_alloc_free(&heap, %s))\n", op[1]);
+        fprintf(out, "            fault(\"Invalid free!\");\n");
+        break;
+    // the streams host calls use are the vm's
+    case RVM_INST_EXP0:
+    case RVM_INST_EXP1:
+    case RVM_INST_EXP2:
+    case RVM_INST_EXP3:
+    case RVM_INST_EXP4:
+        fprintf(out, "        fault(\"Host calls need the vm!\");\n");
+        break;
+    default:
+        fprintf(out, "        printf(\"Instruction NYI.\\n\");\n");
+        break;
+    }
+
+    fprintf(out, "    }\n");
+    return next_pc;
+}
+
+// writes a C expression for each operand into operand. Memory addresses are
+// computed up front, as the VM works out all operand pointers before
+// executing an instruction.
+static void emit_operands(FILE *out, const rvm_inst *inst,
+    const uint32_t *value, char operand[3][32]) {
+
+    for(int i = 0; i < 3; i ++) {
+        switch(inst->optype[i]) {
+        case RVM_OP_VALUE_SCONST:
+        case RVM_OP_VALUE_LCONST:
+            snprintf(operand[i], 32, "0x%xu", value[i]);
+            break;
+        case RVM_OP_VALUE_REG:
+            snprintf(operand[i], 32, "r%u", value[i]);
+            break;
+        case RVM_OP_STACK_SCONST:
+        case RVM_OP_STACK_LCONST:
+            // stack derefs index the heap from sp, as in the VM, where
+            // the sum doesn't wrap.
+            fprintf(out, "        uint64_t a%d = (uint64_t)0x%xu + sp;\n", i,
+                value[i]);
+            emit_heap_check(out, i);
+            snprintf(operand[i], 32, "heap.words[a%d]", i);
+            break;
+        case RVM_OP_STACK_REG:
+            fprintf(out, "        uint64_t a%d = (uint64_t)r%u + sp;\n", i,
+                value[i]);
+            emit_heap_check(out, i);
+            snprintf(operand[i], 32, "heap.words[a%d]", i);
+            break;
+        case RVM_OP_HEAP_SCONST:
+        case RVM_OP_HEAP_LCONST:
+            fprintf(out, "        uint32_t a%d = 0x%xu;\n", i, value[i]);
+            emit_heap_check(out, i);
+            snprintf(operand[i], 32, "heap.words[a%d]", i);
+            break;
+        case RVM_OP_HEAP_REG:
+            fprintf(out, "        uint32_t a%d = r%u;\n", i, value[i]);
+            emit_heap_check(out, i);
+            snprintf(operand[i], 32, "heap.words[a%d]", i);
+            break;
+        default:
+            operand[i][0] = 0;
+            break;
+        }
+    }
+}
+
+// faults on address ai past the heap, as the VM's guard pages would.
+static void emit_heap_check(FILE *out, int i) {
+    fprintf(out, "        if(a%d >= RVM_AOT_HEAP_SIZE / 4)\n", i);
+    fprintf(out, "            fault(\"Heap access out of bounds!\");\n");
+}
+
+// branch relative to pc, if cond holds; constant targets become a direct goto
+// to their label, or to the fault they would raise.
+static void emit_branch(FILE *out, uint32_t pc, const rvm_inst *inst,
+    const uint32_t *value, const char *operand, const char *cond) {
+
+    const char *indent = "        ";
+    if(cond) {
+        fprintf(out, "        if(%s) {\n", cond);
+        indent = "            ";
+    }
+
+    if(inst->optype[0] == RVM_OP_VALUE_SCONST
+        || inst->optype[0] == RVM_OP_VALUE_LCONST) {
+
+        uint32_t target = pc + value[0];
+        if(target >= program_size) fprintf(out, "%sgoto f_end;\n", indent);
+        else if(word_flags[target] & WORD_ENTRY)
+            fprintf(out, "%sgoto L_%x;\n", indent, target);
+        else fprintf(out, "%sgoto f_badjump;\n", indent);
+    }
+    else {
+        fprintf(out, "%suint32_t target = 0x%xu + %s;\n", indent, pc, operand);
+        fprintf(out, "%sif(target >= 0x%xu) goto f_end;\n", indent,
+            program_size);
+        fprintf(out, "%sgoto *jumps[target];\n", indent);
+    }
+
+    if(cond) fprintf(out, "        }\n");
+}
+
+// overflows where vm's would, on a push at or past the limit.
+static void emit_push(FILE *out, const char *value) {
+    fprintf(out, "        if((uint64_t)sp * 4 >= stack.size) "
+        "add_page(&stack);\n");
+    fprintf(out, "        stack.contents[sp ++] = %s;\n", value);
+}
+
+static void emit_underflow_check(FILE *out) {
+    fprintf(out, "        if(sp == 0) {\n");
+    fprintf(out, "            printf(\"Stack underflow!\\n\");\n");
+    fprintf(out, "            exit(1);\n");
+    fprintf(out, "        }\n");
+}
@@ -0,0 +1,38 @@
+#ifndef RVM_ASM_ASM_H
+#define RVM_ASM_ASM_H
+
+#include <stdint.h>
+
+#include "common/inst.h"
+
+// an instruction as parsed, before the constant and label operands are given
+// their encoding: those are all sconsts in inst, with the values here.
+typedef struct asm_inst {
+    rvm_inst inst;
+    uint32_t value[3]; // constant, or symbol index for a label
+    uint8_t consts; // bit per operand with a constant or label
+    uint8_t labels; // bit per operand with a label, relative to the inst
+    uint8_t length; // in words; only grows while relaxing
+    uint8_t dead; // removed by asm_optimize
+    uint32_t address; // in words
+} asm_inst;
+
+typedef struct asm_opt_stats {
+    uint32_t instructions, entries; // before optimizing
+    uint32_t entries_removed;
+    uint32_t folded; // computed into a constant
+    uint32_t identities; // removed, or turned into a move
+    uint32_t strength; // mul and div by powers of two, and by 0
+    uint32_t dead_writes; // overwritten before anything could see them
+    uint32_t removed; // by all of the above
+} asm_opt_stats;
+
+// rewrites insts in place, marking removed instructions dead. targeted is
+// the instructions constant branches reach, from the labels referenced. The
+// result runs the same under vm but for addresses: pc, and anything
+// computed from the layout, as relaxation already changes.
+void asm_optimize(asm_inst *insts, uint32_t count, const uint8_t *targeted,
+    asm_opt_stats *stats);
+void asm_opt_report(const asm_opt_stats *stats);
+
+#endif
@@ -2,39 +2,87 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-
-#define MAX_SYMBOLS 1024
-#define MAX_SYMBOL_REFS 1024
+#include <unistd.h>
 
 #include "common/inst.h"
-
-static char *symbol_names[MAX_SYMBOLS];
-static uint32_t symbol_values[MAX_SYMBOLS];
-static uint8_t symbol_has_value[MAX_SYMBOLS];
-static uint32_t symbol_count;
-
-static uint32_t symbol_ref_address[MAX_SYMBOL_REFS];
-static uint32_t symbol_ref_index[MAX_SYMBOL_REFS];
-static uint32_t symbol_ref_adjust[MAX_SYMBOL_REFS];
-static uint32_t symbol_ref_count;
-
-static void parse(FILE *in, FILE *out);
-static int parse_line(char *line, rvm_inst *result, uint32_t *following,
-    int *num_following, uint32_t address);
+#include "common/object.h"
+#include "asm.h"
+
+#define SYMBOL_NONE 0xffffffff
+
+typedef struct symbol {
+    uint32_t name; // offset of the NUL-terminated name in symbol_names
+    uint32_t hash;
+    uint32_t value; // word address, once relaxed
+    uint32_t inst; // the label's entry instruction
+    uint8_t defined;
+} symbol;
+
+static symbol *symbols;
+static uint32_t symbol_count, symbol_capacity;
+static char *symbol_names;
+static size_t names_size, names_capacity;
+// symbols by name: open addressing with linear probing, kept at most half
+// full. Slots hold SYMBOL_NONE or an index into symbols.
+static uint32_t *symbol_table;
+static uint32_t table_size; // a power of two
+
+// instruction type by mnemonic_hash, or -1
+static int8_t mnemonics[64];
+
+static asm_inst *insts;
+static uint32_t inst_count, inst_capacity;
+
+// the program, in words, once relaxed.
+static uint32_t *code;
+static uint32_t code_size, code_capacity;
+
+static void init_mnemonics(void);
+static void parse(FILE *in);
+static void optimize(void);
+static uint32_t relax(void);
+static void assemble(void);
+static uint8_t encoding(const asm_inst *a, uint8_t length, uint8_t *longs);
+static uint32_t operand_value(const asm_inst *a, int i);
+static uint32_t legacy_size(void);
+static void emit(const uint32_t *words, uint32_t count);
+static int write_object(FILE *out, int raw);
+static int parse_line(char *line, asm_inst *result, uint32_t index);
 static void skip_whitespace(char **p);
 static char *get_token(char **p);
+static int mnemonic_type(const char *op, size_t length);
+static uint32_t mnemonic_hash(const char *op, size_t length);
 static uint32_t symbol_index(const char *name);
+static uint32_t symbol_add(const char *name);
+static uint32_t symbol_hash(const char *name);
+static void grow_table(void);
 
 
 int main(int argc, char *argv[]) {
-    if(argc != 3) {
-        printf("usage: %s input-assembly-filename output-object-filename\n", 
-            argv[0]);
+    // -r writes a legacy raw image, without the object header; -O optimizes.
+    int raw = 0, optimizing = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "rO")) != -1) {
+        switch(opt) {
+        case 'r':
+            raw = 1;
+            break;
+        case 'O':
+            optimizing = 1;
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+    if(argc - optind != 2) {
+        printf("usage: %s [-r] [-O] input-assembly-filename "
+            "output-object-filename\n", argv[0]);
         return 1;
     }
 
-    FILE *in = fopen(argv[1], "rt");
-    FILE *out = fopen(argv[2], "wb");
+    FILE *in = fopen(argv[optind], "rt");
+    FILE *out = fopen(argv[optind + 1], "wb");
 
     if(in == NULL) {
         printf("Couldn't open input file!\n");
@@ -45,76 +93,265 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    parse(in, out);
-
+    init_mnemonics();
+    parse(in);
+    if(optimizing) optimize();
+    uint32_t passes = relax();
+    assemble();
+    uint32_t legacy = legacy_size();
+    printf("%u words, %.1f%% smaller than %u with long labels and int8 "
+        "constants; relaxed in %u passes\n", code_size,
+        legacy ? 100.0 * (legacy - code_size) / legacy : 0.0, legacy, passes);
+    if(write_object(out, raw) || fclose(out)) {
+        printf("Couldn't write output file!\n");
+        return 1;
+    }
     fclose(in);
-    fclose(out);
+    free(code);
+    free(insts);
+    free(symbols);
+    free(symbol_names);
+    free(symbol_table);
 
     return 0;
 }
 
-static void parse(FILE *in, FILE *out) {
-    rvm_inst inst;
-    uint32_t encoded[4];
-    int num_following;
-
+static void parse(FILE *in) {
     // assuming all lines < 1024 chars long
     char line[1024];
     int lineno = 0;
-    uint32_t address = 0;
     while(fgets(line, sizeof(line), in)) {
-        line[strlen(line)-1] = 0;
+        line[strcspn(line, "\n")] = 0;
         lineno++;
 
-        if(parse_line(line, &inst, encoded + 1, &num_following, address))
-            continue;
+        if(inst_count == inst_capacity) {
+            inst_capacity = inst_capacity ? inst_capacity * 2 : 1024;
+            insts = realloc(insts, sizeof(asm_inst) * inst_capacity);
+            if(!insts) {
+                printf("Couldn't allocate program.\n");
+                exit(1);
+            }
+        }
+        asm_inst *a = insts + inst_count;
+        if(parse_line(line, a, inst_count)) continue;
 
-        if(rvm_inst_check_valid(&inst)) {
+        if(rvm_inst_check_valid(&a->inst)) {
             printf("Invalid instruction on line %i\n", lineno);
             exit(1);
         }
+        a->length = 1;
+        inst_count ++;
+    }
+
+    for(uint32_t i = 0; i < inst_count; i ++) {
+        asm_inst *a = insts + i;
+        for(int j = 0; j < 3; j ++) {
+            if(!(a->labels & (1 << j)) || symbols[a->value[j]].defined)
+                continue;
+            printf("Label '%s' is never defined.\n",
+                symbol_names + symbols[a->value[j]].name);
+            exit(1);
+        }
+    }
+}
 
+// runs asm_optimize, telling it which entries labels are referenced at.
+static void optimize(void) {
+    uint8_t *targeted = calloc(inst_count + 1, 1);
+    if(!targeted) {
+        printf("Couldn't allocate program.\n");
+        exit(1);
+    }
+    for(uint32_t i = 0; i < inst_count; i ++) {
+        const asm_inst *a = insts + i;
+        for(int j = 0; j < 3; j ++) {
+            if(a->labels & (1 << j)) targeted[symbols[a->value[j]].inst] = 1;
+        }
+    }
+
+    asm_opt_stats stats;
+    asm_optimize(insts, inst_count, targeted, &stats);
+    asm_opt_report(&stats);
+    free(targeted);
+}
+
+// lays the instructions out, starting with every operand encoded in the
+// instruction word and moving those that don't fit into following words
+// until nothing moves; lengths only grow, so this always settles. Returns the
+// number of passes.
+static uint32_t relax(void) {
+    uint32_t passes = 0;
+    int changed = 1;
+    while(changed) {
+        changed = 0;
+        passes ++;
+
+        uint32_t address = 0;
+        for(uint32_t i = 0; i < inst_count; i ++) {
+            insts[i].address = address;
+            if(!insts[i].dead) address += insts[i].length;
+        }
+        for(uint32_t s = 0; s < symbol_count; s ++) {
+            if(symbols[s].defined)
+                symbols[s].value = insts[symbols[s].inst].address;
+        }
+
+        for(uint32_t i = 0; i < inst_count; i ++) {
+            asm_inst *a = insts + i;
+            if(a->dead) continue;
+            uint8_t longs, length = encoding(a, a->length, &longs);
+            if(length == a->length) continue;
+            a->length = length;
+            changed = 1;
+        }
+    }
+    return passes;
+}
+
+// encodes the relaxed instructions into code.
+static void assemble(void) {
+    for(uint32_t i = 0; i < inst_count; i ++) {
+        asm_inst *a = insts + i;
+        if(a->dead) continue;
+        uint32_t encoded[4];
+        int num_following = 0;
+        uint8_t longs;
+        encoding(a, a->length, &longs);
+
+        rvm_inst inst = a->inst;
+        for(int j = 0; j < 3; j ++) {
+            if(!(a->consts & (1 << j))) continue;
+            uint32_t value = operand_value(a, j);
+            if(longs & (1 << j)) {
+                inst.optype[j] ++; // sconst to lconst
+                inst.opval[j] = 0;
+                encoded[1 + num_following ++] = value;
+            }
+            else inst.opval[j] = value;
+        }
         encoded[0] = rvm_inst_from_struct(&inst);
+        emit(encoded, num_following + 1);
+    }
+}
 
-        fwrite(encoded, sizeof(uint32_t), num_following+1, out);
-        address += (num_following+1)*4;
+// the shortest encoding of at least length words, setting longs to the
+// operands moved into following words. Sconsts are zero-extended and share
+// what registers leave of the 17 operand bits, so moving one out widens the
+// others; moving more out never makes an encoding invalid.
+static uint8_t encoding(const asm_inst *a, uint8_t length, uint8_t *longs) {
+    int regs = 0;
+    for(int i = 0; i < 3; i ++) regs += a->inst.optype[i] % 3 == 2;
+
+    uint8_t best = 4;
+    *longs = a->consts;
+    for(uint8_t mask = 0; mask < 8; mask ++) {
+        if(mask & ~a->consts) continue;
+        uint8_t moved = __builtin_popcount(mask);
+        int shorts = __builtin_popcount(a->consts) - moved;
+        if(1 + moved < length || 1 + moved >= best) continue;
+
+        int bits = shorts ? (17 - 3 * regs) / shorts : 0, fits = 1;
+        for(int i = 0; i < 3; i ++) {
+            if(!(a->consts & ~mask & (1 << i))) continue;
+            if(operand_value(a, i) >> bits) fits = 0;
+        }
+        if(!fits) continue;
+        best = 1 + moved;
+        *longs = mask;
     }
+    return best;
+}
+
+// constant operand i, with labels as of the last layout.
+static uint32_t operand_value(const asm_inst *a, int i) {
+    if(!(a->labels & (1 << i))) return a->value[i];
+    return symbols[a->value[i]].value - a->address;
+}
 
-    for(uint32_t i = 0; i < symbol_ref_count; i ++) {
-        fseek(out, symbol_ref_address[i], SEEK_SET);
-        uint32_t value = symbol_values[symbol_ref_index[i]];
-        printf("symbol name: %s\n", symbol_names[symbol_ref_index[i]]);
-        printf("symbol value: %x\n", value);
-        printf("symbol adjust: %x\n", symbol_ref_adjust[i]);
-        printf("symbol has value: %x\n", symbol_has_value[symbol_ref_index[i]]);
-        value += symbol_ref_adjust[i];
-        fwrite(&value, sizeof(uint32_t), 1, out);
+// the size with every label in a following word and only constants under
+// 128 in the instruction, as the assembler used to encode them.
+static uint32_t legacy_size(void) {
+    uint32_t size = 0;
+    for(uint32_t i = 0; i < inst_count; i ++) {
+        const asm_inst *a = insts + i;
+        if(a->dead) continue;
+        size ++;
+        for(int j = 0; j < 3; j ++) {
+            if(!(a->consts & (1 << j))) continue;
+            if((a->labels & (1 << j)) || a->value[j] >= 128) size ++;
+        }
     }
+    return size;
 }
 
-static int parse_line(char *line, rvm_inst *result, uint32_t *following,
-    int *num_following, uint32_t address) {
+static void emit(const uint32_t *words, uint32_t count) {
+    if(code_size + count > code_capacity) {
+        code_capacity = code_capacity ? code_capacity * 2 : 1024;
+        code = realloc(code, sizeof(uint32_t) * code_capacity);
+        if(!code) {
+            printf("Couldn't allocate program.\n");
+            exit(1);
+        }
+    }
+    memcpy(code + code_size, words, sizeof(uint32_t) * count);
+    code_size += count;
+}
+
+// the program, with its labels as symbols and main, if there is one, as the
+// entry point.
+static int write_object(FILE *out, int raw) {
+    if(raw) {
+        return code_size
+            && fwrite(code, sizeof(uint32_t), code_size, out) != code_size;
+    }
+
+    rvm_object obj;
+    memset(&obj, 0, sizeof(obj));
+    obj.code = code;
+    obj.size = code_size;
+
+    // names of labels declared and never defined go along unreferenced.
+    rvm_symbol *defined = malloc(sizeof(rvm_symbol) * (symbol_count + 1));
+    if(!defined) {
+        printf("Couldn't allocate symbols.\n");
+        exit(1);
+    }
+    for(uint32_t i = 0; i < symbol_count; i ++) {
+        if(!symbols[i].defined) continue;
+        if(!strcmp(symbol_names + symbols[i].name, "main"))
+            obj.entry = symbols[i].value;
+        rvm_symbol *s = defined + obj.symbol_count ++;
+        s->value = symbols[i].value;
+        s->name = symbols[i].name;
+    }
+    obj.symbols = defined;
+    obj.names = symbol_names;
+    obj.names_size = names_size;
+
+    int result = rvm_object_write(out, &obj);
+    free(defined);
+    return result;
+}
+
+static int parse_line(char *line, asm_inst *a, uint32_t index) {
+    rvm_inst *result = &a->inst;
 
     // clear result to keep things clean.
-    memset(result, 0, sizeof(*result));
-    
-    *num_following = 0;
+    memset(a, 0, sizeof(*a));
 
+    // tokens are cut out of line in place.
     char *op = get_token(&line);
+    size_t op_length = line - op;
+    if(*line) *line++ = 0;
     // empty line?
     if(*op == 0) return 1;
     // comment?
     if(*op == '#') return 1;
     // label?
     if(*op == ':') {
-        symbol_names[symbol_count] = malloc(line-op+1);
-        strncpy(symbol_names[symbol_count], op+1, line-op-1);
-        symbol_names[symbol_count][line-op-1] = 0;
-        uint32_t in = symbol_index(symbol_names[symbol_count]);
-        if(in == symbol_count) symbol_count ++;
-        else free(symbol_names[symbol_count]);
-        symbol_values[in] = address/4;
-        symbol_has_value[in] = 1;
+        uint32_t in = symbol_add(op+1);
+        symbols[in].inst = index;
+        symbols[in].defined = 1;
 
         result->type = RVM_INST_ENTRY;
 
@@ -123,23 +360,11 @@ static int parse_line(char *line, rvm_inst *result, uint32_t *following,
     }
     // label forward-decl?
     if(*op == ';') {
-        symbol_names[symbol_count] = malloc(line-op+1);
-        strncpy(symbol_names[symbol_count], op+1, line-op-1);
-        symbol_names[symbol_count][line-op-1] = 0;
-        uint32_t in = symbol_index(symbol_names[symbol_count]);
-        if(in == symbol_count) symbol_count ++, symbol_has_value[in] = 0;
-        else free(symbol_names[symbol_count]);
-
+        symbol_add(op+1);
         return 1;
     }
 
-    int type = -1;
-    for(int i = 0; i < RVM_INST_COUNT; i ++) {
-        if(!strncmp(op, rvm_inst_type_strings[i], line-op)) {
-            type = i;
-            break;
-        }
-    }
+    int type = mnemonic_type(op, op_length);
     if(type == -1) {
         printf("Syntax error: unknown instruction \"%s\"\n", op);
         exit(1);
@@ -157,28 +382,22 @@ static int parse_line(char *line, rvm_inst *result, uint32_t *following,
     for(opcount = 0; opcount < 3; opcount ++) {
         opstr[opcount] = get_token(&line);
         if(opstr[opcount] == line) break;
-        char *t = malloc(line-opstr[opcount] + 1);
-        strncpy(t, opstr[opcount], line-opstr[opcount]);
-        t[line-opstr[opcount]] = 0;
-        opstr[opcount] = t;
+        if(*line) *line++ = 0;
     }
 
     for(int i = 0; i < opcount; i ++) {
         // relative label reference
         if(opstr[i][0] == ':') {
             uint32_t in = symbol_index(opstr[i]+1);
-            if(in == symbol_count) {
+            if(in == SYMBOL_NONE) {
                 printf("Unknown symbol reference '%s'.\n", opstr[i]);
                 exit(1);
             }
 
-            printf("Found symbol '%s' at index %i\n", opstr[i]+1, in);
-            (*num_following) ++;
-            symbol_ref_address[symbol_ref_count] = address + (*num_following * 4);
-            printf("\taddress: %i (adjust %x)\n", address, -(address/4));
-            symbol_ref_adjust[symbol_ref_count] = -(address/4);
-            symbol_ref_index[symbol_ref_count++] = in;
-            result->optype[i] = RVM_OP_VALUE_LCONST;
+            a->value[i] = in;
+            a->consts |= 1 << i;
+            a->labels |= 1 << i;
+            result->optype[i] = RVM_OP_VALUE_SCONST;
             continue;
         }
 
@@ -202,7 +421,7 @@ static int parse_line(char *line, rvm_inst *result, uint32_t *following,
                 exit(1);
             }
             type += 2; // reg
-            result->opval[i] = opstr[i][1] - '0';
+            result->opval[i] = ops[1] - '0';
         }
         // constant
         else {
@@ -212,20 +431,13 @@ static int parse_line(char *line, rvm_inst *result, uint32_t *following,
                 exit(1);
             }
 
-            if((int32_t)((int8_t)parsed) == (int32_t)parsed) {
-                result->opval[i] = (uint8_t)parsed;
-            }
-            else {
-                type += 1; // lconst
-                (*num_following) ++;
-                *(following++) = parsed;
-            }
+            // sconst for now; relax decides.
+            a->value[i] = parsed;
+            a->consts |= 1 << i;
         }
         result->optype[i] = type;
     }
 
-    while(opcount > 0) free(opstr[--opcount]);
-
     return 0;
 }
 
@@ -242,10 +454,111 @@ static char *get_token(char **p) {
     return word;
 }
 
+// builds mnemonics, which mnemonic_hash is perfect for.
+static void init_mnemonics(void) {
+    memset(mnemonics, -1, sizeof(mnemonics));
+    for(int i = 0; i < RVM_INST_COUNT; i ++) {
+        const char *name = rvm_inst_type_strings[i];
+        uint32_t h = mnemonic_hash(name, strlen(name));
+        if(mnemonics[h] != -1) {
+            printf("Mnemonics \"%s\" and \"%s\" hash the same.\n", name,
+                rvm_inst_type_strings[(int)mnemonics[h]]);
+            exit(1);
+        }
+        mnemonics[h] = i;
+    }
+}
+
+// type of the instruction named by length chars of op, which are followed
+// by a NUL, or -1 if there's none.
+static int mnemonic_type(const char *op, size_t length) {
+    int type = mnemonics[mnemonic_hash(op, length)];
+    if(type == -1) return -1;
+    const char *name = rvm_inst_type_strings[type];
+    if(strlen(name) != length || memcmp(name, op, length)) return -1;
+    return type;
+}
+
+// mnemonics are all at least 2 chars, and a shorter op still has its NUL at
+// op[1]; the multipliers were searched for to leave no collisions in 64
+// slots.
+static uint32_t mnemonic_hash(const char *op, size_t length) {
+    return ((uint8_t)op[0] * 60 + (uint8_t)op[1] * 37
+        + (uint8_t)op[length - 1] + length) & 63;
+}
+
+// index of the symbol called name, or SYMBOL_NONE.
 static uint32_t symbol_index(const char *name) {
-    uint32_t j;
-    for(j = 0; j < symbol_count; j ++) {
-        if(!strcmp(name, symbol_names[j])) break;
+    if(!table_size) return SYMBOL_NONE;
+    uint32_t hash = symbol_hash(name);
+    for(uint32_t slot = hash & (table_size - 1);;
+        slot = (slot + 1) & (table_size - 1)) {
+
+        uint32_t in = symbol_table[slot];
+        if(in == SYMBOL_NONE) return SYMBOL_NONE;
+        if(symbols[in].hash == hash
+            && !strcmp(symbol_names + symbols[in].name, name)) return in;
+    }
+}
+
+// index of the symbol called name, added undefined if it's new.
+static uint32_t symbol_add(const char *name) {
+    uint32_t in = symbol_index(name);
+    if(in != SYMBOL_NONE) return in;
+
+    if((symbol_count + 1) * 2 > table_size) grow_table();
+    if(symbol_count == symbol_capacity) {
+        symbol_capacity = symbol_capacity ? symbol_capacity * 2 : 1024;
+        symbols = realloc(symbols, sizeof(symbol) * symbol_capacity);
+    }
+    size_t length = strlen(name) + 1;
+    if(names_size + length > names_capacity) {
+        while(names_size + length > names_capacity)
+            names_capacity = names_capacity ? names_capacity * 2 : 16384;
+        symbol_names = realloc(symbol_names, names_capacity);
+    }
+    if(!symbols || !symbol_names) {
+        printf("Couldn't allocate symbols.\n");
+        exit(1);
+    }
+
+    in = symbol_count ++;
+    symbol *s = symbols + in;
+    memset(s, 0, sizeof(*s));
+    s->name = names_size;
+    s->hash = symbol_hash(name);
+    memcpy(symbol_names + names_size, name, length);
+    names_size += length;
+
+    uint32_t slot = s->hash & (table_size - 1);
+    while(symbol_table[slot] != SYMBOL_NONE)
+        slot = (slot + 1) & (table_size - 1);
+    symbol_table[slot] = in;
+    return in;
+}
+
+// FNV-1a
+static uint32_t symbol_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    while(*name) hash = (hash ^ (uint8_t)*name++) * 16777619u;
+    return hash;
+}
+
+// doubles the table, rehashing what's in it.
+static void grow_table(void) {
+    uint32_t size = table_size ? table_size * 2 : 1024;
+    uint32_t *table = malloc(sizeof(uint32_t) * size);
+    if(!table) {
+        printf("Couldn't allocate symbols.\n");
+        exit(1);
+    }
+    memset(table, 0xff, sizeof(uint32_t) * size);
+    for(uint32_t in = 0; in < symbol_count; in ++) {
+        uint32_t slot = symbols[in].hash & (size - 1);
+        while(table[slot] != SYMBOL_NONE) slot = (slot + 1) & (size - 1);
+        table[slot] = in;
     }
-    return j;
+    free(symbol_table);
+    symbol_table = table;
+    table_size = size;
 }
@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "asm.h"
+
+// asm -O: a few passes over the parsed program, each looking no further than
+// a basic block. Anything that can fault or be seen from elsewhere is left
+// where it is, so only register and constant operands are ever dropped. ret
+// may return to any instruction start, as rvm_program_return allows, once
+// anything but a call can put a value on the stack; every instruction then
+// starts a block. push and pop pairs stay too: the push can overflow a stack
+// whose size is only known when run.
+
+#define NONE 0xffffffff
+
+static void remove_entries(asm_inst *insts, uint32_t count,
+    const uint8_t *targeted, asm_opt_stats *stats);
+static bool returns_anywhere(const asm_inst *insts, uint32_t count);
+static void fold(asm_inst *insts, uint32_t count, bool anywhere,
+    asm_opt_stats *stats);
+static void simplify(asm_inst *insts, uint32_t count, asm_opt_stats *stats);
+static void dead_writes(asm_inst *insts, uint32_t count, bool anywhere,
+    asm_opt_stats *stats);
+static bool arith(const asm_inst *a, int *dst, int *x, int *y);
+static bool plain(const asm_inst *a);
+static bool compute(uint8_t type, uint32_t x, uint32_t y, uint32_t *result);
+static bool is_const(const asm_inst *a, int i);
+static bool is_reg(const asm_inst *a, int i);
+static void copy_operand(asm_inst *a, int i, const asm_inst *from, int j);
+static void set_const(asm_inst *a, int i, uint32_t value);
+static void set_move(asm_inst *a, const asm_inst *from, int i,
+    const asm_inst *to, int j);
+
+void asm_optimize(asm_inst *insts, uint32_t count, const uint8_t *targeted,
+    asm_opt_stats *stats) {
+
+    memset(stats, 0, sizeof(*stats));
+    stats->instructions = count;
+    remove_entries(insts, count, targeted, stats);
+    bool anywhere = returns_anywhere(insts, count);
+    fold(insts, count, anywhere, stats);
+    simplify(insts, count, stats);
+    dead_writes(insts, count, anywhere, stats);
+    for(uint32_t i = 0; i < count; i ++) stats->removed += insts[i].dead;
+}
+
+void asm_opt_report(const asm_opt_stats *stats) {
+    printf("Optimizer report:\n");
+    printf("\tentries: %u of %u removed\n", stats->entries_removed,
+        stats->entries);
+    printf("\tfolded: %u\n", stats->folded);
+    printf("\tidentities: %u\n", stats->identities);
+    printf("\tstrength reduced: %u\n", stats->strength);
+    printf("\tdead writes: %u\n", stats->dead_writes);
+    printf("\tinstructions: %u, %u removed\n", stats->instructions,
+        stats->removed);
+}
+
+// entries no constant branch lands on; with a computed branch anywhere, any
+// entry could be landed on, so they all stay.
+static void remove_entries(asm_inst *insts, uint32_t count,
+    const uint8_t *targeted, asm_opt_stats *stats) {
+
+    bool computed = false;
+    for(uint32_t i = 0; i < count; i ++) {
+        uint8_t type = insts[i].inst.type;
+        if(type == RVM_INST_ENTRY) stats->entries ++;
+        if(type >= RVM_INST_JMP && type <= RVM_INST_CALL
+            && !(insts[i].consts & 1)) computed = true;
+    }
+    if(computed) return;
+
+    for(uint32_t i = 0; i < count; i ++) {
+        if(insts[i].inst.type != RVM_INST_ENTRY || targeted[i]) continue;
+        insts[i].dead = 1;
+        stats->entries_removed ++;
+    }
+}
+
+// whether a ret could land somewhere other than after a call: there's a ret,
+// and a push or a stack operand could leave any value where it pops from.
+static bool returns_anywhere(const asm_inst *insts, uint32_t count) {
+    bool ret = false, written = false;
+    for(uint32_t i = 0; i < count; i ++) {
+        const rvm_inst *inst = &insts[i].inst;
+        if(inst->type == RVM_INST_RET) ret = true;
+        if(inst->type == RVM_INST_PUSH) written = true;
+        for(int k = 0; k < 3; k ++) {
+            if(inst->optype[k] >= RVM_OP_STACK_SCONST
+                && inst->optype[k] <= RVM_OP_STACK_REG) written = true;
+        }
+    }
+    return ret && written;
+}
+
+// tracks which registers hold known constants through each block, and turns
+// arithmetic on nothing but those into a constant move. With returns landing
+// anywhere, that's only constants within one instruction.
+static void fold(asm_inst *insts, uint32_t count, bool anywhere,
+    asm_opt_stats *stats) {
+
+    bool known[8] = {false};
+    uint32_t values[8];
+    for(uint32_t i = 0; i < count; i ++) {
+        asm_inst *a = insts + i;
+        if(a->dead) continue;
+        if(anywhere) memset(known, 0, sizeof(known));
+        uint8_t type = a->inst.type;
+
+        int dst, x, y;
+        if(arith(a, &dst, &x, &y)) {
+            if(!is_reg(a, dst)) continue;
+            uint32_t r = a->inst.opval[dst], value[2] = {0, 0}, result;
+            int ops[2] = {x, y};
+            bool all = plain(a);
+            for(int k = 0; k < 2 && all; k ++) {
+                if(ops[k] < 0) continue;
+                if(is_const(a, ops[k])) value[k] = a->value[ops[k]];
+                else if(known[a->inst.opval[ops[k]]])
+                    value[k] = values[a->inst.opval[ops[k]]];
+                else all = false;
+            }
+            if(!all || !compute(type, value[0], value[1], &result)) {
+                known[r] = false;
+                continue;
+            }
+
+            if(type != RVM_INST_OR || dst != 2 || !is_const(a, 0)
+                || !is_const(a, 1) || a->value[0] != result
+                || a->value[1] != 0) {
+
+                asm_inst constant = *a;
+                set_const(&constant, 0, result);
+                set_move(a, &constant, 0, a, dst);
+                stats->folded ++;
+            }
+            known[r] = true;
+            values[r] = result;
+            continue;
+        }
+
+        switch(type) {
+        case RVM_INST_POP:
+            if(is_reg(a, 0)) known[a->inst.opval[0]] = false;
+            break;
+        case RVM_INST_SWAP:
+            if(is_reg(a, 0)) known[a->inst.opval[0]] = false;
+            if(is_reg(a, 1)) known[a->inst.opval[1]] = false;
+            break;
+        case RVM_INST_ALLOC:
+            if(is_reg(a, 1)) known[a->inst.opval[1]] = false;
+            break;
+        // the start of a block, or the end of one that isn't fallen out of
+        case RVM_INST_ENTRY:
+        case RVM_INST_JMP:
+        case RVM_INST_CALL:
+        case RVM_INST_RET:
+        case RVM_INST_HLT:
+        // host calls, which write registers from outside
+        case RVM_INST_EXP0:
+        case RVM_INST_EXP3:
+        case RVM_INST_EXP4:
+            memset(known, 0, sizeof(known));
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// arithmetic with a constant that changes nothing, or that has a cheaper
+// form: x + 0, x * 1, ... go, or become a move; multiplying and dividing by
+// powers of two become shifts, and by 0, a constant.
+static void simplify(asm_inst *insts, uint32_t count, asm_opt_stats *stats) {
+    for(uint32_t i = 0; i < count; i ++) {
+        asm_inst *a = insts + i;
+        int dst, x, y;
+        if(a->dead || !arith(a, &dst, &x, &y) || y < 0 || !plain(a)
+            || !is_reg(a, dst)) continue;
+        uint8_t type = a->inst.type;
+        bool commutes = type == RVM_INST_ADD || type == RVM_INST_MUL
+            || type == RVM_INST_OR || type == RVM_INST_AND
+            || type == RVM_INST_XOR;
+
+        // the constant on the right, where it can be
+        int c = y, other = x;
+        if(!is_const(a, y)) {
+            if(!commutes || !is_const(a, x) || dst == x) continue;
+            c = x;
+            other = y;
+        }
+        uint32_t value = a->value[c];
+
+        uint32_t identity = type == RVM_INST_MUL || type == RVM_INST_DIV ? 1
+            : type == RVM_INST_AND ? 0xffffffff : 0;
+        if(value == identity) {
+            if(is_reg(a, other)
+                && a->inst.opval[other] == a->inst.opval[dst]) {
+
+                a->dead = 1;
+                stats->identities ++;
+            }
+            else if(type != RVM_INST_OR || c != 1) {
+                set_move(a, a, other, a, dst);
+                stats->identities ++;
+            }
+            continue;
+        }
+
+        if((type == RVM_INST_MUL || type == RVM_INST_AND) && value == 0) {
+            if(type == RVM_INST_AND && dst == other) continue;
+            // nothing to read, so and rX 0 or a constant move
+            if(dst == other) a->inst.type = RVM_INST_AND;
+            else {
+                asm_inst zero = *a;
+                set_const(&zero, 0, 0);
+                set_move(a, &zero, 0, a, dst);
+            }
+            stats->strength ++;
+            continue;
+        }
+
+        if((type == RVM_INST_MUL || type == RVM_INST_DIV) && value > 1
+            && !(value & (value - 1))) {
+
+            asm_inst shift = *a;
+            shift.inst.type = type == RVM_INST_MUL ? RVM_INST_SHL
+                : RVM_INST_SHR;
+            copy_operand(&shift, 0, a, other);
+            set_const(&shift, 1, __builtin_ctz(value));
+            *a = shift;
+            stats->strength ++;
+        }
+    }
+}
+
+// removes plain arithmetic into a register that's written again before
+// anything reads it. Anything else, faulting included, ends the window, as
+// the registers can be seen from there; with returns landing anywhere, so
+// does every instruction, which leaves nothing to remove.
+static void dead_writes(asm_inst *insts, uint32_t count, bool anywhere,
+    asm_opt_stats *stats) {
+
+    if(anywhere) return;
+    uint32_t last[8]; // write no one has read yet
+    for(int r = 0; r < 8; r ++) last[r] = NONE;
+    for(uint32_t i = 0; i < count; i ++) {
+        asm_inst *a = insts + i;
+        if(a->dead) continue;
+
+        int dst = 0, x = 0, y = 0;
+        bool writes = arith(a, &dst, &x, &y) && plain(a) && is_reg(a, dst)
+            && (a->inst.type != RVM_INST_DIV
+                || (is_const(a, y) && a->value[y]));
+        for(int k = 0; k < 3; k ++) {
+            uint8_t optype = a->inst.optype[k];
+            if(optype % 3 != 2) continue;
+            // the destination of a three-operand form isn't read
+            if(writes && k == dst && dst != x) continue;
+            last[a->inst.opval[k]] = NONE;
+        }
+
+        if(!writes) {
+            if(a->inst.type == RVM_INST_CMP && plain(a)) continue;
+            for(int r = 0; r < 8; r ++) last[r] = NONE;
+            continue;
+        }
+        uint32_t r = a->inst.opval[dst];
+        if(last[r] != NONE) {
+            insts[last[r]].dead = 1;
+            stats->dead_writes ++;
+        }
+        last[r] = i;
+    }
+}
+
+// operands of arithmetic writing dst from x and, unless it's not, y (-1).
+static bool arith(const asm_inst *a, int *dst, int *x, int *y) {
+    uint8_t type = a->inst.type;
+    bool absent = a->inst.optype[type == RVM_INST_NOT ? 1 : 2]
+        == RVM_OP_ABSENT;
+    *x = 0;
+    if(type == RVM_INST_NOT) {
+        *dst = absent ? 0 : 1;
+        *y = -1;
+        return true;
+    }
+    if(type < RVM_INST_ADD || type > RVM_INST_SHR || type == RVM_INST_CMP)
+        return false;
+    *dst = absent ? 0 : 2;
+    *y = 1;
+    return true;
+}
+
+// only registers and constants: nothing that can fault, or that moves with
+// the layout.
+static bool plain(const asm_inst *a) {
+    if(a->labels) return false;
+    for(int i = 0; i < 3; i ++) {
+        uint8_t optype = a->inst.optype[i];
+        if(optype != RVM_OP_ABSENT && optype > RVM_OP_VALUE_REG) return false;
+    }
+    return true;
+}
+
+// as vm computes it; false for what vm leaves to the host, which might
+// differ or trap.
+static bool compute(uint8_t type, uint32_t x, uint32_t y, uint32_t *result) {
+    switch(type) {
+    case RVM_INST_ADD: *result = x + y; return true;
+    case RVM_INST_SUB: *result = x - y; return true;
+    case RVM_INST_MUL: *result = x * y; return true;
+    case RVM_INST_DIV:
+        if(!y) return false;
+        *result = x / y;
+        return true;
+    case RVM_INST_OR: *result = x | y; return true;
+    case RVM_INST_AND: *result = x & y; return true;
+    case RVM_INST_NOT: *result = ~x; return true;
+    case RVM_INST_XOR: *result = x ^ y; return true;
+    case RVM_INST_SHL:
+        if(y >= 32) return false;
+        *result = x << y;
+        return true;
+    case RVM_INST_SHR:
+        if(y >= 32) return false;
+        *result = x >> y;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_const(const asm_inst *a, int i) {
+    return a->inst.optype[i] == RVM_OP_VALUE_SCONST
+        && !(a->labels & (1 << i));
+}
+
+static bool is_reg(const asm_inst *a, int i) {
+    return a->inst.optype[i] == RVM_OP_VALUE_REG;
+}
+
+static void copy_operand(asm_inst *a, int i, const asm_inst *from, int j) {
+    a->inst.optype[i] = from->inst.optype[j];
+    a->inst.opval[i] = from->inst.opval[j];
+    a->value[i] = from->value[j];
+    a->consts = (a->consts & ~(1 << i)) | (((from->consts >> j) & 1) << i);
+    a->labels = (a->labels & ~(1 << i)) | (((from->labels >> j) & 1) << i);
+}
+
+static void set_const(asm_inst *a, int i, uint32_t value) {
+    a->inst.optype[i] = RVM_OP_VALUE_SCONST;
+    a->inst.opval[i] = 0;
+    a->value[i] = value;
+    a->consts |= 1 << i;
+    a->labels &= ~(1 << i);
+}
+
+// a becomes or <operand i of from> 0 <operand j of to>.
+static void set_move(asm_inst *a, const asm_inst *from, int i,
+    const asm_inst *to, int j) {
+
+    asm_inst move = *a;
+    move.inst.type = RVM_INST_OR;
+    move.consts = move.labels = 0;
+    copy_operand(&move, 0, from, i);
+    set_const(&move, 1, 0);
+    copy_operand(&move, 2, to, j);
+    *a = move;
+}
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// assembler throughput on a generated program the size of the ones that
+// outgrew the old fixed symbol tables: blocks of straight-line code, each
+// with a label branched back to and one branched forward to.
+
+#define LINES 1000000
+#define BLOCK 20 // lines per label
+
+extern char **environ;
+
+static uint32_t generate(FILE *out, uint32_t lines);
+static double now(void);
+
+int main(int argc, char *argv[]) {
+    uint32_t lines = LINES;
+    const char *assembler = "./asm";
+    if(argc > 1) lines = strtoul(argv[1], NULL, 0);
+    if(argc > 2) assembler = argv[2];
+
+    char source[] = "/tmp/rvm-asm-bench-XXXXXX";
+    int fd = mkstemp(source);
+    FILE *out = fd < 0 ? NULL : fdopen(fd, "w");
+    if(!out) {
+        printf("Couldn't create source file: %m\n");
+        return 1;
+    }
+    uint32_t labels = generate(out, lines);
+    if(fclose(out)) {
+        printf("Couldn't write source file: %m\n");
+        return 1;
+    }
+    char object[sizeof(source) + 2];
+    sprintf(object, "%s.o", source);
+
+    // the assembler's own report would only get in the way.
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    char *args[] = {(char *)assembler, source, object, NULL};
+
+    double start = now();
+    pid_t pid;
+    int status = 0;
+    int error = posix_spawn(&pid, assembler, &actions, NULL, args, environ);
+    if(!error && waitpid(pid, &status, 0) < 0) error = 1;
+    double elapsed = now() - start;
+    posix_spawn_file_actions_destroy(&actions);
+
+    unlink(source);
+    unlink(object);
+    if(error || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        printf("Couldn't assemble with \"%s\".\n", assembler);
+        return 1;
+    }
+    printf("%u lines, %u labels in %.3fs: %.2f M lines/s\n", lines, labels,
+        elapsed, lines / elapsed / 1e6);
+
+    return 0;
+}
+
+// writes lines lines of assembly, returning the number of labels.
+static uint32_t generate(FILE *out, uint32_t lines) {
+    uint32_t written = 0, block = 0;
+    fprintf(out, ":main\n");
+    written ++;
+    while(written + BLOCK < lines) {
+        fprintf(out, ";b%u\n", block + 1);
+        fprintf(out, ":b%u\n", block);
+        for(int i = 0; i < BLOCK - 6; i ++) {
+            fprintf(out, "\tadd r%d %u r%d\n", i % 7, (block + i) % 70000,
+                (i + 1) % 7);
+        }
+        fprintf(out, "\tcmp r7 1\n");
+        fprintf(out, "\tje :b%u\n", block);
+        fprintf(out, "\tjne :b%u\n", block + 1);
+        fprintf(out, "# block %u\n", block);
+        written += BLOCK;
+        block ++;
+    }
+    fprintf(out, ":b%u\n", block);
+    written ++;
+    while(written < lines - 1) {
+        fprintf(out, "\tadd r0 1\n");
+        written ++;
+    }
+    fprintf(out, "\thlt\n");
+    return block + 2;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common/inst.h"
+
+// decode and encode throughput of rvm_inst_to_struct/rvm_inst_from_struct,
+// against the divide/modulo decoder the operand table replaced.
+
+#define WORDS (1 << 16)
+#define ROUNDS 256
+
+static uint32_t words[WORDS];
+
+static void reference_to_struct(uint32_t encoded, rvm_inst *inst);
+static double now(void);
+
+int main(int argc, char *argv[]) {
+    int rounds = ROUNDS;
+    if(argc > 1) rounds = atoi(argv[1]);
+
+    // every optype field, with random type and operand bits.
+    uint32_t x = 0x9e3779b9;
+    for(uint32_t i = 0; i < WORDS; i ++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        words[i] = (x & ~(0x3ffu << (32-5-10)))
+            | ((i % RVM_OPTAB_SIZE) << (32-5-10));
+    }
+
+    for(uint32_t i = 0; i < WORDS; i ++) {
+        rvm_inst a, b;
+        memset(&a, 0, sizeof(a));
+        memset(&b, 0, sizeof(b));
+        rvm_inst_to_struct(words[i], &a);
+        reference_to_struct(words[i], &b);
+        if(memcmp(&a, &b, sizeof(a))) {
+            printf("Decoders disagree on %08x\n", words[i]);
+            return 1;
+        }
+    }
+
+    uint32_t sum = 0;
+    double start = now();
+    for(int r = 0; r < rounds; r ++) {
+        for(uint32_t i = 0; i < WORDS; i ++) {
+            rvm_inst inst;
+            reference_to_struct(words[i], &inst);
+            sum += inst.opval[0] + inst.optype[2];
+        }
+    }
+    double reference = now() - start;
+
+    start = now();
+    for(int r = 0; r < rounds; r ++) {
+        for(uint32_t i = 0; i < WORDS; i ++) {
+            rvm_inst inst;
+            rvm_inst_to_struct(words[i], &inst);
+            sum += inst.opval[0] + inst.optype[2];
+        }
+    }
+    double table = now() - start;
+
+    start = now();
+    for(int r = 0; r < rounds; r ++) {
+        for(uint32_t i = 0; i < WORDS; i ++) {
+            rvm_inst inst;
+            rvm_inst_to_struct(words[i], &inst);
+            sum += rvm_inst_from_struct(&inst);
+        }
+    }
+    double round_trip = now() - start;
+
+    double count = (double)rounds * WORDS;
+    printf("decode (divide/modulo): %.1f M/s\n", count / reference / 1e6);
+    printf("decode (table): %.1f M/s\n", count / table / 1e6);
+    printf("decode+encode (table): %.1f M/s\n", count / round_trip / 1e6);
+    printf("checksum: %08x\n", sum);
+
+    return 0;
+}
+
+// rvm_inst_to_struct as it was before the operand table.
+static void reference_to_struct(uint32_t encoded, rvm_inst *inst) {
+    uint8_t type = encoded >> (32-5);
+
+    inst->type = (rvm_inst_type)type;
+    uint16_t optypes = (encoded >> (32-5-10)) & 0x3ff;
+    inst->optype[0] = (rvm_op_type)(optypes % 10);
+    inst->optype[1] = (rvm_op_type)((optypes / 10) % 10);
+    inst->optype[2] = (rvm_op_type)((optypes / 10 / 10) % 10);
+
+    uint8_t reqbits = 0, sconsts = 0;
+    for(int i = 0; i < 3; i ++) {
+        if(inst->optype[i] % 3 == 0 && inst->optype[i] != RVM_OP_ABSENT) {
+            sconsts ++;
+        }
+        if(inst->optype[i] % 3 == 2) {
+            reqbits += 3;
+        }
+    }
+    uint8_t pers = 0;
+    if(sconsts > 0) pers = (17 - reqbits) / sconsts;
+
+    uint8_t offset = 0;
+    for(int i = 0; i < 3; i ++) {
+        inst->opval[i] = 0;
+        if(inst->optype[i] == RVM_OP_ABSENT) continue;
+
+        switch(inst->optype[i] % 3) {
+        case 0: // sconst
+            inst->opval[i] = (encoded >> offset) & ((1<<pers)-1);
+            offset += pers;
+        case 1: // lconst
+            break;
+        case 2: // reg
+            inst->opval[i] = (encoded >> offset) & 0x7;
+            offset += 3;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
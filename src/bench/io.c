@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// streams a large file through programs in bench/ on ./vm with host calls,
+// on each engine a number of times, each run a process of its own: once
+// with the input mapped into the heap, and once with the buffer moved off
+// its page, so every chunk is copied in. stream.s does next to nothing with
+// what it reads, so it's the host calls' own rate; checksum.s sums every
+// word, and its sums are checked against ones taken here, whose time is the
+// host's rate to compare with. The file is made if it isn't there at the
+// size asked for, and kept for the next run.
+
+#define RUNS 3
+#define SIZE ((uint64_t)4 << 30)
+#define CHUNK (1 << 20)
+
+typedef struct workload {
+    const char *name;
+    const char *what;
+} workload;
+
+static const workload workloads[] = {
+    {"stream", "the bytes read"},
+    {"checksum", "the sums"},
+};
+#define WORKLOADS (sizeof(workloads) / sizeof(*workloads))
+
+static const char *assembler = "./asm", *vm = "./vm", *dir = "bench";
+static char output[] = "/tmp/rvm-io-bench-XXXXXX";
+
+extern char **environ;
+
+static int bench(const workload *w, const char *object, const char *path,
+    uint64_t size, const char *engines, const char *modes, uint32_t runs,
+    const uint32_t *expected);
+static void make_input(const char *path, uint64_t size);
+static void checksum(const char *path, uint32_t *sums);
+static int run(char *const *args, double *time);
+static uint64_t parse_size(const char *arg);
+static double now(void);
+static void usage(const char *argv0);
+
+int main(int argc, char *argv[]) {
+    uint32_t runs = RUNS;
+    uint64_t size = SIZE;
+    const char *engines = "fused";
+    const char *modes = "map,copy";
+    const char *path = "/tmp/rvm-io-bench.dat";
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:s:f:e:m:d:a:v:")) != -1) {
+        switch(opt) {
+        case 'n':
+            runs = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            size = parse_size(optarg);
+            break;
+        case 'f':
+            path = optarg;
+            break;
+        case 'e':
+            engines = optarg;
+            break;
+        case 'm':
+            modes = optarg;
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'a':
+            assembler = optarg;
+            break;
+        case 'v':
+            vm = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind != argc || !runs || !size) usage(argv[0]);
+
+    int fd = mkstemp(output);
+    if(fd < 0) {
+        printf("Couldn't create output file: %m\n");
+        return 1;
+    }
+    close(fd);
+
+    make_input(path, size);
+    uint32_t expected[WORKLOADS][2] = {{size, size >> 32}};
+    double start = now();
+    checksum(path, expected[1]);
+    double time = now() - start;
+    printf("%llu bytes in \"%s\"; the host sums them at %.2f GB/s\n",
+        (unsigned long long)size, path, size / time / 1e9);
+
+    printf("%-8s %-8s %-5s %10s %10s %8s\n", "workload", "engine", "mode",
+        "mean (s)", "min (s)", "GB/s");
+    bool failed = false;
+    for(uint32_t w = 0; w < WORKLOADS; w ++) {
+        char source[1024], object[64];
+        snprintf(source, sizeof(source), "%s/%s.s", dir, workloads[w].name);
+        snprintf(object, sizeof(object), "%s.o", output);
+        char *asm_args[] = {(char *)assembler, source, object, NULL};
+        if(run(asm_args, &time)) {
+            printf("Couldn't assemble \"%s\".\n", source);
+            return 1;
+        }
+        if(bench(workloads + w, object, path, size, engines, modes, runs,
+            expected[w])) failed = true;
+        unlink(object);
+    }
+    unlink(output);
+    return failed ? 1 : 0;
+}
+
+// runs the assembled workload on each engine in each mode, returning
+// nonzero if any run wrote something other than expected.
+static int bench(const workload *w, const char *object, const char *path,
+    uint64_t size, const char *engines, const char *modes, uint32_t runs,
+    const uint32_t *expected) {
+
+    bool failed = false;
+    char engine_list[256];
+    snprintf(engine_list, sizeof(engine_list), "%s", engines);
+    char *engine_save;
+    for(char *engine = strtok_r(engine_list, ",", &engine_save); engine;
+        engine = strtok_r(NULL, ",", &engine_save)) {
+
+        char mode_list[64];
+        snprintf(mode_list, sizeof(mode_list), "%s", modes);
+        char *mode_save;
+        for(char *mode = strtok_r(mode_list, ",", &mode_save); mode;
+            mode = strtok_r(NULL, ",", &mode_save)) {
+
+            // r7 moves the program's buffer a word off its page.
+            const char *regs = strcmp(mode, "copy") ? "0,0,0,0,0,0,0,0"
+                : "0,0,0,0,0,0,0,1";
+            char *args[] = {(char *)vm, "-e", engine, "-r", (char *)regs,
+                "-I", (char *)path, "-O", output, (char *)object, NULL};
+            double sum = 0, min = 0;
+            for(uint32_t r = 0; r < runs; r ++) {
+                double time;
+                if(run(args, &time)) {
+                    printf("%s on %s failed.\n", w->name, engine);
+                    exit(1);
+                }
+                sum += time;
+                if(!r || time < min) min = time;
+
+                uint32_t got[2] = {0, 0};
+                FILE *in = fopen(output, "rb");
+                if(!in || fread(got, sizeof(got), 1, in) != 1
+                    || got[0] != expected[0] || got[1] != expected[1]) {
+
+                    printf("%s on %s %s: %s came out as %08x %08x, not "
+                        "%08x %08x.\n", w->name, engine, mode, w->what,
+                        got[0], got[1], expected[0], expected[1]);
+                    failed = true;
+                }
+                if(in) fclose(in);
+            }
+            printf("%-8s %-8s %-5s %10.3f %10.3f %8.2f\n", w->name, engine,
+                mode, sum / runs, min, size / min / 1e9);
+        }
+    }
+    return failed;
+}
+
+// path as size bytes of pseudo-random data, unless it already is that size.
+static void make_input(const char *path, uint64_t size) {
+    struct stat st;
+    if(!stat(path, &st) && (uint64_t)st.st_size == size) return;
+
+    printf("Writing %llu bytes to \"%s\"...\n", (unsigned long long)size,
+        path);
+    FILE *out = fopen(path, "wb");
+    uint64_t *chunk = malloc(CHUNK);
+    if(!out || !chunk) {
+        printf("Couldn't write \"%s\": %m\n", path);
+        exit(1);
+    }
+    uint64_t x = 88172645463325252ull;
+    for(uint64_t done = 0; done < size; done += CHUNK) {
+        for(uint32_t i = 0; i < CHUNK / 8; i ++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            chunk[i] = x;
+        }
+        size_t length = size - done < CHUNK ? size - done : CHUNK;
+        if(fwrite(chunk, 1, length, out) != length) {
+            printf("Couldn't write \"%s\": %m\n", path);
+            exit(1);
+        }
+    }
+    free(chunk);
+    if(fclose(out)) {
+        printf("Couldn't write \"%s\": %m\n", path);
+        exit(1);
+    }
+}
+
+// the sums bench/checksum.s takes: of the file's words, and of those sums,
+// a partial last word padded with zeroes.
+static void checksum(const char *path, uint32_t *sums) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st)) {
+        printf("Cannot open file \"%s\": %m\n", path);
+        exit(1);
+    }
+    uint64_t size = st.st_size;
+    const uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED) {
+        printf("Failed to map \"%s\": %m\n", path);
+        exit(1);
+    }
+    close(fd);
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    uint32_t a = 0, b = 0;
+    const uint32_t *words = (const uint32_t *)data;
+    for(uint64_t i = 0; i < size / 4; i ++) {
+        a += words[i];
+        b += a;
+    }
+    if(size & 3) {
+        uint32_t last = 0;
+        memcpy(&last, data + (size & ~(uint64_t)3), size & 3);
+        a += last;
+        b += a;
+    }
+    munmap((void *)data, size);
+    sums[0] = a;
+    sums[1] = b;
+}
+
+// runs args to completion with stdout thrown away, returning nonzero if it
+// couldn't be run or failed; time is its wall time.
+static int run(char *const *args, double *time) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+
+    double start = now();
+    pid_t pid;
+    int status = 0;
+    int error = posix_spawn(&pid, args[0], &actions, NULL, args, environ);
+    if(!error && waitpid(pid, &status, 0) < 0) error = 1;
+    *time = now() - start;
+    posix_spawn_file_actions_destroy(&actions);
+    return error || !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+static uint64_t parse_size(const char *arg) {
+    char *end;
+    uint64_t size = strtoull(arg, &end, 0);
+    switch(*end) {
+    case 'k': case 'K': size <<= 10; end ++; break;
+    case 'm': case 'M': size <<= 20; end ++; break;
+    case 'g': case 'G': size <<= 30; end ++; break;
+    }
+    if(end == arg || *end) {
+        printf("Unknown size \"%s\"\n", arg);
+        exit(1);
+    }
+    return size;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *argv0) {
+    printf("Usage: %s [-n runs] [-s size] [-f file] [-e engine,...] "
+        "[-m map,copy] [-d workloads] [-a asm] [-v vm]\n", argv0);
+    exit(1);
+}
@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// the workloads in bench/, assembled with ./asm with and without -O and run
+// on each of ./vm's engines a number of times, each run a process of its
+// own. Instruction counts come from profiling each program once, which also
+// gives the result every engine has to agree with.
+//
+// Results come out as a table, and with -o as tab-separated lines
+//
+//     workload mode engine instructions runs mean ci95 min mips rss
+//
+// after a "# vm-bench 1" line, times in seconds and peak RSS in KiB. Given
+// one of those files with -c, a mean more than the threshold slower than
+// it, and by more than the two intervals together, fails the run.
+
+#define RUNS 5
+#define THRESHOLD 5.0 // percent
+#define FORMAT "# vm-bench 1"
+#define MAX_RESULTS 256
+
+typedef struct workload {
+    const char *name;
+    const char *what;
+} workload;
+
+static const workload workloads[] = {
+    {"recursion", "calls and returns"},
+    {"loop", "arithmetic in one loop"},
+    {"heap", "alloc, free and heap derefs"},
+    {"stack", "deep pushes and pops"},
+    {"branch", "unpredictable branches"},
+};
+#define WORKLOADS (sizeof(workloads) / sizeof(*workloads))
+
+static const char *modes[] = {"plain", "opt"};
+
+typedef struct result {
+    char workload[32], mode[16], engine[16];
+    uint64_t instructions;
+    uint32_t runs;
+    double mean, ci, min; // wall time
+    long rss; // peak, in KiB
+} result;
+
+static const char *assembler = "./asm", *vm = "./vm", *dir = "bench";
+static char output[] = "/tmp/rvm-vm-bench-XXXXXX";
+
+extern char **environ;
+
+static int run(char *const *args, double *time, long *rss);
+static char *read_output(void);
+static const char *cpu_state(const char *out);
+static double t95(uint32_t n);
+static uint32_t parse_results(const char *path, result *results);
+static void usage(const char *argv0);
+
+int main(int argc, char *argv[]) {
+    uint32_t runs = RUNS;
+    double threshold = THRESHOLD;
+    const char *engines = "switch,threaded,fused,jit,tiered";
+    const char *out_path = NULL, *baseline_path = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:e:d:a:v:o:c:t:")) != -1) {
+        switch(opt) {
+        case 'n':
+            runs = strtoul(optarg, NULL, 0);
+            break;
+        case 'e':
+            engines = optarg;
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'a':
+            assembler = optarg;
+            break;
+        case 'v':
+            vm = optarg;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'c':
+            baseline_path = optarg;
+            break;
+        case 't':
+            threshold = strtod(optarg, NULL);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind != argc || runs < 2) usage(argv[0]);
+
+    int fd = mkstemp(output);
+    if(fd < 0) {
+        printf("Couldn't create output file: %m\n");
+        return 1;
+    }
+    close(fd);
+
+    result *results = calloc(MAX_RESULTS, sizeof(result));
+    if(!results) {
+        printf("Couldn't allocate results.\n");
+        return 1;
+    }
+    uint32_t count = 0;
+    bool failed = false;
+
+    printf("%-10s %-5s %-8s %12s %10s %9s %10s %9s %8s\n", "workload",
+        "mode", "engine", "instructions", "mean (s)", "+-95%", "min (s)",
+        "MIPS", "RSS KiB");
+    for(uint32_t w = 0; w < WORKLOADS; w ++) {
+        for(uint32_t m = 0; m < sizeof(modes) / sizeof(*modes); m ++) {
+            char source[1024], object[64];
+            snprintf(source, sizeof(source), "%s/%s.s", dir,
+                workloads[w].name);
+            snprintf(object, sizeof(object), "%s.%s.o", output, modes[m]);
+            char *asm_args[] = {(char *)assembler, source, object, NULL};
+            char *asm_opt_args[] = {(char *)assembler, "-O", source, object,
+                NULL};
+            double time;
+            long rss;
+            if(run(m ? asm_opt_args : asm_args, &time, &rss)) {
+                printf("Couldn't assemble \"%s\".\n", source);
+                return 1;
+            }
+
+            // the instruction count, and the state every engine must end
+            // in, from rvm_step.
+            char *profile_args[] = {(char *)vm, "-p", "/dev/null", "-i",
+                "1000000", object, NULL};
+            char *expected = NULL;
+            uint64_t instructions = 0;
+            if(!run(profile_args, &time, &rss)) {
+                expected = read_output();
+                const char *p = strstr(expected, "Profile report:\n\t");
+                if(p) instructions = strtoull(p + 17, NULL, 10);
+            }
+            if(!instructions) {
+                printf("Couldn't count instructions in \"%s\".\n", source);
+                return 1;
+            }
+
+            char list[256];
+            snprintf(list, sizeof(list), "%s", engines);
+            for(char *engine = strtok(list, ","); engine;
+                engine = strtok(NULL, ",")) {
+
+                char *args[] = {(char *)vm, "-e", engine, object, NULL};
+                double *times = calloc(runs, sizeof(double));
+                if(!times) {
+                    printf("Couldn't allocate times.\n");
+                    return 1;
+                }
+                long peak = 0;
+                for(uint32_t r = 0; r < runs; r ++) {
+                    if(run(args, times + r, &rss)) {
+                        printf("%s on %s failed.\n", source, engine);
+                        return 1;
+                    }
+                    if(rss > peak) peak = rss;
+                    char *got = read_output();
+                    if(strcmp(cpu_state(got), cpu_state(expected))) {
+                        printf("%s on %s ended in another state:\n%s",
+                            source, engine, cpu_state(got));
+                        failed = true;
+                    }
+                    free(got);
+                }
+
+                double sum = 0, min = times[0];
+                for(uint32_t r = 0; r < runs; r ++) {
+                    sum += times[r];
+                    if(times[r] < min) min = times[r];
+                }
+                double mean = sum / runs, var = 0;
+                for(uint32_t r = 0; r < runs; r ++)
+                    var += (times[r] - mean) * (times[r] - mean);
+                double ci = t95(runs) * sqrt(var / (runs - 1) / runs);
+                free(times);
+
+                if(count == MAX_RESULTS) {
+                    printf("Too many results.\n");
+                    return 1;
+                }
+                result *res = results + count ++;
+                snprintf(res->workload, sizeof(res->workload), "%s",
+                    workloads[w].name);
+                snprintf(res->mode, sizeof(res->mode), "%s", modes[m]);
+                snprintf(res->engine, sizeof(res->engine), "%s", engine);
+                res->instructions = instructions;
+                res->runs = runs;
+                res->mean = mean;
+                res->ci = ci;
+                res->min = min;
+                res->rss = peak;
+                printf("%-10s %-5s %-8s %12llu %10.4f %9.4f %10.4f %9.1f "
+                    "%8ld\n", res->workload, res->mode, res->engine,
+                    (unsigned long long)instructions, mean, ci, min,
+                    instructions / mean / 1e6, peak);
+            }
+            free(expected);
+            unlink(object);
+        }
+    }
+    unlink(output);
+
+    if(out_path) {
+        FILE *out = fopen(out_path, "w");
+        if(!out) {
+            printf("Couldn't write \"%s\": %m\n", out_path);
+            return 1;
+        }
+        fprintf(out, "%s\n", FORMAT);
+        for(uint32_t i = 0; i < count; i ++) {
+            const result *r = results + i;
+            fprintf(out, "%s\t%s\t%s\t%llu\t%u\t%.6f\t%.6f\t%.6f\t%.3f\t%ld\n",
+                r->workload, r->mode, r->engine,
+                (unsigned long long)r->instructions, r->runs, r->mean, r->ci,
+                r->min, r->instructions / r->mean / 1e6, r->rss);
+        }
+        if(fclose(out)) {
+            printf("Couldn't write \"%s\": %m\n", out_path);
+            return 1;
+        }
+    }
+
+    if(baseline_path) {
+        result *baseline = calloc(MAX_RESULTS, sizeof(result));
+        if(!baseline) {
+            printf("Couldn't allocate results.\n");
+            return 1;
+        }
+        uint32_t baseline_count = parse_results(baseline_path, baseline);
+        uint32_t regressions = 0;
+        for(uint32_t i = 0; i < count; i ++) {
+            const result *r = results + i;
+            for(uint32_t j = 0; j < baseline_count; j ++) {
+                const result *b = baseline + j;
+                if(strcmp(r->workload, b->workload) || strcmp(r->mode, b->mode)
+                    || strcmp(r->engine, b->engine)) continue;
+                // slower by the threshold, and by more than noise explains
+                if(r->mean > b->mean * (1 + threshold / 100)
+                    && r->mean - b->mean > r->ci + b->ci) {
+
+                    printf("Regression: %s %s %s: %.4fs, was %.4fs "
+                        "(+%.1f%%)\n", r->workload, r->mode, r->engine,
+                        r->mean, b->mean, (r->mean / b->mean - 1) * 100);
+                    regressions ++;
+                }
+            }
+        }
+        free(baseline);
+        printf("%u regressions over %.1f%% against \"%s\"\n", regressions,
+            threshold, baseline_path);
+        if(regressions) failed = true;
+    }
+    free(results);
+
+    return failed ? 1 : 0;
+}
+
+// runs args to completion with stdout in output, returning nonzero if it
+// couldn't be run or failed; time is its wall time, rss its peak RSS.
+static int run(char *const *args, double *time, long *rss) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, output,
+        O_WRONLY | O_TRUNC, 0);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid;
+    int status = 0;
+    struct rusage usage;
+    int error = posix_spawn(&pid, args[0], &actions, NULL, args, environ);
+    if(!error && wait4(pid, &status, 0, &usage) < 0) error = 1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    posix_spawn_file_actions_destroy(&actions);
+
+    *time = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+    *rss = error ? 0 : usage.ru_maxrss;
+    return error || !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+// what the last run printed.
+static char *read_output(void) {
+    FILE *in = fopen(output, "r");
+    if(!in) {
+        printf("Couldn't read output: %m\n");
+        exit(1);
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    rewind(in);
+    char *text = malloc(size + 1);
+    if(!text) {
+        printf("Couldn't allocate output.\n");
+        exit(1);
+    }
+    text[fread(text, 1, size, in)] = 0;
+    fclose(in);
+    return text;
+}
+
+// the final state dump in vm's output, or "" if there's none.
+static const char *cpu_state(const char *out) {
+    const char *state = strstr(out, "\tCPU state:\n");
+    return state ? state : "";
+}
+
+// two-sided 95% Student's t for the mean of n samples.
+static double t95(uint32_t n) {
+    static const double t[] = {
+        0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+        2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+        2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045,
+        2.042,
+    };
+    uint32_t df = n - 1;
+    return df < sizeof(t) / sizeof(*t) ? t[df] : 1.960;
+}
+
+// reads a file -o wrote into results, returning how many there were.
+static uint32_t parse_results(const char *path, result *results) {
+    FILE *in = fopen(path, "r");
+    if(!in) {
+        printf("Couldn't read \"%s\": %m\n", path);
+        exit(1);
+    }
+    char line[512];
+    if(!fgets(line, sizeof(line), in) || strncmp(line, FORMAT,
+        strlen(FORMAT))) {
+
+        printf("\"%s\" isn't vm-bench output.\n", path);
+        exit(1);
+    }
+    uint32_t count = 0;
+    while(count < MAX_RESULTS && fgets(line, sizeof(line), in)) {
+        result *r = results + count;
+        unsigned long long instructions;
+        double mips;
+        if(sscanf(line, "%31s %15s %15s %llu %u %lf %lf %lf %lf %ld",
+            r->workload, r->mode, r->engine, &instructions, &r->runs,
+            &r->mean, &r->ci, &r->min, &mips, &r->rss) != 10) continue;
+        r->instructions = instructions;
+        count ++;
+    }
+    fclose(in);
+    return count;
+}
+
+static void usage(const char *argv0) {
+    printf("Usage: %s [-n runs] [-e engine,...] [-d workloads] [-a asm] "
+        "[-v vm] [-o results] [-c baseline] [-t threshold%%]\n", argv0);
+    exit(1);
+}
@@ -0,0 +1,207 @@
+#ifndef RVM_COMMON_ALLOC_H
+#define RVM_COMMON_ALLOC_H
+
+// heap allocator behind alloc and free, working in words of the guest heap.
+// Self-contained, so that the AOT translator can paste it into its output
+// and allocate exactly like the VM.
+//
+// Every block starts with a header word, and the address handed out is the
+// word after it; word 0 is the first header, so 0 is never a valid address.
+// Small blocks are rounded up to a size class and recycled through a free
+// list per class, never merged. Large blocks are merged with free large
+// neighbours through boundary tags, and given back to the unallocated top of
+// the heap when they end up touching it.
+
+#include <stdint.h>
+
+// header: block size in words, including the header, above three flags
+#define RVM_ALLOC_USED 1
+#define RVM_ALLOC_SMALL 2
+#define RVM_ALLOC_PREV_FREE 4 // the previous block is a free large block
+#define RVM_ALLOC_SIZE(header) ((header) >> 3)
+#define RVM_ALLOC_MAX_BLOCK ((uint32_t)1 << 29)
+
+#define RVM_ALLOC_CLASSES 16
+// largest small payload, in words; anything bigger is a large block, which
+// also leaves room for the free list links and footer.
+#define RVM_ALLOC_SMALL_MAX 256
+
+typedef struct rvm_alloc {
+    uint32_t *words;
+    uint32_t limit; // words available
+    uint32_t top; // first word never handed out
+
+    uint32_t small[RVM_ALLOC_CLASSES]; // free small blocks, by class
+    uint32_t large; // free large blocks, doubly linked
+
+    // stats
+    uint64_t allocs, frees;
+    uint32_t live; // words in allocated payloads
+    uint32_t high_water; // highest top
+} rvm_alloc;
+
+static const uint32_t rvm_alloc_class_sizes[RVM_ALLOC_CLASSES] = {
+    1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256
+};
+
+static inline void rvm_alloc_init(rvm_alloc *a, uint32_t *words,
+    uint32_t limit) {
+
+    a->words = words;
+    a->limit = limit;
+    a->top = 0;
+    for(int c = 0; c < RVM_ALLOC_CLASSES; c ++) a->small[c] = 0;
+    a->large = 0;
+    a->allocs = a->frees = 0;
+    a->live = a->high_water = 0;
+}
+
+// carves a block of size words off the top and returns its address, or 0
+// if it doesn't fit.
+static inline uint32_t rvm_alloc_carve(rvm_alloc *a, uint32_t size,
+    uint32_t flags) {
+
+    if(size > a->limit - a->top) return 0;
+    uint32_t block = a->top;
+    a->top += size;
+    if(a->top > a->high_water) a->high_water = a->top;
+    a->words[block] = (size << 3) | flags;
+    return block + 1;
+}
+
+// large free list; links live in the first two payload words.
+static inline void rvm_alloc_link(rvm_alloc *a, uint32_t block) {
+    a->words[block + 1] = a->large;
+    a->words[block + 2] = 0;
+    if(a->large) a->words[a->large + 2] = block;
+    a->large = block;
+}
+
+static inline void rvm_alloc_unlink(rvm_alloc *a, uint32_t block) {
+    uint32_t next = a->words[block + 1], prev = a->words[block + 2];
+    if(prev) a->words[prev + 1] = next;
+    else a->large = next;
+    if(next) a->words[next + 2] = prev;
+}
+
+// returns the address of a block of at least size words, or 0 if the heap
+// is out of room.
+static inline uint32_t rvm_alloc_block(rvm_alloc *a, uint32_t size) {
+    if(size <= RVM_ALLOC_SMALL_MAX) {
+        int c = 0;
+        while(rvm_alloc_class_sizes[c] < size) c ++;
+        uint32_t payload = rvm_alloc_class_sizes[c];
+
+        uint32_t address, block = a->small[c];
+        if(block) {
+            a->small[c] = a->words[block + 1];
+            a->words[block] |= RVM_ALLOC_USED;
+            address = block + 1;
+        }
+        else {
+            address = rvm_alloc_carve(a, payload + 1,
+                RVM_ALLOC_USED | RVM_ALLOC_SMALL);
+            if(!address) return 0;
+        }
+        a->allocs ++;
+        a->live += payload;
+        return address;
+    }
+
+    if(size >= RVM_ALLOC_MAX_BLOCK) return 0;
+    uint32_t need = size + 1;
+
+    // first fit
+    for(uint32_t block = a->large; block; block = a->words[block + 1]) {
+        uint32_t header = a->words[block];
+        uint32_t have = RVM_ALLOC_SIZE(header);
+        if(have < need) continue;
+
+        rvm_alloc_unlink(a, block);
+        uint32_t next = block + have;
+        if(have - need >= RVM_ALLOC_SMALL_MAX + 2) {
+            // split, keeping the tail free.
+            uint32_t rest = block + need, rest_size = have - need;
+            a->words[rest] = rest_size << 3;
+            a->words[rest + rest_size - 1] = rest_size;
+            rvm_alloc_link(a, rest);
+            have = need;
+        }
+        else if(next < a->top) a->words[next] &= ~RVM_ALLOC_PREV_FREE;
+
+        a->words[block] = (have << 3) | RVM_ALLOC_USED;
+        a->allocs ++;
+        a->live += have - 1;
+        return block + 1;
+    }
+
+    uint32_t address = rvm_alloc_carve(a, need, RVM_ALLOC_USED);
+    if(!address) return 0;
+    a->allocs ++;
+    a->live += size;
+    return address;
+}
+
+// returns nonzero if address isn't that of an allocated block.
+static inline int rvm_alloc_free(rvm_alloc *a, uint32_t address) {
+    uint32_t block = address - 1;
+    if(address == 0 || address > a->top
+        || !(a->words[block] & RVM_ALLOC_USED)) return 1;
+
+    // the guest can write headers, so one has to describe a block that
+    // could be there before anything is taken from it.
+    uint32_t header = a->words[block];
+    uint32_t size = RVM_ALLOC_SIZE(header);
+    int c = 0;
+    if(header & RVM_ALLOC_SMALL) {
+        while(c < RVM_ALLOC_CLASSES && rvm_alloc_class_sizes[c] + 1 != size)
+            c ++;
+        if(c == RVM_ALLOC_CLASSES) return 1;
+    }
+    else {
+        if(size < RVM_ALLOC_SMALL_MAX + 2 || size > a->top - block) return 1;
+        if(header & RVM_ALLOC_PREV_FREE) {
+            uint32_t prev_size = block ? a->words[block - 1] : 0;
+            if(prev_size < RVM_ALLOC_SMALL_MAX + 2 || prev_size > block
+                || a->words[block - prev_size] != prev_size << 3) return 1;
+        }
+    }
+    a->frees ++;
+    a->live -= size - 1;
+
+    if(header & RVM_ALLOC_SMALL) {
+        a->words[block] = header & ~RVM_ALLOC_USED;
+        a->words[block + 1] = a->small[c];
+        a->small[c] = block;
+        return 0;
+    }
+
+    // merge with free large neighbours.
+    uint32_t next = block + size;
+    if(next < a->top) {
+        uint32_t next_header = a->words[next];
+        if(!(next_header & (RVM_ALLOC_USED | RVM_ALLOC_SMALL))) {
+            rvm_alloc_unlink(a, next);
+            size += RVM_ALLOC_SIZE(next_header);
+        }
+    }
+    if(header & RVM_ALLOC_PREV_FREE) {
+        uint32_t prev_size = a->words[block - 1];
+        block -= prev_size;
+        size += prev_size;
+        rvm_alloc_unlink(a, block);
+    }
+
+    next = block + size;
+    if(next == a->top) {
+        a->top = block;
+        return 0;
+    }
+    a->words[block] = size << 3;
+    a->words[next - 1] = size;
+    a->words[next] |= RVM_ALLOC_PREV_FREE;
+    rvm_alloc_link(a, block);
+    return 0;
+}
+
+#endif
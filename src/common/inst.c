@@ -38,91 +38,35 @@ const char *rvm_inst_type_strings[] = {
 static int is_const(uint16_t optype);
 
 uint32_t rvm_inst_from_struct(rvm_inst *inst) {
+    uint16_t optypes = inst->optype[0] + inst->optype[1] * 10
+        + inst->optype[2] * 100;
+    const rvm_optab_entry *layout = rvm_optab + optypes;
+
     uint32_t result = 0;
     result |= (uint32_t)(inst->type) << (32-5);
-
-    uint16_t optypes = 0;
-    optypes += inst->optype[2];
-    optypes *= 10;
-    optypes += inst->optype[1];
-    optypes *= 10;
-    optypes += inst->optype[0];
-
     result |= (uint32_t)(optypes) << (32-5-10);
 
-    uint8_t reqbits = 0, sconsts = 0;
-    for(int i = 0; i < 3; i ++) {
-        if(inst->optype[i] % 3 == 0 && inst->optype[i] != RVM_OP_ABSENT) {
-            sconsts ++;
-        }
-        if(inst->optype[i] % 3 == 2) {
-            reqbits += 3;
-        }
-    }
-    uint8_t pers = 0;
-    if(sconsts > 0) pers = (17 - reqbits) / sconsts;
-
-    uint8_t offset = 0;
     for(int i = 0; i < 3; i ++) {
-        if(inst->optype[i] == RVM_OP_ABSENT) continue;
-        switch(inst->optype[i] % 3) {
-        case 0: // sconst
-            result |= ((uint32_t)(inst->opval[i])) << offset;
-            offset += pers;
-            break;
-        case 1: // lconst
-            break;
-        case 2: // reg
-            result |= ((uint32_t)(inst->opval[i]) << offset);
-            offset += 3;
-            break;
-        default:
-            break;
-        }
+        if(!layout->mask[i]) continue;
+        result |= (uint32_t)(inst->opval[i]) << layout->shift[i];
     }
 
     return result;
 }
 
 void rvm_inst_to_struct(uint32_t encoded, rvm_inst *inst) {
-    uint8_t type = encoded >> (32-5);
+    const rvm_optab_entry *layout =
+        rvm_optab + ((encoded >> (32-5-10)) & 0x3ff);
 
-    inst->type = (rvm_inst_type)type;
-    uint16_t optypes = (encoded >> (32-5-10)) & 0x3ff;
-    inst->optype[0] = (rvm_op_type)(optypes % 10);
-    inst->optype[1] = (rvm_op_type)((optypes / 10) % 10);
-    inst->optype[2] = (rvm_op_type)((optypes / 10 / 10) % 10);
-
-    uint8_t reqbits = 0, sconsts = 0;
+    inst->type = (rvm_inst_type)(encoded >> (32-5));
     for(int i = 0; i < 3; i ++) {
-        if(inst->optype[i] % 3 == 0 && inst->optype[i] != RVM_OP_ABSENT) {
-            sconsts ++;
-        }
-        if(inst->optype[i] % 3 == 2) {
-            reqbits += 3;
-        }
+        inst->optype[i] = (rvm_op_type)layout->optype[i];
+        inst->opval[i] = (encoded >> layout->shift[i]) & layout->mask[i];
     }
-    uint8_t pers = 0;
-    if(sconsts > 0) pers = (17 - reqbits) / sconsts;
-
-    uint8_t offset = 0;
-    for(int i = 0; i < 3; i ++) {
-        if(inst->optype[i] == RVM_OP_ABSENT) continue;
+}
 
-        switch(inst->optype[i] % 3) {
-        case 0: // sconst
-            inst->opval[i] = (encoded >> offset) & ((1<<pers)-1);
-            offset += pers;
-        case 1: // lconst
-            break;
-        case 2: // reg
-            inst->opval[i] = (encoded >> offset) & 0x7;
-            offset += 3;
-            break;
-        default:
-            break;
-        }
-    }
+uint8_t rvm_inst_length(uint32_t encoded) {
+    return rvm_optab[(encoded >> (32-5-10)) & 0x3ff].length;
 }
 
 static int is_present(uint16_t optype) {
@@ -200,7 +144,31 @@ int rvm_inst_check_valid(rvm_inst *inst) {
         if(!is_present(op1) || !is_present(op2) || is_present(op3)) return 1;
         if(is_const(op1) || is_const(op2)) return 1;
         return 0;
-    default: // expansions are all rendered invalid by this
+    // host calls; see doc/hostcalls. read: buffer, words, and where the
+    // bytes read go.
+    case RVM_INST_EXP0:
+        if(!is_present(op1) || !is_present(op2) || !is_present(op3)) return 1;
+        if(is_const(op3)) return 1;
+        return 0;
+    // write: buffer and bytes.
+    case RVM_INST_EXP1:
+        if(!is_present(op1) || !is_present(op2) || is_present(op3)) return 1;
+        return 0;
+    // flush: no operands.
+    case RVM_INST_EXP2:
+        if(is_present(op1) || is_present(op2) || is_present(op3)) return 1;
+        return 0;
+    // skip: bytes, and where the bytes skipped go.
+    case RVM_INST_EXP3:
+        if(!is_present(op1) || !is_present(op2) || is_present(op3)) return 1;
+        if(is_const(op2)) return 1;
+        return 0;
+    // tell: where the low and high words of the bytes consumed go.
+    case RVM_INST_EXP4:
+        if(!is_present(op1) || !is_present(op2) || is_present(op3)) return 1;
+        if(is_const(op1) || is_const(op2)) return 1;
+        return 0;
+    default:
         return 0;
     }
 }
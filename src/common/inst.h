@@ -58,11 +58,27 @@ typedef enum rvm_op_type {
 typedef struct rvm_inst {
     rvm_inst_type type;
     rvm_op_type optype[3];
-    uint16_t opval[3];
+    uint32_t opval[3];
 } rvm_inst;
 
+// operand layout for each value of the 10-bit optype field; generated at
+// build time by src/gen/optab.c.
+#define RVM_OPTAB_SIZE 1024
+
+typedef struct rvm_optab_entry {
+    uint8_t optype[3];
+    uint8_t shift[3]; // bit offset of each sconst or register operand
+    uint32_t mask[3]; // 0 for lconst and absent operands
+    uint8_t lconsts; // number of following lconst words
+    uint8_t length; // in words, including the lconsts
+} rvm_optab_entry;
+
+extern const rvm_optab_entry rvm_optab[RVM_OPTAB_SIZE];
+
 uint32_t rvm_inst_from_struct(rvm_inst *inst);
 void rvm_inst_to_struct(uint32_t encoded, rvm_inst *inst);
+// length in words of the instruction starting with encoded.
+uint8_t rvm_inst_length(uint32_t encoded);
 
 int rvm_inst_check_valid(rvm_inst *inst);
 
@@ -0,0 +1,136 @@
+#include <string.h>
+#include <stdbool.h>
+
+#include "object.h"
+
+static int write_padding(FILE *out, uint64_t *written, uint64_t to);
+
+int rvm_object_parse(const void *data, size_t size, rvm_object *obj) {
+    memset(obj, 0, sizeof(*obj));
+    const rvm_object_header *h = data;
+    if(size < sizeof(uint32_t) || h->magic != RVM_OBJECT_MAGIC) {
+        if(size % 4 != 0 || size / 4 > UINT32_MAX) return RVM_OBJECT_SIZE;
+        obj->code = data;
+        obj->size = size / 4;
+        return RVM_OBJECT_OK;
+    }
+
+    if(size < sizeof(*h) || h->version == 0) return RVM_OBJECT_FORMAT;
+    if(h->version > RVM_OBJECT_VERSION) return RVM_OBJECT_VERSION_MISMATCH;
+    if(h->section_count > RVM_OBJECT_MAX_SECTIONS) return RVM_OBJECT_FORMAT;
+
+    bool have_code = false;
+    for(uint32_t i = 0; i < h->section_count; i ++) {
+        const rvm_section *s = h->sections + i;
+        if(s->offset > size || s->size > size - s->offset)
+            return RVM_OBJECT_FORMAT;
+        const uint8_t *contents = (const uint8_t *)data + s->offset;
+
+        switch(s->type) {
+        case RVM_SECTION_CODE:
+            if(s->offset % 4 || s->size % 4 || s->size / 4 > UINT32_MAX)
+                return RVM_OBJECT_SIZE;
+            obj->code = (const uint32_t *)contents;
+            obj->size = s->size / 4;
+            have_code = true;
+            break;
+        case RVM_SECTION_SYMBOLS: {
+            if(s->offset % 4 || s->size < 4) return RVM_OBJECT_FORMAT;
+            uint32_t count = *(const uint32_t *)contents;
+            if(count > (s->size - 4) / sizeof(rvm_symbol))
+                return RVM_OBJECT_FORMAT;
+            obj->symbols = (const rvm_symbol *)(contents + 4);
+            obj->symbol_count = count;
+            obj->names = (const char *)(obj->symbols + count);
+            obj->names_size = s->size - 4 - count * sizeof(rvm_symbol);
+            break;
+        }
+        case RVM_SECTION_CACHE:
+            obj->cache = contents;
+            obj->cache_size = s->size;
+            break;
+        default:
+            // left for whoever knows what it is.
+            break;
+        }
+    }
+    if(!have_code || h->entry > obj->size) return RVM_OBJECT_FORMAT;
+    obj->entry = h->entry;
+    return RVM_OBJECT_OK;
+}
+
+const char *rvm_object_symbol_name(const rvm_object *obj, uint32_t i) {
+    uint32_t name = obj->symbols[i].name;
+    if(name >= obj->names_size) return NULL;
+    if(!memchr(obj->names + name, 0, obj->names_size - name)) return NULL;
+    return obj->names + name;
+}
+
+int rvm_object_write(FILE *out, const rvm_object *obj) {
+    rvm_object_header h;
+    memset(&h, 0, sizeof(h));
+    h.magic = RVM_OBJECT_MAGIC;
+    h.version = RVM_OBJECT_VERSION;
+    h.entry = obj->entry;
+
+    uint64_t sizes[] = {
+        (uint64_t)obj->size * 4,
+        obj->symbol_count ? 4 + obj->symbol_count * sizeof(rvm_symbol)
+            + obj->names_size : 0,
+        obj->cache ? obj->cache_size : 0,
+    };
+    static const uint32_t types[] = {
+        RVM_SECTION_CODE, RVM_SECTION_SYMBOLS, RVM_SECTION_CACHE
+    };
+    uint64_t offset = RVM_OBJECT_PAGE;
+    for(int i = 0; i < 3; i ++) {
+        if(i > 0 && !sizes[i]) continue;
+        rvm_section *s = h.sections + h.section_count ++;
+        s->type = types[i];
+        s->offset = offset;
+        s->size = sizes[i];
+        offset += (sizes[i] + RVM_OBJECT_PAGE - 1) / RVM_OBJECT_PAGE
+            * RVM_OBJECT_PAGE;
+    }
+
+    uint64_t written = sizeof(h);
+    if(fwrite(&h, sizeof(h), 1, out) != 1) return 1;
+    for(uint32_t i = 0; i < h.section_count; i ++) {
+        const rvm_section *s = h.sections + i;
+        if(write_padding(out, &written, s->offset)) return 1;
+
+        size_t ok = 1;
+        switch(s->type) {
+        case RVM_SECTION_CODE:
+            if(obj->size)
+                ok = fwrite(obj->code, 4, obj->size, out) == obj->size;
+            break;
+        case RVM_SECTION_SYMBOLS:
+            ok = fwrite(&obj->symbol_count, 4, 1, out) == 1
+                && fwrite(obj->symbols, sizeof(rvm_symbol),
+                    obj->symbol_count, out) == obj->symbol_count
+                && fwrite(obj->names, 1, obj->names_size, out)
+                    == obj->names_size;
+            break;
+        case RVM_SECTION_CACHE:
+            ok = fwrite(obj->cache, 1, obj->cache_size, out)
+                == obj->cache_size;
+            break;
+        }
+        if(!ok) return 1;
+        written += s->size;
+    }
+    return 0;
+}
+
+// zeroes up to offset to, so the next section starts on its page.
+static int write_padding(FILE *out, uint64_t *written, uint64_t to) {
+    static const uint8_t zeroes[RVM_OBJECT_PAGE];
+    while(*written < to) {
+        uint64_t n = to - *written;
+        if(n > sizeof(zeroes)) n = sizeof(zeroes);
+        if(fwrite(zeroes, 1, n, out) != n) return 1;
+        *written += n;
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+#ifndef RVM_COMMON_OBJECT_H
+#define RVM_COMMON_OBJECT_H
+
+// object files, as asm writes them: a header page, then sections, each at a
+// page-aligned offset, so that code can be mapped straight from the file.
+// Fields are in host byte order.
+//
+// A file not starting with RVM_OBJECT_MAGIC is a legacy raw image: nothing
+// but code, entered at word 0.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// "RVM\xfe"; as an instruction word it has an expansion type, so no valid
+// raw image starts with it.
+#define RVM_OBJECT_MAGIC 0xfe4d5652
+#define RVM_OBJECT_VERSION 1
+#define RVM_OBJECT_PAGE 4096
+#define RVM_OBJECT_MAX_SECTIONS 16
+
+typedef enum rvm_section_type {
+    RVM_SECTION_CODE = 1, // instruction words
+    RVM_SECTION_SYMBOLS, // a uint32_t count, rvm_symbol entries, then names
+    RVM_SECTION_CACHE, // decoded program, as the VM that wrote it lays it out
+} rvm_section_type;
+
+typedef struct rvm_section {
+    uint32_t type; // rvm_section_type
+    uint32_t reserved;
+    uint64_t offset, size; // in bytes, from the start of the file
+} rvm_section;
+
+typedef struct rvm_object_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry; // word address execution starts at
+    uint32_t section_count;
+    rvm_section sections[RVM_OBJECT_MAX_SECTIONS];
+} rvm_object_header;
+
+typedef struct rvm_symbol {
+    uint32_t value; // word address of the label
+    uint32_t name; // offset of its NUL-terminated name in the names
+} rvm_symbol;
+
+// a parsed object file; everything points into the file's contents.
+typedef struct rvm_object {
+    const uint32_t *code;
+    uint32_t size; // in words
+    uint32_t entry;
+    const rvm_symbol *symbols;
+    uint32_t symbol_count;
+    const char *names;
+    size_t names_size;
+    const void *cache; // NULL if there's none
+    size_t cache_size;
+} rvm_object;
+
+typedef enum rvm_object_error {
+    RVM_OBJECT_OK,
+    RVM_OBJECT_SIZE, // code isn't a whole number of words
+    RVM_OBJECT_FORMAT, // bad header or section table
+    RVM_OBJECT_VERSION_MISMATCH, // written by a later version
+} rvm_object_error;
+
+// splits size bytes of file contents, which must be word-aligned, into
+// sections; a raw image comes back as all code. Returns an
+// rvm_object_error.
+int rvm_object_parse(const void *data, size_t size, rvm_object *obj);
+// name of symbol i, or NULL if it isn't within the names.
+const char *rvm_object_symbol_name(const rvm_object *obj, uint32_t i);
+// writes obj out in the current version, leaving out empty sections.
+// Returns nonzero if writing failed.
+int rvm_object_write(FILE *out, const rvm_object *obj);
+
+#endif
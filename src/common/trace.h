@@ -0,0 +1,47 @@
+#ifndef RVM_COMMON_TRACE_H
+#define RVM_COMMON_TRACE_H
+
+// execution trace files, as vm -T writes them and trace reads them back: a
+// header page, then a ring of records, one per instruction run. The vm maps
+// the file shared and writes records straight into it, so the newest
+// capacity instructions are there even if the vm dies mid-run. Fields are in
+// host byte order.
+
+#include <stdint.h>
+
+#define RVM_TRACE_MAGIC 0x544d5652 // "RVMT"
+#define RVM_TRACE_VERSION 1
+#define RVM_TRACE_PAGE 4096
+
+typedef struct rvm_trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size; // sizeof(rvm_trace_record)
+    uint32_t capacity; // records in the ring, a power of two
+    // records ever written; the newest is at (head - 1) % capacity
+    uint64_t head;
+    // the program traced, as rvm_program has them
+    uint32_t program_size, program_hash;
+    uint8_t closed; // the run is over, and halted and error are set
+    uint8_t halted;
+    uint8_t error; // rvm_error
+    uint8_t reserved;
+} rvm_trace_header;
+
+#define RVM_TRACE_ZF 1
+#define RVM_TRACE_NF 2
+#define RVM_TRACE_DONE 4 // ran to the end, rather than faulting
+#define RVM_TRACE_WROTE 8 // value is set
+
+typedef struct rvm_trace_record {
+    uint32_t pc;
+    uint32_t word; // the instruction's first word; lconsts aren't kept
+    // what the instruction wrote: its destination operand, as it was after;
+    // the word push or call pushed; the address ret returned to; or the
+    // difference cmp set the flags from.
+    uint32_t value;
+    uint8_t flags; // RVM_TRACE_*, the cpu's after the instruction
+    uint8_t reserved[3];
+} rvm_trace_record;
+
+#endif
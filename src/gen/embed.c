@@ -0,0 +1,40 @@
+#include <stdio.h>
+
+// writes a file's contents out as a C string constant.
+
+int main(int argc, char *argv[]) {
+    if(argc != 4) {
+        printf("usage: %s symbol-name input-filename output-c-filename\n",
+            argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[2], "rt");
+    FILE *out = fopen(argv[3], "wt");
+    if(in == NULL) {
+        printf("Couldn't open input file!\n");
+        return 1;
+    }
+    if(out == NULL) {
+        printf("Couldn't open output file!\n");
+        return 1;
+    }
+
+    fprintf(out, "// generated by embed from %s; do not edit.\n", argv[2]);
+    fprintf(out, "const char %s[] =\n    \"", argv[1]);
+    int c;
+    while((c = fgetc(in)) != EOF) {
+        switch(c) {
+        case '\\': fputs("\\\\", out); break;
+        case '"': fputs("\\\"", out); break;
+        case '\n': fputs("\\n\"\n    \"", out); break;
+        default: fputc(c, out); break;
+        }
+    }
+    fprintf(out, "\";\n");
+
+    fclose(in);
+    fclose(out);
+
+    return 0;
+}
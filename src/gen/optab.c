@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdint.h>
+
+// writes the operand layout table used by rvm_inst_to_struct and
+// rvm_inst_from_struct, for every value of the 10-bit optype field.
+
+#define OP_ABSENT 9 // RVM_OP_ABSENT
+
+int main(int argc, char *argv[]) {
+    if(argc != 2) {
+        printf("usage: %s output-c-filename\n", argv[0]);
+        return 1;
+    }
+
+    FILE *out = fopen(argv[1], "wt");
+    if(out == NULL) {
+        printf("Couldn't open output file!\n");
+        return 1;
+    }
+
+    fprintf(out, "// generated by optab-gen; do not edit.\n");
+    fprintf(out, "#include \"common/inst.h\"\n\n");
+    fprintf(out, "const rvm_optab_entry rvm_optab[RVM_OPTAB_SIZE] = {\n");
+
+    for(uint32_t optypes = 0; optypes < 1024; optypes ++) {
+        uint8_t optype[3];
+        optype[0] = optypes % 10;
+        optype[1] = (optypes / 10) % 10;
+        optype[2] = (optypes / 10 / 10) % 10;
+
+        // sconsts share whatever the registers leave of the 17 operand bits.
+        uint8_t reqbits = 0, sconsts = 0, lconsts = 0;
+        for(int i = 0; i < 3; i ++) {
+            if(optype[i] % 3 == 0 && optype[i] != OP_ABSENT) sconsts ++;
+            if(optype[i] % 3 == 1) lconsts ++;
+            if(optype[i] % 3 == 2) reqbits += 3;
+        }
+        uint8_t pers = 0;
+        if(sconsts > 0) pers = (17 - reqbits) / sconsts;
+
+        uint8_t shift[3] = {0, 0, 0};
+        uint32_t mask[3] = {0, 0, 0};
+        uint8_t offset = 0;
+        for(int i = 0; i < 3; i ++) {
+            if(optype[i] == OP_ABSENT) continue;
+            switch(optype[i] % 3) {
+            case 0: // sconst
+                shift[i] = offset;
+                mask[i] = (1u << pers) - 1;
+                offset += pers;
+                break;
+            case 2: // reg
+                shift[i] = offset;
+                mask[i] = 0x7;
+                offset += 3;
+                break;
+            default:
+                break;
+            }
+        }
+
+        fprintf(out, "    {{%u, %u, %u}, {%u, %u, %u}, {0x%x, 0x%x, 0x%x}, "
+            "%u, %u},\n", optype[0], optype[1], optype[2], shift[0], shift[1],
+            shift[2], mask[0], mask[1], mask[2], lconsts, 1 + lconsts);
+    }
+
+    fprintf(out, "};\n");
+    fclose(out);
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "common/inst.h"
+#include "common/object.h"
+#include "common/trace.h"
+
+// reads back a trace vm -T wrote, oldest record first, as assembly. With the
+// program the trace was taken from, lconst operands are filled in from it.
+
+static const uint32_t *program;
+static uint32_t program_size;
+
+static void *map_file(const char *filename, size_t *size);
+static void print_record(uint64_t n, const rvm_trace_record *r);
+static void print_operand(const rvm_inst *inst, int i, uint32_t pc,
+    uint32_t *lconst);
+
+int main(int argc, char *argv[]) {
+    uint64_t last = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "n:")) != -1) {
+        switch(opt) {
+        case 'n':
+            last = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            printf("usage: %s [-n last] trace [program]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(optind != argc - 1 && optind != argc - 2) {
+        printf("usage: %s [-n last] trace [program]\n", argv[0]);
+        return 1;
+    }
+
+    size_t size;
+    const rvm_trace_header *h = map_file(argv[optind], &size);
+    if(size < RVM_TRACE_PAGE || h->magic != RVM_TRACE_MAGIC
+        || h->version != RVM_TRACE_VERSION
+        || h->record_size != sizeof(rvm_trace_record) || !h->capacity
+        || (h->capacity & (h->capacity - 1))
+        || (size - RVM_TRACE_PAGE) / sizeof(rvm_trace_record)
+            < h->capacity) {
+
+        printf("\"%s\" isn't a trace.\n", argv[optind]);
+        return 1;
+    }
+    const rvm_trace_record *records = (const rvm_trace_record *)
+        ((const uint8_t *)h + RVM_TRACE_PAGE);
+
+    if(optind + 1 < argc) {
+        size_t object_size;
+        const void *data = map_file(argv[optind + 1], &object_size);
+        rvm_object obj;
+        if(rvm_object_parse(data, object_size, &obj)) {
+            printf("\"%s\" isn't a valid object file.\n", argv[optind + 1]);
+            return 1;
+        }
+        uint32_t hash = 2166136261u;
+        for(uint32_t i = 0; i < obj.size; i ++)
+            hash = (hash ^ obj.code[i]) * 16777619u;
+        if(obj.size != h->program_size || hash != h->program_hash) {
+            printf("\"%s\" isn't the program traced.\n", argv[optind + 1]);
+            return 1;
+        }
+        program = obj.code;
+        program_size = obj.size;
+    }
+
+    // the vm may still be writing; take head once.
+    uint64_t head = h->head;
+    uint64_t count = head < h->capacity ? head : h->capacity;
+    if(last && last < count) count = last;
+    printf("Trace of %llu instructions, the last %llu here:\n",
+        (unsigned long long)head, (unsigned long long)count);
+    for(uint64_t n = head - count; n < head; n ++)
+        print_record(n, records + (n & (h->capacity - 1)));
+
+    if(!h->closed) printf("Still running, or stopped without closing.\n");
+    else if(h->error) printf("Stopped with error %u.\n", h->error);
+    else printf("Halted.\n");
+    return 0;
+}
+
+static void *map_file(const char *filename, size_t *size) {
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        printf("Cannot open file \"%s\": %m\n", filename);
+        exit(1);
+    }
+    struct stat fds;
+    fstat(fd, &fds);
+    *size = fds.st_size;
+    if(!*size) {
+        printf("\"%s\" is empty.\n", filename);
+        exit(1);
+    }
+    void *p = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED) {
+        printf("Failed to map \"%s\": %m\n", filename);
+        exit(1);
+    }
+    close(fd);
+    return p;
+}
+
+static void print_record(uint64_t n, const rvm_trace_record *r) {
+    rvm_inst inst;
+    rvm_inst_to_struct(r->word, &inst);
+
+    printf("%10llu  %6x  %08x  %-6s", (unsigned long long)n, r->pc, r->word,
+        rvm_inst_type_strings[inst.type]);
+    uint32_t lconst = r->pc + 1;
+    for(int i = 0; i < 3 && inst.optype[i] != RVM_OP_ABSENT; i ++)
+        print_operand(&inst, i, r->pc, &lconst);
+
+    if(r->flags & RVM_TRACE_WROTE) printf("  = %08x", r->value);
+    if(r->flags & RVM_TRACE_ZF) printf(" ZF");
+    if(r->flags & RVM_TRACE_NF) printf(" NF");
+    if(!(r->flags & RVM_TRACE_DONE)) printf("  (faulted)");
+    printf("\n");
+}
+
+// prints operand i as asm takes it; lconsts come from the program at
+// *lconst, if there is one.
+static void print_operand(const rvm_inst *inst, int i, uint32_t pc,
+    uint32_t *lconst) {
+
+    uint8_t type = inst->optype[i];
+    const char *prefix = type >= RVM_OP_HEAP_SCONST ? "@"
+        : type >= RVM_OP_STACK_SCONST ? "!" : "";
+    bool known = true;
+    uint32_t value = inst->opval[i];
+    if(type % 3 == 1) {
+        known = program && *lconst < program_size;
+        if(known) value = program[*lconst];
+        ++ *lconst;
+    }
+
+    if(type % 3 == 2) printf(" %sr%u", prefix, value);
+    else if(!known) printf(" %s?", prefix);
+    else printf(" %s%u", prefix, value);
+
+    // constant branch targets are relative to the branch.
+    if(i == 0 && type <= RVM_OP_VALUE_LCONST && known
+        && inst->type >= RVM_INST_JMP && inst->type <= RVM_INST_CALL)
+        printf(" (%x)", pc + value);
+}
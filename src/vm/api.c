@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rvm.h"
+
+struct rvm_vm {
+    rvm_config config;
+    rvm_program prog;
+    rvm_object object; // the file prog was loaded from
+    bool loaded, verified;
+    uint8_t engine; // rvm_engine_kind ctx.engine is
+    rvm_context ctx;
+};
+
+static const char *engine_names[] = {
+    [RVM_ENGINE_TIERED] = "tiered",
+    [RVM_ENGINE_SWITCH] = "switch",
+    [RVM_ENGINE_THREADED] = "threaded",
+    [RVM_ENGINE_FUSED] = "fused",
+    [RVM_ENGINE_JIT] = "jit",
+};
+
+static rvm_engine prepare(rvm_program *prog, const rvm_config *config,
+    uint8_t *kind);
+
+void rvm_config_default(rvm_config *config) {
+    config->engine = RVM_ENGINE_TIERED;
+    config->threshold = 100;
+    config->verify = false;
+    config->report = false;
+    config->preempt = false;
+    config->stack_size = 64 << 20;
+    config->heap_size = 1 << 30;
+}
+
+int rvm_engine_parse(const char *name) {
+    for(int i = 0; i < (int)(sizeof(engine_names) / sizeof(*engine_names));
+        i ++) {
+
+        if(!strcmp(name, engine_names[i])) return i;
+    }
+    return -1;
+}
+
+rvm_vm *rvm_vm_create(const rvm_config *config) {
+    if(config->engine > RVM_ENGINE_JIT) return NULL;
+    if(config->stack_size > RVM_MEM_MAX || config->heap_size > RVM_MEM_MAX)
+        return NULL;
+
+    rvm_vm *vm = calloc(1, sizeof(rvm_vm));
+    if(!vm) return NULL;
+    vm->config = *config;
+    vm->engine = config->engine;
+    if(rvm_context_init(&vm->ctx, NULL, NULL, config->stack_size,
+        config->heap_size)) {
+
+        free(vm);
+        return NULL;
+    }
+    return vm;
+}
+
+void rvm_vm_destroy(rvm_vm *vm) {
+    if(vm->loaded) rvm_program_free(&vm->prog);
+    rvm_context_free(&vm->ctx);
+    free(vm);
+}
+
+uint8_t rvm_vm_load(rvm_vm *vm, const void *image, size_t size) {
+    rvm_object object;
+    switch(rvm_object_parse(image, size, &object)) {
+    case RVM_OBJECT_OK:
+        break;
+    case RVM_OBJECT_SIZE:
+        return RVM_LOAD_SIZE;
+    case RVM_OBJECT_VERSION_MISMATCH:
+        return RVM_LOAD_VERSION;
+    default:
+        return RVM_LOAD_FORMAT;
+    }
+
+    if(vm->loaded) {
+        rvm_program_free(&vm->prog);
+        vm->loaded = false;
+    }
+    // a cache that doesn't fit this program or this build is just ignored.
+    bool verified = false, cached = object.cache
+        && !rvm_cache_load(&vm->prog, object.code, object.size, object.cache,
+            object.cache_size, &verified);
+    if(!cached && rvm_decode_program(&vm->prog, object.code, object.size))
+        return RVM_LOAD_MEMORY;
+    if(vm->config.report) {
+        printf("Loaded %u words, %s\n", object.size,
+            cached ? (verified ? "cached and verified" : "cached")
+                : "decoded");
+    }
+    if(object.entry != 0 && (object.entry >= object.size
+        || vm->prog.index[object.entry] == RVM_DEC_NONE)) {
+
+        rvm_program_free(&vm->prog);
+        return RVM_LOAD_FORMAT;
+    }
+    vm->prog.entry = object.entry;
+
+    if(vm->config.verify && !verified) {
+        rvm_verify_stats stats;
+        rvm_verify_program(&vm->prog, &stats);
+        if(vm->config.report) rvm_verify_report(&stats);
+        if(stats.errors) {
+            rvm_program_free(&vm->prog);
+            return RVM_LOAD_UNVERIFIED;
+        }
+        verified = true;
+    }
+    // before fusing or compiling changes it
+    vm->object = object;
+    vm->verified = verified;
+
+    vm->ctx.prog = &vm->prog;
+    vm->ctx.engine = prepare(&vm->prog, &vm->config, &vm->engine);
+    vm->loaded = true;
+    rvm_vm_reset(vm, NULL);
+    return RVM_LOAD_OK;
+}
+
+// fuses and compiles as the config asks, returning the engine to run the
+// program on, with its rvm_engine_kind in kind; that's only different from
+// the config's if the JIT can't take the program, or there's no memory for
+// the tiered engine's counts.
+static rvm_engine prepare(rvm_program *prog, const rvm_config *config,
+    uint8_t *kind) {
+
+    rvm_engine engine;
+    *kind = config->engine;
+    switch(config->engine) {
+    case RVM_ENGINE_SWITCH:
+        return rvm_sim_switch;
+    case RVM_ENGINE_FUSED: {
+        rvm_fuse_stats stats;
+        rvm_fuse_program(prog, &stats);
+        if(!config->preempt) rvm_fuse_entries(prog, &stats);
+        if(config->report) rvm_fuse_report(&stats);
+        engine = rvm_sim_threaded;
+        break;
+    }
+    case RVM_ENGINE_JIT:
+        if(!rvm_jit_compile(prog)) {
+            if(config->report) rvm_jit_report(prog);
+            return rvm_sim_jit;
+        }
+        *kind = RVM_ENGINE_THREADED;
+        engine = rvm_sim_threaded;
+        break;
+    case RVM_ENGINE_THREADED:
+        engine = rvm_sim_threaded;
+        break;
+    default:
+        if(!rvm_tier_prepare(prog, config->threshold)) return rvm_sim_tiered;
+        *kind = RVM_ENGINE_SWITCH;
+        return rvm_sim_switch;
+    }
+    rvm_threaded_prepare(prog);
+    return engine;
+}
+
+void rvm_vm_reset(rvm_vm *vm, const uint32_t *regs) {
+    rvm_context_reset(&vm->ctx);
+    if(regs) memcpy(vm->ctx.cpu.regs, regs, sizeof(vm->ctx.cpu.regs));
+}
+
+uint8_t rvm_vm_run(rvm_vm *vm, uint64_t budget) {
+    if(!vm->loaded) {
+        vm->ctx.cpu.error = RVM_ERR_END;
+        vm->ctx.cpu.halted = true;
+        return RVM_ERR_END;
+    }
+    vm->ctx.budget = budget;
+    vm->ctx.fuel = 0;
+    return rvm_context_run(&vm->ctx);
+}
+
+uint8_t rvm_vm_run_fuel(rvm_vm *vm, uint64_t fuel) {
+    if(!vm->loaded) return rvm_vm_run(vm, 0);
+    vm->ctx.budget = 0;
+    vm->ctx.fuel = fuel;
+    return rvm_context_run(&vm->ctx);
+}
+
+uint8_t rvm_vm_profile(rvm_vm *vm, rvm_profile *profile, uint64_t interval) {
+    if(!vm->loaded) {
+        memset(profile, 0, sizeof(*profile));
+        return rvm_vm_run(vm, 0);
+    }
+    if(rvm_profile_init(profile, &vm->prog, &vm->object)) {
+        vm->ctx.cpu.error = RVM_ERR_HOST_MEMORY;
+        vm->ctx.cpu.halted = true;
+        return RVM_ERR_HOST_MEMORY;
+    }
+    return rvm_profile_run(profile, &vm->ctx, interval ? interval : 1);
+}
+
+uint8_t rvm_vm_trace(rvm_vm *vm, rvm_trace *trace) {
+    if(!vm->loaded) return rvm_vm_run(vm, 0);
+    vm->ctx.trace = trace;
+    // budgeted runs are the ones that step, and this one never runs out.
+    uint8_t error = rvm_vm_run(vm, UINT64_MAX);
+    vm->ctx.trace = NULL;
+    return error;
+}
+
+#ifdef RVM_METRICS
+int rvm_vm_metrics(rvm_vm *vm, const char *path) {
+    if(!vm->loaded) {
+        rvm_vm_run(vm, 0);
+        return 0;
+    }
+    rvm_metrics metrics;
+    int failed = rvm_metrics_init(&metrics, &vm->prog)
+        || rvm_metrics_run(&metrics, &vm->ctx, path);
+    rvm_metrics_free(&metrics);
+    return failed;
+}
+#endif
+
+uint8_t rvm_vm_snapshot(const rvm_vm *vm, rvm_snapshot *snap) {
+    if(!vm->loaded) return RVM_SNAPSHOT_MISMATCH;
+    return rvm_snapshot_take(snap, &vm->ctx);
+}
+
+uint8_t rvm_vm_restore(rvm_vm *vm, const rvm_snapshot *snap,
+    const uint32_t *regs) {
+
+    if(!vm->loaded) return RVM_SNAPSHOT_MISMATCH;
+    uint8_t error = rvm_snapshot_restore(snap, &vm->ctx);
+    if(error) rvm_context_reset(&vm->ctx);
+    else if(regs) memcpy(vm->ctx.cpu.regs, regs, sizeof(vm->ctx.cpu.regs));
+    return error;
+}
+
+uint8_t rvm_vm_save(const rvm_vm *vm, const char *path) {
+    if(!vm->loaded) return RVM_SAVE_UNLOADED;
+    // the cache needs the program as decoding left it, which fusing, the JIT
+    // and tiering up don't.
+    rvm_program prog;
+    if(rvm_decode_program(&prog, vm->object.code, vm->object.size))
+        return RVM_SAVE_MEMORY;
+    rvm_object object = vm->object;
+    void *cache;
+    object.cache_size = rvm_cache_build(&prog, vm->verified, &cache);
+    object.cache = cache;
+    rvm_program_free(&prog);
+    if(!cache) return RVM_SAVE_MEMORY;
+
+    FILE *out = fopen(path, "wb");
+    int failed = !out || rvm_object_write(out, &object);
+    if(out && fclose(out)) failed = 1;
+    free(cache);
+    return failed ? RVM_SAVE_IO : RVM_SAVE_OK;
+}
+
+const rvm_object *rvm_vm_object(const rvm_vm *vm) {
+    return vm->loaded ? &vm->object : NULL;
+}
+
+int rvm_vm_set_io(rvm_vm *vm, rvm_io *io) {
+    // reset can't drop pages still mapping the old input.
+    if(vm->ctx.io && rvm_io_unmap(vm->ctx.io, &vm->ctx.heap)) return -1;
+    vm->ctx.io = io;
+    return 0;
+}
+
+const rvm_cpu_state *rvm_vm_state(const rvm_vm *vm) {
+    return &vm->ctx.cpu;
+}
+
+void rvm_vm_print_error(const rvm_vm *vm) {
+    rvm_context_print_error(&vm->ctx);
+}
+
+void rvm_vm_report(const rvm_vm *vm) {
+    if(vm->loaded && vm->ctx.engine == rvm_sim_tiered)
+        rvm_tier_report(&vm->prog);
+    rvm_mem_report(&vm->ctx.heap);
+}
+
+const rvm_program *rvm_vm_program(const rvm_vm *vm) {
+    return &vm->prog;
+}
+
+rvm_engine rvm_vm_engine(const rvm_vm *vm) {
+    return vm->ctx.engine;
+}
+
+uint8_t rvm_vm_engine_kind(const rvm_vm *vm) {
+    return vm->engine;
+}
+
+const rvm_config *rvm_vm_config(const rvm_vm *vm) {
+    return &vm->config;
+}
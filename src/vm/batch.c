@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "vm.h"
+
+// each thread starts with a contiguous range of the jobs in its own queue,
+// taking from the front; once that runs dry it takes from the back of the
+// others', so threads that drew short jobs help out with the long ones.
+typedef struct queue {
+    pthread_mutex_t lock;
+    uint32_t front, back; // jobs still to run, front inclusive
+} queue;
+
+typedef struct worker {
+    rvm_batch *batch;
+    queue *queues;
+    uint32_t id;
+    pthread_t thread;
+    bool started;
+} worker;
+
+static void *run_worker(void *arg);
+static int take(queue *q, uint32_t *job, int steal);
+
+int rvm_batch_run(rvm_batch *batch) {
+    uint32_t threads = batch->threads;
+    if(threads == 0) threads = 1;
+    if(threads > batch->jobs && batch->jobs) threads = batch->jobs;
+    batch->threads = threads;
+
+    batch->results = calloc(batch->jobs, sizeof(rvm_cpu_state));
+    batch->thread_jobs = calloc(threads, sizeof(uint32_t));
+    batch->thread_steals = calloc(threads, sizeof(uint32_t));
+    queue *queues = calloc(threads, sizeof(queue));
+    worker *workers = calloc(threads, sizeof(worker));
+    if(!batch->results || !batch->thread_jobs || !batch->thread_steals
+        || !queues || !workers) {
+
+        free(queues);
+        free(workers);
+        return -1;
+    }
+
+    for(uint32_t t = 0; t < threads; t ++) {
+        pthread_mutex_init(&queues[t].lock, NULL);
+        queues[t].front = (uint64_t)batch->jobs * t / threads;
+        queues[t].back = (uint64_t)batch->jobs * (t + 1) / threads;
+        workers[t].batch = batch;
+        workers[t].queues = queues;
+        workers[t].id = t;
+    }
+
+    double start = rvm_now();
+    // thread 0 is this one. The jobs of a thread that couldn't start, or
+    // set up its context, are stolen by the others.
+    for(uint32_t t = 1; t < threads; t ++) {
+        workers[t].started = !pthread_create(&workers[t].thread, NULL,
+            run_worker, workers + t);
+    }
+    run_worker(workers);
+    uint32_t ran = batch->thread_jobs[0];
+    for(uint32_t t = 1; t < threads; t ++) {
+        if(workers[t].started) pthread_join(workers[t].thread, NULL);
+        ran += batch->thread_jobs[t];
+    }
+    batch->time = rvm_now() - start;
+
+    for(uint32_t t = 0; t < threads; t ++) {
+        pthread_mutex_destroy(&queues[t].lock);
+    }
+    free(queues);
+    free(workers);
+    return ran < batch->jobs ? -1 : 0;
+}
+
+void rvm_batch_free(rvm_batch *batch) {
+    free(batch->results);
+    free(batch->thread_jobs);
+    free(batch->thread_steals);
+}
+
+static void *run_worker(void *arg) {
+    worker *w = arg;
+    rvm_batch *batch = w->batch;
+    uint32_t threads = batch->threads;
+
+    rvm_context ctx;
+    if(rvm_context_init(&ctx, batch->progs[0], batch->engines[0],
+        batch->stack_size, batch->heap_size)) return NULL;
+
+    uint32_t job, victim = w->id;
+    for(;;) {
+        int stolen = 0;
+        if(!take(w->queues + w->id, &job, 0)) {
+            // jobs never add more, so one pass over the others finding
+            // nothing means the batch is done.
+            uint32_t tried;
+            for(tried = 1; tried < threads; tried ++) {
+                victim = (victim + 1) % threads;
+                if(victim == w->id) victim = (victim + 1) % threads;
+                if(take(w->queues + victim, &job, 1)) break;
+            }
+            if(tried >= threads) break;
+            stolen = 1;
+        }
+
+        ctx.prog = batch->progs[job % batch->prog_count];
+        ctx.engine = batch->engines[job % batch->prog_count];
+        if(batch->snapshot) {
+            // the job is lost; this thread's others are left to be stolen.
+            if(rvm_snapshot_restore(batch->snapshot, &ctx)) break;
+        }
+        else {
+            if(batch->thread_jobs[w->id]) rvm_context_reset(&ctx);
+            ctx.cpu.pc = ctx.prog->entry;
+        }
+        rvm_context_run(&ctx);
+        batch->results[job] = ctx.cpu;
+        batch->thread_jobs[w->id] ++;
+        batch->thread_steals[w->id] += stolen;
+    }
+
+    rvm_context_free(&ctx);
+    return NULL;
+}
+
+static int take(queue *q, uint32_t *job, int steal) {
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if(q->front < q->back) {
+        *job = steal ? -- q->back : q->front ++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
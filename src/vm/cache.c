@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+
+typedef struct cache_header {
+    uint32_t version; // RVM_CACHE_VERSION
+    uint32_t decoded_size; // sizeof(rvm_decoded)
+    uint32_t flags; // RVM_CACHE_*
+    uint32_t program_size, program_hash;
+    uint32_t count; // decoded instructions, without the sentinels
+} cache_header;
+
+static int check_decoded(const rvm_decoded *d, uint32_t size,
+    uint32_t count);
+
+size_t rvm_cache_build(const rvm_program *prog, bool verified,
+    void **cache) {
+
+    size_t code_size = sizeof(rvm_decoded) * (prog->count + 3);
+    size_t size = sizeof(cache_header) + code_size
+        + sizeof(uint32_t) * (prog->size + 1);
+    uint8_t *p = malloc(size);
+    *cache = p;
+    if(!p) return 0;
+
+    cache_header *h = (cache_header *)p;
+    memset(h, 0, sizeof(*h));
+    h->version = RVM_CACHE_VERSION;
+    h->decoded_size = sizeof(rvm_decoded);
+    h->flags = verified ? RVM_CACHE_VERIFIED : 0;
+    h->program_size = prog->size;
+    h->program_hash = prog->hash;
+    h->count = prog->count;
+
+    rvm_decoded *code = (rvm_decoded *)(h + 1);
+    memcpy(code, prog->code, code_size);
+    // handlers are addresses in this process, and set up again on load
+    for(uint32_t i = 0; i < prog->count + 3; i ++) code[i].handler = NULL;
+    memcpy(code + prog->count + 3, prog->index,
+        sizeof(uint32_t) * (prog->size + 1));
+    return size;
+}
+
+int rvm_cache_load(rvm_program *prog, const uint32_t *words, uint32_t size,
+    const void *cache, size_t cache_size, bool *verified) {
+
+    const cache_header *h = cache;
+    if(cache_size < sizeof(*h) || h->version != RVM_CACHE_VERSION
+        || h->decoded_size != sizeof(rvm_decoded) || h->program_size != size
+        || h->count > size) return 1;
+    size_t code_size = sizeof(rvm_decoded) * (h->count + 3);
+    if(cache_size != sizeof(*h) + code_size
+        + sizeof(uint32_t) * ((size_t)size + 1)) return 1;
+
+    uint32_t hash = 2166136261u;
+    for(uint32_t i = 0; i < size; i ++) hash = (hash ^ words[i]) * 16777619u;
+    if(hash != h->program_hash) return 1;
+
+    // a damaged cache mustn't take the engines out of bounds, so everything
+    // they index by is checked, as are the sentinels they land on at the
+    // end, a bad jump or a bad return; that's still much less than decoding.
+    const rvm_decoded *code = (const rvm_decoded *)(h + 1);
+    const uint32_t *index = (const uint32_t *)(code + h->count + 3);
+    for(uint32_t i = 0; i < h->count + 3; i ++) {
+        if(check_decoded(code + i, size, h->count)) return 1;
+    }
+    static const uint8_t sentinels[3] = {
+        RVM_DEC_END, RVM_DEC_BADJUMP, RVM_DEC_BADRET
+    };
+    for(int s = 0; s < 3; s ++) {
+        if(code[h->count + s].op != sentinels[s]) return 1;
+    }
+    for(uint32_t i = 0; i < size; i ++) {
+        if(index[i] >= h->count && index[i] != RVM_DEC_NONE) return 1;
+    }
+    if(index[size] != h->count) return 1;
+
+    prog->words = words;
+    prog->size = size;
+    prog->hash = hash;
+    prog->entry = 0;
+    prog->jit = NULL;
+    prog->tier = NULL;
+    prog->count = h->count;
+    prog->code = malloc(code_size);
+    prog->index = malloc(sizeof(uint32_t) * (size + 1));
+    if(!prog->code || !prog->index) {
+        free(prog->code);
+        free(prog->index);
+        return 1;
+    }
+    memcpy(prog->code, code, code_size);
+    memcpy(prog->index, index, sizeof(uint32_t) * (size + 1));
+    *verified = h->flags & RVM_CACHE_VERIFIED;
+    return 0;
+}
+
+static int check_decoded(const rvm_decoded *d, uint32_t size,
+    uint32_t count) {
+
+    // a plain decode, so nothing fused or tiered.
+    if(d->op > RVM_DEC_BADRET || d->type > RVM_DEC_BADRET) return 1;
+    if(d->target != RVM_DEC_NONE && d->target >= count + 3) return 1;
+    if(d->pc > size || d->next_pc > size) return 1;
+    for(int i = 0; i < 3; i ++) {
+        // lconsts are folded into sconsts
+        if(d->optype[i] > RVM_OP_ABSENT || d->optype[i] % 3 == 1) return 1;
+        if(d->optype[i] % 3 == 2 && d->opval[i] >= 8) return 1;
+    }
+    // handlers are looked up by op and shape, and the specialized ones go
+    // by the shape alone.
+    if(d->shape >= RVM_SHAPE_COUNT) return 1;
+    if(d->op < RVM_INST_COUNT && d->shape != rvm_shape_of(d->optype))
+        return 1;
+    return 0;
+}
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+
+// the context running on this thread, for rvm_context_fault
+static __thread rvm_context *running;
+
+static void run_budget(rvm_context *ctx);
+
+int rvm_context_init(rvm_context *ctx, const rvm_program *prog,
+    rvm_engine engine, size_t stack_size, size_t heap_size) {
+
+    ctx->prog = prog;
+    ctx->engine = engine;
+    ctx->budget = ctx->fuel = 0;
+    ctx->trace = NULL;
+    ctx->io = NULL;
+#ifdef RVM_METRICS
+    ctx->metrics = NULL;
+#endif
+    memset(&ctx->cpu, 0, sizeof(ctx->cpu));
+    if(prog) ctx->cpu.pc = prog->entry;
+    if(rvm_mem_reserve(&ctx->stack, stack_size, RVM_MEM_STACK)) return -1;
+    if(rvm_mem_reserve(&ctx->heap, heap_size, RVM_MEM_HEAP)) {
+        rvm_mem_release(&ctx->stack);
+        return -1;
+    }
+    return 0;
+}
+
+void rvm_context_free(rvm_context *ctx) {
+    rvm_mem_release(&ctx->stack);
+    rvm_mem_release(&ctx->heap);
+}
+
+void rvm_context_reset(rvm_context *ctx) {
+    memset(&ctx->cpu, 0, sizeof(ctx->cpu));
+    if(ctx->prog) ctx->cpu.pc = ctx->prog->entry;
+    // the heap would still read the file's pages, so it can't be run.
+    if(ctx->io && rvm_io_unmap(ctx->io, &ctx->heap)) {
+        ctx->cpu.error = RVM_ERR_HOST_IO;
+        ctx->cpu.halted = true;
+        return;
+    }
+    // memory that couldn't be emptied can't be run from either.
+    if(rvm_mem_reset(&ctx->stack) || rvm_mem_reset(&ctx->heap)) {
+        ctx->cpu.error = RVM_ERR_HOST_MEMORY;
+        ctx->cpu.halted = true;
+    }
+}
+
+uint8_t rvm_context_run(rvm_context *ctx) {
+    if(ctx->cpu.error == RVM_ERR_FUEL) {
+        ctx->cpu.error = RVM_OK;
+        ctx->cpu.halted = false;
+    }
+    if(ctx->cpu.halted) return ctx->cpu.error;
+    ctx->cpu.fuel = ctx->fuel ? ctx->fuel : UINT64_MAX;
+
+    rvm_context *outer = running;
+    running = ctx;
+    // a guard page fault lands back here, with the error already set. The
+    // handler doesn't block anything, so there's no mask to save, which
+    // would cost a system call per run.
+    if(sigsetjmp(ctx->fault_jump, 0) == 0) {
+        if(ctx->budget) run_budget(ctx);
+        else ctx->engine(ctx->prog, &ctx->cpu, &ctx->stack, &ctx->heap);
+    }
+    running = outer;
+    return ctx->cpu.error;
+}
+
+static void run_budget(rvm_context *ctx) {
+    const rvm_program *prog = ctx->prog;
+    rvm_cpu_state *cpu = &ctx->cpu;
+    uint64_t budget = ctx->budget;
+
+    uint32_t ip = prog->index[cpu->pc];
+    while(!cpu->halted && budget) {
+#ifdef RVM_METRICS
+        uint32_t ran = ip;
+#endif
+        if(ctx->trace) ip = rvm_trace_step(ctx->trace, ctx, ip);
+        else ip = rvm_step(prog, cpu, &ctx->stack, &ctx->heap, ip);
+#ifdef RVM_METRICS
+        if(ctx->metrics) rvm_metrics_count(ctx->metrics, ctx, ran);
+#endif
+        budget --;
+    }
+    ctx->budget = budget;
+    if(!cpu->halted) {
+        cpu->pc = prog->code[ip].pc;
+        cpu->error = RVM_ERR_BUDGET;
+        cpu->halted = true;
+    }
+}
+
+rvm_io *rvm_context_io(void) {
+    return running ? running->io : NULL;
+}
+
+void rvm_context_fault(uint8_t error) {
+    rvm_context *ctx = running;
+    // a region used outside of any context; nothing to go back to.
+    if(!ctx) return;
+    ctx->cpu.error = error;
+    ctx->cpu.halted = true;
+    siglongjmp(ctx->fault_jump, 1);
+}
+
+void rvm_context_print_error(const rvm_context *ctx) {
+    const rvm_program *prog = ctx->prog;
+    switch(ctx->cpu.error) {
+    case RVM_OK:
+        break;
+    case RVM_ERR_END:
+        printf("Tried to execute past end of program.\n");
+        break;
+    case RVM_ERR_TRUNCATED:
+        printf("Instruction extends past end of program\n");
+        break;
+    case RVM_ERR_INVALID: {
+        uint8_t type = prog->code[prog->index[ctx->cpu.pc]].type;
+        printf("Invalid %s instruction!\n", rvm_inst_type_strings[type]);
+        break;
+    }
+    case RVM_ERR_BADJUMP:
+        printf("Jumped to non-entry instruction!\n");
+        break;
+    case RVM_ERR_BADRET:
+        printf("Returned into the middle of an instruction!\n");
+        break;
+    case RVM_ERR_STACK_OVERFLOW:
+        printf("Stack overflow!\n");
+        break;
+    case RVM_ERR_STACK_UNDERFLOW:
+        printf("Stack underflow!\n");
+        break;
+    case RVM_ERR_HEAP_BOUNDS:
+        printf("Heap access out of bounds!\n");
+        break;
+    case RVM_ERR_OUT_OF_MEMORY:
+        printf("Out of heap memory!\n");
+        break;
+    case RVM_ERR_INVALID_FREE:
+        printf("Invalid free!\n");
+        break;
+    case RVM_ERR_BUDGET:
+        printf("Instruction budget exhausted.\n");
+        break;
+    case RVM_ERR_FUEL:
+        printf("Out of fuel.\n");
+        break;
+    case RVM_ERR_DIV_ZERO:
+        printf("Division by zero!\n");
+        break;
+    case RVM_ERR_HOST_IO:
+        printf("Couldn't put back heap memory mapping input!\n");
+        break;
+    case RVM_ERR_HOST_MEMORY:
+        printf("Out of host memory!\n");
+        break;
+    default:
+        printf("Unknown fault.\n");
+        break;
+    }
+}
@@ -0,0 +1,135 @@
+#include <stdlib.h>
+
+#include "vm.h"
+
+static int is_branch(uint8_t type);
+
+int rvm_decode_program(rvm_program *prog, const uint32_t *words,
+    uint32_t size) {
+
+    prog->words = words;
+    prog->size = size;
+    prog->entry = 0;
+    prog->hash = 2166136261u;
+    for(uint32_t i = 0; i < size; i ++)
+        prog->hash = (prog->hash ^ words[i]) * 16777619u;
+    prog->jit = NULL;
+    prog->tier = NULL;
+    // at most one instruction per word, plus the sentinels.
+    prog->code = malloc(sizeof(rvm_decoded) * (size + 3));
+    prog->index = malloc(sizeof(uint32_t) * (size + 1));
+    if(!prog->code || !prog->index) {
+        free(prog->code);
+        free(prog->index);
+        return -1;
+    }
+
+    uint32_t count = 0;
+    uint32_t pc = 0;
+    while(pc < size) {
+        rvm_decoded *d = prog->code + count;
+        rvm_inst inst;
+        rvm_inst_to_struct(words[pc], &inst);
+
+        prog->index[pc] = count++;
+        d->pc = pc++;
+        d->type = d->op = inst.type;
+        d->target = RVM_DEC_NONE;
+        d->handler = NULL;
+        d->flags_live = 0;
+
+        for(int i = 0; i < 3; i ++) {
+            d->optype[i] = inst.optype[i];
+            d->opval[i] = inst.opval[i];
+        }
+        for(int i = 0; i < 3; i ++) {
+            if(inst.optype[i] % 3 != 1) continue;
+
+            // lconst: pull in the following word.
+            if(pc >= size) {
+                d->op = RVM_DEC_TRUNCATED;
+                break;
+            }
+            prog->index[pc] = RVM_DEC_NONE;
+            d->optype[i] --;
+            d->opval[i] = words[pc++];
+        }
+        d->next_pc = pc;
+
+        d->shape = rvm_shape_of(d->optype);
+
+        if(d->op == RVM_DEC_TRUNCATED) continue;
+        if(rvm_inst_check_valid(&inst)) d->op = RVM_DEC_INVALID;
+    }
+    prog->index[size] = count;
+    prog->count = count;
+
+    static const uint8_t sentinels[3] = {
+        RVM_DEC_END, RVM_DEC_BADJUMP, RVM_DEC_BADRET
+    };
+    for(int s = 0; s < 3; s ++) {
+        rvm_decoded *d = prog->code + count + s;
+        d->op = d->type = sentinels[s];
+        for(int i = 0; i < 3; i ++) d->optype[i] = RVM_OP_ABSENT;
+        d->shape = RVM_SHAPE_GENERIC;
+        d->target = RVM_DEC_NONE;
+        d->handler = NULL;
+        d->flags_live = 0;
+        d->pc = d->next_pc = size;
+    }
+
+    // resolve constant branch targets, relative to the branch itself.
+    for(uint32_t i = 0; i < count; i ++) {
+        rvm_decoded *d = prog->code + i;
+        if(d->op != d->type || !is_branch(d->type)) continue;
+        if(d->optype[0] != RVM_OP_VALUE_SCONST) continue;
+
+        d->target = rvm_program_jump(prog, d->pc + d->opval[0]);
+    }
+    return 0;
+}
+
+void rvm_program_free(rvm_program *prog) {
+    rvm_jit_free(prog);
+    rvm_tier_free(prog);
+    free(prog->code);
+    free(prog->index);
+}
+
+void rvm_decoded_fault(const rvm_decoded *d, rvm_cpu_state *cpu) {
+    static const uint8_t errors[] = {
+        [RVM_DEC_END - RVM_DEC_END] = RVM_ERR_END,
+        [RVM_DEC_TRUNCATED - RVM_DEC_END] = RVM_ERR_TRUNCATED,
+        [RVM_DEC_INVALID - RVM_DEC_END] = RVM_ERR_INVALID,
+        [RVM_DEC_BADJUMP - RVM_DEC_END] = RVM_ERR_BADJUMP,
+        [RVM_DEC_BADRET - RVM_DEC_END] = RVM_ERR_BADRET,
+    };
+    cpu->pc = d->pc;
+    cpu->error = errors[d->op - RVM_DEC_END];
+    cpu->halted = true;
+}
+
+uint8_t rvm_shape_of(const uint8_t *optype) {
+#define X(name, a, b, c) \
+    if(optype[0] == a && optype[1] == b && optype[2] == c) \
+        return RVM_SHAPE_##name;
+    RVM_SHAPES(X)
+#undef X
+    return RVM_SHAPE_GENERIC;
+}
+
+static int is_branch(uint8_t type) {
+    switch(type) {
+    case RVM_INST_JMP:
+    case RVM_INST_JE:
+    case RVM_INST_JL:
+    case RVM_INST_JLE:
+    case RVM_INST_JNE:
+    case RVM_INST_JNL:
+    case RVM_INST_JNLE:
+    case RVM_INST_CALL:
+        return 1;
+    default:
+        return 0;
+    }
+}
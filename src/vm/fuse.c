@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+
+static int is_jcc(uint8_t type);
+
+void rvm_fuse_program(rvm_program *prog, rvm_fuse_stats *stats) {
+    static const uint8_t cmp_jcc_ops[] = {
+        [RVM_INST_JE] = RVM_DEC_CMP_JE,
+        [RVM_INST_JL] = RVM_DEC_CMP_JL,
+        [RVM_INST_JLE] = RVM_DEC_CMP_JLE,
+        [RVM_INST_JNE] = RVM_DEC_CMP_JNE,
+        [RVM_INST_JNL] = RVM_DEC_CMP_JNL,
+        [RVM_INST_JNLE] = RVM_DEC_CMP_JNLE,
+    };
+
+    memset(stats, 0, sizeof(*stats));
+    // without liveness, the flags are all kept.
+    uint8_t *live = rvm_flags_liveness(prog);
+
+    for(uint32_t i = 0; i + 1 < prog->count; i ++) {
+        rvm_decoded *a = prog->code + i, *b = a + 1;
+        if(a->op != a->type || b->op != b->type) continue;
+
+        if(a->type == RVM_INST_CMP && is_jcc(b->type)
+            && b->target != RVM_DEC_NONE) {
+
+            a->op = cmp_jcc_ops[b->type];
+            a->target = b->target;
+            a->flags_live = 0;
+            if(!live || live[b->target]) a->flags_live |= RVM_FLAGS_TAKEN;
+            else stats->cmp_jcc_taken_elided ++;
+            if(!live || live[i + 2]) a->flags_live |= RVM_FLAGS_NOT_TAKEN;
+            else stats->cmp_jcc_not_taken_elided ++;
+            stats->cmp_jcc ++;
+        }
+        else if(a->type == RVM_INST_PUSH && b->type == RVM_INST_CALL
+            && b->target != RVM_DEC_NONE) {
+
+            a->op = RVM_DEC_PUSH_CALL;
+            a->target = b->target;
+            // return address
+            a->next_pc = b->next_pc;
+            stats->push_call ++;
+        }
+        else if(a->type == RVM_INST_POP && b->type == RVM_INST_PUSH) {
+            a->op = RVM_DEC_POP_PUSH;
+            a->optype[1] = b->optype[0];
+            a->opval[1] = b->opval[0];
+            a->shape = rvm_shape_of(a->optype);
+            stats->pop_push ++;
+        }
+        else continue;
+
+        // the second instruction stays decoded as it was, but is not the
+        // start of another run.
+        i ++;
+    }
+
+    free(live);
+}
+
+void rvm_fuse_entries(rvm_program *prog, rvm_fuse_stats *stats) {
+    // entry is a no-op, so constant branches can land just past it.
+    for(uint32_t i = 0; i < prog->count; i ++) {
+        rvm_decoded *d = prog->code + i;
+        if(d->target == RVM_DEC_NONE) continue;
+        if(prog->code[d->target].op != RVM_INST_ENTRY) continue;
+        d->target ++;
+        stats->entry_skip ++;
+    }
+}
+
+void rvm_fuse_report(const rvm_fuse_stats *stats) {
+    printf("Fusion report:\n");
+    printf("\tcmp+jcc: %u (flag writes elided: %u taken, %u not taken)\n",
+        stats->cmp_jcc, stats->cmp_jcc_taken_elided,
+        stats->cmp_jcc_not_taken_elided);
+    printf("\tpush+call: %u\n", stats->push_call);
+    printf("\tpop+push: %u\n", stats->pop_push);
+    printf("\tentry skip: %u\n", stats->entry_skip);
+}
+
+// for each decoded instruction, whether the flags may be read before they are
+// next written if execution reaches it. hlt counts as a read, since the final
+// CPU state shows the flags. ret may return to any instruction start, as
+// rvm_program_return allows, not just past a call; computed branches may land
+// on any entry.
+uint8_t *rvm_flags_liveness(const rvm_program *prog) {
+    uint32_t total = prog->count + 3;
+    uint8_t *live = calloc(total, 1);
+    if(!live) return NULL;
+
+    int changed;
+    do {
+        changed = 0;
+
+        uint8_t ret_live = 0, entry_live = 0;
+        for(uint32_t i = 0; i < prog->count; i ++) {
+            ret_live |= live[i];
+            if(prog->code[i].type == RVM_INST_ENTRY) entry_live |= live[i];
+        }
+
+        for(uint32_t i = prog->count; i -- > 0;) {
+            const rvm_decoded *d = prog->code + i;
+            uint8_t in, target_live = entry_live;
+            if(d->target != RVM_DEC_NONE) target_live = live[d->target];
+
+            // faults never reach the final CPU state.
+            if(d->op != d->type) in = 0;
+            else if(d->type == RVM_INST_HLT || is_jcc(d->type)) in = 1;
+            else if(d->type == RVM_INST_CMP) in = 0;
+            else if(d->type == RVM_INST_JMP || d->type == RVM_INST_CALL)
+                in = target_live;
+            else if(d->type == RVM_INST_RET) in = ret_live;
+            else in = live[i + 1];
+
+            if(in != live[i]) {
+                live[i] = in;
+                changed = 1;
+            }
+        }
+    } while(changed);
+
+    return live;
+}
+
+static int is_jcc(uint8_t type) {
+    return type >= RVM_INST_JE && type <= RVM_INST_JNLE;
+}
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "vm.h"
+
+#define PAGE_MASK ((uint64_t)RVM_IO_PAGE - 1)
+
+static int read_chunk(rvm_io *io, rvm_mem *heap, uint32_t buf,
+    uint32_t words, uint32_t *placed);
+static int map_chunk(rvm_io *io, rvm_mem *heap, uint32_t buf,
+    uint64_t length);
+static uint64_t copy_chunk(rvm_io *io, uint8_t *to, uint64_t size);
+static uint32_t skip(rvm_io *io, uint32_t bytes);
+static void write_chunk(rvm_io *io, const uint8_t *from, uint32_t bytes);
+static int write_all(rvm_io *io, const uint8_t *from, size_t size);
+static int in_heap(const rvm_mem *heap, uint32_t address, uint64_t words);
+
+int rvm_io_init(rvm_io *io, int in, int out) {
+    memset(io, 0, sizeof(*io));
+    io->in = in;
+    io->out = out;
+
+    struct stat st;
+    if(in >= 0 && !fstat(in, &st) && S_ISREG(st.st_mode)) {
+        off_t at = lseek(in, 0, SEEK_CUR);
+        io->mappable = true;
+        io->in_size = st.st_size;
+        io->consumed = at > 0 ? at : 0;
+        posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    if(out >= 0) {
+        io->buffer = malloc(RVM_IO_BUFFER);
+        if(!io->buffer) return -1;
+    }
+    return 0;
+}
+
+void rvm_io_free(rvm_io *io) {
+    rvm_io_flush(io);
+    free(io->buffer);
+    io->buffer = NULL;
+}
+
+int rvm_io_flush(rvm_io *io) {
+    if(!io->buffered) return 0;
+    int failed = write_all(io, io->buffer, io->buffered);
+    io->buffered = 0;
+    return failed;
+}
+
+int rvm_io_unmap(rvm_io *io, rvm_mem *heap) {
+    if(io->mapped_end <= io->mapped_start) return 0;
+    if(mmap((uint8_t *)heap->contents + io->mapped_start,
+        io->mapped_end - io->mapped_start, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0)
+        == MAP_FAILED) return -1;
+    io->mapped_start = io->mapped_end = 0;
+    return 0;
+}
+
+void rvm_io_report(const rvm_io *io) {
+    printf("I/O report:\n");
+    printf("\treads: %llu, %llu bytes mapped, %llu bytes copied\n",
+        (unsigned long long)io->reads, (unsigned long long)io->mapped,
+        (unsigned long long)io->copied);
+    printf("\twrites: %llu, %llu bytes\n", (unsigned long long)io->writes,
+        (unsigned long long)io->written);
+    printf("\tsystem calls: %llu, %llu failed\n",
+        (unsigned long long)io->calls, (unsigned long long)io->errors);
+}
+
+void rvm_host_call(const rvm_decoded *d, uint32_t *const *op,
+    rvm_cpu_state *cpu, rvm_mem *heap) {
+
+    rvm_io *io = rvm_context_io();
+    uint8_t error = RVM_ERR_HEAP_BOUNDS;
+    switch(d->type) {
+    case RVM_INST_EXP0: { // read buf words bytes
+        if(!in_heap(heap, *op[0], *op[1])) break;
+        uint32_t placed = 0;
+        if(io && io->in >= 0
+            && read_chunk(io, heap, *op[0], *op[1], &placed)) {
+
+            error = RVM_ERR_HOST_IO;
+            break;
+        }
+        *op[2] = placed;
+        return;
+    }
+    case RVM_INST_EXP1: // write buf bytes
+        if(!in_heap(heap, *op[0], ((uint64_t)*op[1] + 3) / 4)) break;
+        if(io && io->out >= 0)
+            write_chunk(io, (const uint8_t *)(heap->contents + *op[0]),
+                *op[1]);
+        return;
+    case RVM_INST_EXP2: // flush
+        if(io) rvm_io_flush(io);
+        return;
+    case RVM_INST_EXP3: // skip bytes skipped
+        *op[1] = io && io->in >= 0 ? skip(io, *op[0]) : 0;
+        return;
+    case RVM_INST_EXP4: { // tell lo hi
+        uint64_t consumed = io ? io->consumed : 0;
+        *op[0] = consumed;
+        *op[1] = consumed >> 32;
+        return;
+    }
+    }
+    cpu->pc = d->pc;
+    cpu->error = error;
+    cpu->halted = true;
+}
+
+// the next words words of input, or as much as is left, into the heap at
+// buf; placed is set to the bytes placed. The rest of a last, partial word
+// is zeroed. Returns nonzero if a failed mapping left the heap unusable.
+static int read_chunk(rvm_io *io, rvm_mem *heap, uint32_t buf,
+    uint32_t words, uint32_t *placed) {
+
+    io->reads ++;
+    uint64_t size = (uint64_t)words * 4;
+    // what's placed has to fit in the count returned.
+    if(size > UINT32_MAX) size = UINT32_MAX & ~PAGE_MASK;
+    if(io->mappable) {
+        uint64_t left = io->consumed < io->in_size
+            ? io->in_size - io->consumed : 0;
+        // whole pages, so the next chunk starts on one too, unless this is
+        // the end of the file, whose last page reads as zero past it.
+        uint64_t length = left < size ? left : size & ~PAGE_MASK;
+        int failed = 1;
+        if(length && ((length + PAGE_MASK) & ~PAGE_MASK) <= size)
+            failed = map_chunk(io, heap, buf, length);
+        if(failed < 0) return -1;
+        if(!failed) {
+            io->consumed += length;
+            io->mapped += length;
+            *placed = length;
+            return 0;
+        }
+    }
+
+    uint8_t *to = (uint8_t *)(heap->contents + buf);
+    uint64_t got = copy_chunk(io, to, size);
+    if(got & 3) memset(to + got, 0, 4 - (got & 3));
+    io->consumed += got;
+    io->copied += got;
+    *placed = got;
+    return 0;
+}
+
+// maps length bytes of input at consumed over the heap at buf, if both are
+// page-aligned; returns 1 if they aren't or mapping fails, and -1 if the
+// heap couldn't be put back after.
+static int map_chunk(rvm_io *io, rvm_mem *heap, uint32_t buf,
+    uint64_t length) {
+
+    uint64_t start = (uint64_t)buf * 4;
+    if((start & PAGE_MASK) || (io->consumed & PAGE_MASK)) return 1;
+    uint64_t end = start + ((length + PAGE_MASK) & ~PAGE_MASK);
+    uint8_t *to = (uint8_t *)heap->contents + start;
+
+    io->calls ++;
+    if(mmap(to, end - start, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_FIXED, io->in, io->consumed)
+        == MAP_FAILED) {
+
+        // a failed fixed mapping may have dropped what was there.
+        io->errors ++;
+        if(mmap(to, end - start, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0)
+            == MAP_FAILED) return -1;
+        return 1;
+    }
+    if(io->mapped_end <= io->mapped_start) {
+        io->mapped_start = start;
+        io->mapped_end = end;
+    }
+    else {
+        if(start < io->mapped_start) io->mapped_start = start;
+        if(end > io->mapped_end) io->mapped_end = end;
+    }
+
+    // have the kernel start on the chunk after this one.
+    io->calls ++;
+    posix_fadvise(io->in, io->consumed + length, length,
+        POSIX_FADV_WILLNEED);
+    return 0;
+}
+
+// reads until size bytes are in or the input ends; a pipe or terminal can
+// hand over less than asked for at a time.
+static uint64_t copy_chunk(rvm_io *io, uint8_t *to, uint64_t size) {
+    uint64_t got = 0;
+    while(got < size) {
+        ssize_t n;
+        io->calls ++;
+        if(io->mappable) n = pread(io->in, to + got, size - got,
+            io->consumed + got);
+        else n = read(io->in, to + got, size - got);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0) io->errors ++;
+        if(n <= 0) break;
+        got += n;
+    }
+    return got;
+}
+
+// returns the bytes skipped, fewer than asked for at the end of the input.
+static uint32_t skip(rvm_io *io, uint32_t bytes) {
+    if(io->mappable) {
+        uint64_t left = io->consumed < io->in_size
+            ? io->in_size - io->consumed : 0;
+        if(bytes > left) bytes = left;
+        io->consumed += bytes;
+        return bytes;
+    }
+
+    uint8_t scratch[RVM_IO_PAGE * 4];
+    uint32_t skipped = 0;
+    while(skipped < bytes) {
+        uint32_t size = bytes - skipped < sizeof(scratch)
+            ? bytes - skipped : sizeof(scratch);
+        uint64_t got = copy_chunk(io, scratch, size);
+        skipped += got;
+        io->consumed += got;
+        if(got < size) break;
+    }
+    return skipped;
+}
+
+// small writes are gathered in the buffer; large ones go straight from the
+// heap, after what's buffered.
+static void write_chunk(rvm_io *io, const uint8_t *from, uint32_t bytes) {
+    io->writes ++;
+    io->written += bytes;
+    if(bytes >= RVM_IO_BUFFER) {
+        rvm_io_flush(io);
+        write_all(io, from, bytes);
+        return;
+    }
+    if(io->buffered + bytes > RVM_IO_BUFFER) rvm_io_flush(io);
+    memcpy(io->buffer + io->buffered, from, bytes);
+    io->buffered += bytes;
+}
+
+static int write_all(rvm_io *io, const uint8_t *from, size_t size) {
+    while(size) {
+        io->calls ++;
+        ssize_t n = write(io->out, from, size);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) {
+            io->errors ++;
+            return -1;
+        }
+        from += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// words words at address are all below the heap's size.
+static int in_heap(const rvm_mem *heap, uint32_t address, uint64_t words) {
+    return ((uint64_t)address + words) * 4 <= heap->size;
+}
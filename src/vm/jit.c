@@ -0,0 +1,677 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "vm.h"
+
+#if defined(__x86_64__)
+
+// run-time state the generated code works on, pointed to by rbx. The guest
+// registers live in r8d-r15d and the guest sp in ebp while in generated code,
+// and are written back to cpu around every call out.
+typedef struct rvm_jit_ctx {
+    rvm_cpu_state cpu;
+    const rvm_program *prog;
+    rvm_mem *stack;
+    rvm_mem *heap;
+    const struct rvm_jit *jit;
+} rvm_jit_ctx;
+
+typedef void (*rvm_jit_entry)(rvm_jit_ctx *ctx, void *start);
+
+struct rvm_jit {
+    uint8_t *code;
+    size_t code_len, code_size;
+    rvm_jit_entry entry;
+    void **native; // decoded index -> native address
+    void **word_native; // word address -> native address, for ret
+    void **entry_native; // word address -> native address, for branches
+    uint32_t fallbacks; // instructions left to the interpreter
+};
+
+typedef struct emitter {
+    uint8_t *buf;
+    size_t len, cap;
+    // rel32 fields to point at native[index] once known
+    uint32_t *patch_pos;
+    uint32_t *patch_index;
+    uint32_t patch_count, patch_cap;
+    // a buffer couldn't grow; what's emitted after is dropped.
+    bool failed;
+} emitter;
+
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+#define GUEST(i) (R8 + (i))
+
+// condition codes, as the low nibble of jcc/setcc
+enum { CC_B = 0x2, CC_E = 0x4, CC_NE = 0x5, CC_S = 0x8, CC_NS = 0x9 };
+
+static void emit8(emitter *e, uint8_t b) {
+    if(e->len == e->cap) {
+        size_t cap = e->cap ? e->cap * 2 : 0x10000;
+        uint8_t *buf = realloc(e->buf, cap);
+        if(!buf) {
+            e->failed = true;
+            return;
+        }
+        e->buf = buf;
+        e->cap = cap;
+    }
+    e->buf[e->len++] = b;
+}
+
+static void emit32(emitter *e, uint32_t v) {
+    for(int i = 0; i < 4; i ++) emit8(e, v >> (i*8));
+}
+
+static void emit64(emitter *e, uint64_t v) {
+    emit32(e, v);
+    emit32(e, v >> 32);
+}
+
+static void rex(emitter *e, int w, int reg, int index, int base) {
+    uint8_t r = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0)
+        | ((index & 8) ? 2 : 0) | ((base & 8) ? 1 : 0);
+    if(r != 0x40) emit8(e, r);
+}
+
+// opcode with a register-direct r/m operand.
+static void op_rr(emitter *e, int w, uint8_t opcode, int reg, int rm) {
+    rex(e, w, reg, 0, rm);
+    emit8(e, opcode);
+    emit8(e, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// opcode with a [base + index*scale + disp32] r/m operand; index < 0 for
+// none.
+static void op_rm(emitter *e, int w, const uint8_t *opcode, int oplen,
+    int reg, int base, int index, int scale, int32_t disp) {
+
+    rex(e, w, reg, index < 0 ? 0 : index, base);
+    for(int i = 0; i < oplen; i ++) emit8(e, opcode[i]);
+    if(index < 0 && (base & 7) != RSP) {
+        emit8(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+    }
+    else {
+        uint8_t ss = scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+        emit8(e, 0x84 | ((reg & 7) << 3));
+        emit8(e, (ss << 6) | ((index < 0 ? RSP : index) & 7) << 3
+            | (base & 7));
+    }
+    emit32(e, disp);
+}
+
+static void op_rm1(emitter *e, int w, uint8_t opcode, int reg, int base,
+    int32_t disp) {
+
+    op_rm(e, w, &opcode, 1, reg, base, -1, 0, disp);
+}
+
+static void mov_rr(emitter *e, int dst, int src) {
+    if(dst != src) op_rr(e, 0, 0x89, src, dst);
+}
+
+static void mov_ri(emitter *e, int dst, uint32_t imm) {
+    rex(e, 0, 0, 0, dst);
+    emit8(e, 0xb8 + (dst & 7));
+    emit32(e, imm);
+}
+
+static void mov_ri64(emitter *e, int dst, uint64_t imm) {
+    rex(e, 1, 0, 0, dst);
+    emit8(e, 0xb8 + (dst & 7));
+    emit64(e, imm);
+}
+
+static void push_r(emitter *e, int r) {
+    rex(e, 0, 0, 0, r);
+    emit8(e, 0x50 + (r & 7));
+}
+
+static void pop_r(emitter *e, int r) {
+    rex(e, 0, 0, 0, r);
+    emit8(e, 0x58 + (r & 7));
+}
+
+// two-operand ALU op on 32-bit registers, by its /r opcode
+static void alu_rr(emitter *e, uint8_t opcode, int dst, int src) {
+    op_rr(e, 0, opcode, src, dst);
+}
+
+// the same op against an immediate, by its 0x81 /ext
+static void alu_ri(emitter *e, int ext, int dst, uint32_t imm) {
+    op_rr(e, 0, 0x81, ext, dst);
+    emit32(e, imm);
+}
+
+static void call_abs(emitter *e, void *fn) {
+    mov_ri64(e, RAX, (uint64_t)fn);
+    op_rr(e, 0, 0xff, 2, RAX);
+}
+
+// jcc/jmp rel32 to decoded instruction index, patched once all are emitted.
+static void jump_index(emitter *e, int cc, uint32_t index) {
+    if(cc < 0) emit8(e, 0xe9);
+    else {
+        emit8(e, 0x0f);
+        emit8(e, 0x80 | cc);
+    }
+    if(e->patch_count == e->patch_cap) {
+        uint32_t cap = e->patch_cap ? e->patch_cap * 2 : 256;
+        uint32_t *pos = realloc(e->patch_pos, cap * sizeof(uint32_t));
+        if(pos) e->patch_pos = pos;
+        uint32_t *index = realloc(e->patch_index, cap * sizeof(uint32_t));
+        if(index) e->patch_index = index;
+        if(!pos || !index) {
+            e->failed = true;
+            emit32(e, 0);
+            return;
+        }
+        e->patch_cap = cap;
+    }
+    e->patch_pos[e->patch_count] = e->len;
+    e->patch_index[e->patch_count++] = index;
+    emit32(e, 0);
+}
+
+// forward jcc/jmp rel32 within the code for one instruction; returns the
+// position to bind.
+static size_t jump_local(emitter *e, int cc) {
+    if(cc < 0) emit8(e, 0xe9);
+    else {
+        emit8(e, 0x0f);
+        emit8(e, 0x80 | cc);
+    }
+    emit32(e, 0);
+    return e->len;
+}
+
+static void bind_local(emitter *e, size_t pos) {
+    if(e->failed) return;
+    uint32_t rel = e->len - pos;
+    memcpy(e->buf + pos - 4, &rel, 4);
+}
+
+#define CPU_OFF(field) ((int32_t)offsetof(rvm_jit_ctx, cpu.field))
+#define CTX_OFF(field) ((int32_t)offsetof(rvm_jit_ctx, field))
+
+static void spill(emitter *e) {
+    for(int i = 0; i < 8; i ++) {
+        op_rm1(e, 0, 0x89, GUEST(i), RBX, CPU_OFF(regs) + i*4);
+    }
+    op_rm1(e, 0, 0x89, RBP, RBX, CPU_OFF(sp));
+}
+
+static void reload(emitter *e) {
+    for(int i = 0; i < 8; i ++) {
+        op_rm1(e, 0, 0x8b, GUEST(i), RBX, CPU_OFF(regs) + i*4);
+    }
+    op_rm1(e, 0, 0x8b, RBP, RBX, CPU_OFF(sp));
+}
+
+// jumps through a word address table, with the word address in eax; anything
+// past the end of the program goes to the END sentinel.
+static void jump_table(emitter *e, void **table, uint32_t size) {
+    alu_ri(e, 7, RAX, size);
+    size_t in_range = jump_local(e, CC_B);
+    mov_ri(e, RAX, size);
+    bind_local(e, in_range);
+    mov_ri64(e, RCX, (uint64_t)table);
+    static const uint8_t jmp_mem[] = {0xff};
+    op_rm(e, 1, jmp_mem, 1, 4, RCX, RAX, 8, 0);
+}
+
+static void *fallback(rvm_jit_ctx *ctx, uint32_t ip) {
+    ip = rvm_step(ctx->prog, &ctx->cpu, ctx->stack, ctx->heap, ip);
+    if(ctx->cpu.halted) return NULL;
+    return ctx->jit->native[ip];
+}
+
+// hands instruction ip to the interpreter and continues wherever it says.
+static void emit_fallback(emitter *e, size_t exit_pos, uint32_t ip) {
+    spill(e);
+    op_rr(e, 1, 0x89, RBX, RDI);
+    mov_ri(e, RSI, ip);
+    call_abs(e, (void *)fallback);
+    reload(e);
+    op_rr(e, 1, 0x85, RAX, RAX);
+    size_t running = jump_local(e, CC_NE);
+    // halted: the exit stub
+    emit8(e, 0xe9);
+    emit32(e, exit_pos - (e->len + 4));
+    bind_local(e, running);
+    op_rr(e, 0, 0xff, 4, RAX);
+}
+
+// rdx = stack->contents, for a push; overflow runs into the guard region.
+static void emit_push_prologue(emitter *e) {
+    op_rm1(e, 1, 0x8b, RCX, RBX, CTX_OFF(stack));
+    op_rm1(e, 1, 0x8b, RDX, RCX, offsetof(rvm_mem, contents));
+}
+
+static void emit_push_reg(emitter *e, int reg) {
+    emit_push_prologue(e);
+    static const uint8_t mov[] = {0x89};
+    op_rm(e, 0, mov, 1, reg, RDX, RBP, 4, 0);
+    op_rr(e, 0, 0xff, 0, RBP);
+}
+
+static void emit_push_imm(emitter *e, uint32_t imm) {
+    emit_push_prologue(e);
+    static const uint8_t mov[] = {0xc7};
+    op_rm(e, 0, mov, 1, 0, RDX, RBP, 4, 0);
+    emit32(e, imm);
+    op_rr(e, 0, 0xff, 0, RBP);
+}
+
+static int is_value(uint8_t optype) {
+    return optype == RVM_OP_VALUE_SCONST || optype == RVM_OP_VALUE_REG
+        || optype == RVM_OP_ABSENT;
+}
+
+static void load_operand(emitter *e, int dst, const rvm_decoded *d, int i) {
+    if(d->optype[i] == RVM_OP_VALUE_REG) mov_rr(e, dst, GUEST(d->opval[i]));
+    else mov_ri(e, dst, d->opval[i]);
+}
+
+static void store_flags(emitter *e) {
+    static const uint8_t sete[] = {0x0f, 0x90 | CC_E};
+    static const uint8_t sets[] = {0x0f, 0x90 | CC_S};
+    op_rm(e, 0, sete, 2, 0, RBX, -1, 0, CPU_OFF(zflag));
+    op_rm(e, 0, sets, 2, 0, RBX, -1, 0, CPU_OFF(nflag));
+}
+
+// native branch on the host flags left by a cmp, to decoded index target.
+static void emit_host_jcc(emitter *e, uint8_t type, uint32_t target) {
+    switch(type) {
+    case RVM_INST_JE: jump_index(e, CC_E, target); break;
+    case RVM_INST_JL: jump_index(e, CC_S, target); break;
+    case RVM_INST_JLE:
+        jump_index(e, CC_S, target);
+        jump_index(e, CC_E, target);
+        break;
+    case RVM_INST_JNE: jump_index(e, CC_NE, target); break;
+    case RVM_INST_JNL: jump_index(e, CC_NS, target); break;
+    case RVM_INST_JNLE: {
+        size_t skip = jump_local(e, CC_S);
+        jump_index(e, CC_NE, target);
+        bind_local(e, skip);
+        break;
+    }
+    }
+}
+
+// tests the stored flags for a branch of type, returning the local jump to
+// bind where the branch is not taken.
+static size_t emit_flag_test(emitter *e, uint8_t type) {
+    static const uint8_t movzxb[] = {0x0f, 0xb6};
+    op_rm(e, 0, movzxb, 2, RAX, RBX, -1, 0, CPU_OFF(zflag));
+    op_rm(e, 0, movzxb, 2, RCX, RBX, -1, 0, CPU_OFF(nflag));
+    switch(type) {
+    case RVM_INST_JE:
+    case RVM_INST_JNE:
+        op_rr(e, 0, 0x85, RAX, RAX);
+        break;
+    case RVM_INST_JL:
+    case RVM_INST_JNL:
+        op_rr(e, 0, 0x85, RCX, RCX);
+        break;
+    default: // jle, jnle
+        alu_rr(e, 0x09, RAX, RCX);
+        break;
+    }
+    switch(type) {
+    case RVM_INST_JE:
+    case RVM_INST_JL:
+    case RVM_INST_JLE:
+        return jump_local(e, CC_E);
+    default:
+        return jump_local(e, CC_NE);
+    }
+}
+
+static int is_jcc(uint8_t type) {
+    return type >= RVM_INST_JE && type <= RVM_INST_JNLE;
+}
+
+// returns nonzero if d was left to the interpreter.
+static int emit_inst(emitter *e, const rvm_program *prog, const uint8_t *live,
+    uint32_t ip, size_t exit_pos) {
+
+    const rvm_decoded *d = prog->code + ip;
+
+    if(d->op != d->type) goto fallback;
+    for(int i = 0; i < 3; i ++) {
+        if(!is_value(d->optype[i])) goto fallback;
+    }
+
+    switch(d->type) {
+    case RVM_INST_ENTRY: {
+        // sub qword [fuel], 1, leaving through the exit stub at zero.
+        static const uint8_t sub_imm8[] = {0x83}, movb[] = {0xc6};
+        op_rm(e, 1, sub_imm8, 1, 5, RBX, -1, 0, CPU_OFF(fuel));
+        emit8(e, 1);
+        size_t fueled = jump_local(e, CC_NE);
+        op_rm1(e, 0, 0xc7, 0, RBX, CPU_OFF(pc));
+        emit32(e, d->next_pc);
+        op_rm(e, 0, movb, 1, 0, RBX, -1, 0, CPU_OFF(error));
+        emit8(e, RVM_ERR_FUEL);
+        op_rm(e, 0, movb, 1, 0, RBX, -1, 0, CPU_OFF(halted));
+        emit8(e, 1);
+        emit8(e, 0xe9);
+        emit32(e, exit_pos - (e->len + 4));
+        bind_local(e, fueled);
+        return 0;
+    }
+    case RVM_INST_HLT:
+        op_rm1(e, 0, 0xc7, 0, RBX, CPU_OFF(pc));
+        emit32(e, d->next_pc);
+        {
+            static const uint8_t movb[] = {0xc6};
+            op_rm(e, 0, movb, 1, 0, RBX, -1, 0, CPU_OFF(halted));
+            emit8(e, 1);
+        }
+        emit8(e, 0xe9);
+        emit32(e, exit_pos - (e->len + 4));
+        return 0;
+    case RVM_INST_ADD:
+    case RVM_INST_SUB:
+    case RVM_INST_OR:
+    case RVM_INST_AND:
+    case RVM_INST_XOR:
+    case RVM_INST_MUL:
+    case RVM_INST_DIV:
+    case RVM_INST_SHL:
+    case RVM_INST_SHR: {
+        int dst = d->optype[2] != RVM_OP_ABSENT ? 2 : 0;
+        load_operand(e, RAX, d, 0);
+        switch(d->type) {
+        case RVM_INST_ADD:
+        case RVM_INST_SUB:
+        case RVM_INST_OR:
+        case RVM_INST_AND:
+        case RVM_INST_XOR: {
+            static const uint8_t rr[] = {
+                [RVM_INST_ADD] = 0x01, [RVM_INST_SUB] = 0x29,
+                [RVM_INST_OR] = 0x09, [RVM_INST_AND] = 0x21,
+                [RVM_INST_XOR] = 0x31,
+            };
+            static const uint8_t ext[] = {
+                [RVM_INST_ADD] = 0, [RVM_INST_SUB] = 5,
+                [RVM_INST_OR] = 1, [RVM_INST_AND] = 4,
+                [RVM_INST_XOR] = 6,
+            };
+            if(d->optype[1] == RVM_OP_VALUE_REG)
+                alu_rr(e, rr[d->type], RAX, GUEST(d->opval[1]));
+            else alu_ri(e, ext[d->type], RAX, d->opval[1]);
+            break;
+        }
+        case RVM_INST_MUL:
+            load_operand(e, RCX, d, 1);
+            // imul eax, ecx
+            emit8(e, 0x0f);
+            emit8(e, 0xaf);
+            emit8(e, 0xc0 | (RAX << 3) | RCX);
+            break;
+        case RVM_INST_DIV: {
+            load_operand(e, RCX, d, 1);
+            // test ecx, ecx, leaving through the exit stub at zero.
+            static const uint8_t movb[] = {0xc6};
+            op_rr(e, 0, 0x85, RCX, RCX);
+            size_t nonzero = jump_local(e, CC_NE);
+            op_rm1(e, 0, 0xc7, 0, RBX, CPU_OFF(pc));
+            emit32(e, d->pc);
+            op_rm(e, 0, movb, 1, 0, RBX, -1, 0, CPU_OFF(error));
+            emit8(e, RVM_ERR_DIV_ZERO);
+            op_rm(e, 0, movb, 1, 0, RBX, -1, 0, CPU_OFF(halted));
+            emit8(e, 1);
+            emit8(e, 0xe9);
+            emit32(e, exit_pos - (e->len + 4));
+            bind_local(e, nonzero);
+            alu_rr(e, 0x31, RDX, RDX);
+            op_rr(e, 0, 0xf7, 6, RCX);
+            break;
+        }
+        case RVM_INST_SHL:
+        case RVM_INST_SHR:
+            load_operand(e, RCX, d, 1);
+            op_rr(e, 0, 0xd3, d->type == RVM_INST_SHL ? 4 : 5, RAX);
+            break;
+        }
+        mov_rr(e, GUEST(d->opval[dst]), RAX);
+        return 0;
+    }
+    case RVM_INST_NOT: {
+        int dst = d->optype[1] != RVM_OP_ABSENT ? 1 : 0;
+        load_operand(e, RAX, d, 0);
+        op_rr(e, 0, 0xf7, 2, RAX);
+        mov_rr(e, GUEST(d->opval[dst]), RAX);
+        return 0;
+    }
+    case RVM_INST_SWAP:
+        mov_rr(e, RAX, GUEST(d->opval[0]));
+        mov_rr(e, GUEST(d->opval[0]), GUEST(d->opval[1]));
+        mov_rr(e, GUEST(d->opval[1]), RAX);
+        return 0;
+    case RVM_INST_CMP: {
+        load_operand(e, RAX, d, 0);
+        if(d->optype[1] == RVM_OP_VALUE_REG)
+            alu_rr(e, 0x39, RAX, GUEST(d->opval[1]));
+        else alu_ri(e, 7, RAX, d->opval[1]);
+
+        const rvm_decoded *n = d + 1;
+        int fuse = ip + 1 < prog->count && is_jcc(n->type)
+            && n->op == n->type && n->target != RVM_DEC_NONE;
+        if(fuse) {
+            // cmp+jcc: branch on the host flags, and only keep the guest
+            // flags if something can still read them.
+            if(live[n->target] || live[ip + 2]) store_flags(e);
+            emit_host_jcc(e, n->type, n->target);
+            jump_index(e, -1, ip + 2);
+        }
+        else if(live[ip + 1]) store_flags(e);
+        return 0;
+    }
+    case RVM_INST_JMP:
+    case RVM_INST_JE:
+    case RVM_INST_JL:
+    case RVM_INST_JLE:
+    case RVM_INST_JNE:
+    case RVM_INST_JNL:
+    case RVM_INST_JNLE:
+    case RVM_INST_CALL: {
+        size_t not_taken = 0;
+        if(is_jcc(d->type)) not_taken = emit_flag_test(e, d->type);
+        if(d->type == RVM_INST_CALL) emit_push_imm(e, d->next_pc);
+        if(d->target != RVM_DEC_NONE) jump_index(e, -1, d->target);
+        else {
+            mov_rr(e, RAX, GUEST(d->opval[0]));
+            alu_ri(e, 0, RAX, d->pc);
+            jump_table(e, prog->jit->entry_native, prog->size);
+        }
+        if(is_jcc(d->type)) bind_local(e, not_taken);
+        return 0;
+    }
+    case RVM_INST_RET:
+        op_rr(e, 0, 0xff, 1, RBP);
+        op_rm1(e, 1, 0x8b, RCX, RBX, CTX_OFF(stack));
+        op_rm1(e, 1, 0x8b, RDX, RCX, offsetof(rvm_mem, contents));
+        {
+            static const uint8_t mov[] = {0x8b};
+            op_rm(e, 0, mov, 1, RAX, RDX, RBP, 4, 0);
+        }
+        jump_table(e, prog->jit->word_native, prog->size);
+        return 0;
+    case RVM_INST_PUSH:
+        if(d->optype[0] == RVM_OP_VALUE_REG)
+            emit_push_reg(e, GUEST(d->opval[0]));
+        else emit_push_imm(e, d->opval[0]);
+        return 0;
+    case RVM_INST_POP: {
+        // an sp of 0 wraps around into the guard region.
+        op_rr(e, 0, 0xff, 1, RBP);
+        op_rm1(e, 1, 0x8b, RCX, RBX, CTX_OFF(stack));
+        op_rm1(e, 1, 0x8b, RDX, RCX, offsetof(rvm_mem, contents));
+        static const uint8_t mov[] = {0x8b};
+        op_rm(e, 0, mov, 1, GUEST(d->opval[0]), RDX, RBP, 4, 0);
+        return 0;
+    }
+    default:
+        break;
+    }
+
+fallback:
+    emit_fallback(e, exit_pos, ip);
+    return 1;
+}
+
+int rvm_jit_compile(rvm_program *prog) {
+    struct rvm_jit *jit = calloc(1, sizeof(*jit));
+    if(!jit) return 1;
+    prog->jit = jit;
+    uint32_t total = prog->count + 3;
+    jit->native = malloc(sizeof(void *) * total);
+    jit->word_native = malloc(sizeof(void *) * (prog->size + 1));
+    jit->entry_native = malloc(sizeof(void *) * (prog->size + 1));
+    size_t *offsets = malloc(sizeof(size_t) * total);
+    uint8_t *live = rvm_flags_liveness(prog);
+    if(!jit->native || !jit->word_native || !jit->entry_native || !offsets
+        || !live) {
+
+        free(offsets);
+        free(live);
+        rvm_jit_free(prog);
+        return 1;
+    }
+
+    emitter e = {0};
+
+    // entry: save callee-saved registers, keep the stack 16-byte aligned for
+    // calls out, pick up the guest state and jump to the start address.
+    push_r(&e, RBX);
+    push_r(&e, RBP);
+    push_r(&e, R12);
+    push_r(&e, R13);
+    push_r(&e, R14);
+    push_r(&e, R15);
+    op_rr(&e, 1, 0x83, 5, RSP);
+    emit8(&e, 8);
+    op_rr(&e, 1, 0x89, RDI, RBX);
+    reload(&e);
+    op_rr(&e, 1, 0xff, 4, RSI);
+
+    // exit: write the guest state back and return.
+    size_t exit_pos = e.len;
+    spill(&e);
+    op_rr(&e, 1, 0x83, 0, RSP);
+    emit8(&e, 8);
+    pop_r(&e, R15);
+    pop_r(&e, R14);
+    pop_r(&e, R13);
+    pop_r(&e, R12);
+    pop_r(&e, RBP);
+    pop_r(&e, RBX);
+    emit8(&e, 0xc3);
+
+    for(uint32_t i = 0; i < total; i ++) {
+        offsets[i] = e.len;
+        jit->fallbacks += emit_inst(&e, prog, live, i, exit_pos);
+    }
+    // falling off the last instruction lands on the END sentinel, which is
+    // emitted in sequence; nothing falls off the sentinels.
+
+    int failed = e.failed;
+    for(uint32_t i = 0; !failed && i < e.patch_count; i ++) {
+        uint32_t pos = e.patch_pos[i];
+        uint32_t rel = offsets[e.patch_index[i]] - (pos + 4);
+        memcpy(e.buf + pos, &rel, 4);
+    }
+
+    jit->code_len = e.len;
+    jit->code_size = (e.len + 0xfff) & ~0xfff;
+    if(!failed) {
+        jit->code = mmap(NULL, jit->code_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if(failed || jit->code == MAP_FAILED) failed = 1;
+    else {
+        memcpy(jit->code, e.buf, e.len);
+        if(mprotect(jit->code, jit->code_size, PROT_READ | PROT_EXEC))
+            failed = 1;
+    }
+
+    if(!failed) {
+        jit->entry = (rvm_jit_entry)(void *)jit->code;
+        for(uint32_t i = 0; i < total; i ++)
+            jit->native[i] = jit->code + offsets[i];
+        for(uint32_t w = 0; w <= prog->size; w ++) {
+            jit->word_native[w] = jit->native[rvm_program_return(prog, w)];
+            jit->entry_native[w] = jit->native[rvm_program_jump(prog, w)];
+        }
+    }
+
+    free(e.buf);
+    free(e.patch_pos);
+    free(e.patch_index);
+    free(offsets);
+    free(live);
+    if(failed) rvm_jit_free(prog);
+    return failed;
+}
+
+void rvm_jit_free(rvm_program *prog) {
+    struct rvm_jit *jit = prog->jit;
+    if(!jit) return;
+    if(jit->code && jit->code != MAP_FAILED) munmap(jit->code, jit->code_size);
+    free(jit->native);
+    free(jit->word_native);
+    free(jit->entry_native);
+    free(jit);
+    prog->jit = NULL;
+}
+
+void rvm_jit_report(const rvm_program *prog) {
+    printf("JIT: %zu bytes of code, %u instructions left to the "
+        "interpreter\n", prog->jit->code_len, prog->jit->fallbacks);
+}
+
+void rvm_sim_jit(const rvm_program *prog, rvm_cpu_state *cpu,
+    rvm_mem *stack, rvm_mem *heap) {
+
+    rvm_jit_ctx ctx;
+    ctx.cpu = *cpu;
+    ctx.prog = prog;
+    ctx.stack = stack;
+    ctx.heap = heap;
+    ctx.jit = prog->jit;
+
+    prog->jit->entry(&ctx, prog->jit->native[prog->index[cpu->pc]]);
+    *cpu = ctx.cpu;
+}
+
+#else
+
+int rvm_jit_compile(rvm_program *prog) {
+    return 1;
+}
+
+void rvm_jit_free(rvm_program *prog) {
+}
+
+void rvm_jit_report(const rvm_program *prog) {
+}
+
+void rvm_sim_jit(const rvm_program *prog, rvm_cpu_state *cpu,
+    rvm_mem *stack, rvm_mem *heap) {
+
+    printf("No JIT for this platform.\n");
+    exit(1);
+}
+
+#endif
@@ -0,0 +1,469 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+
+// one value per lane; GCC lowers operations on these to SSE2, or AVX2 when
+// built for it, and to scalar code anywhere else.
+typedef uint32_t lanes __attribute__((vector_size(RVM_LANES * 4)));
+typedef int32_t lane_mask __attribute__((vector_size(RVM_LANES * 4)));
+
+// RVM_LANES instances at the same pc. Registers and flags are kept
+// struct-of-arrays; sp only moves on push, pop, call and ret, which every
+// lane runs together, so it's shared. Lanes that leave lockstep have their
+// state written back to their context, and their vector slots go stale.
+typedef struct group {
+    const rvm_program *prog;
+    rvm_context *ctx; // by lane
+    uint32_t *stack[RVM_LANES], *heap[RVM_LANES]; // contents, by lane
+    uint32_t stack_words, heap_words;
+    uint32_t active; // bit per lane still in lockstep
+    lanes regs[8];
+    lane_mask zflag, nflag;
+    uint32_t sp;
+    uint64_t steps;
+} group;
+
+// where each lane's memory operands are, resolved the way rvm_operand would
+// before the instruction runs, as word indexes into the lane's heap.
+typedef struct addresses {
+    uint64_t lane[RVM_LANES];
+} addresses;
+
+static void run_group(rvm_lockstep *ls, rvm_context *ctx, uint32_t first,
+    uint32_t count);
+static void lockstep(group *g);
+static void leave(group *g, uint32_t lane, uint32_t pc);
+static void leave_all(group *g, uint32_t pc);
+static inline void resolve(group *g, const rvm_decoded *d, addresses *a);
+// vectors go through pointers, as passing them by value needs AVX.
+static inline void load(const group *g, const rvm_decoded *d,
+    const addresses *a, int i, lanes *v);
+static inline void store(group *g, const rvm_decoded *d,
+    const addresses *a, int i, const lanes *v);
+static inline uint32_t taken_lanes(const group *g, uint8_t type);
+static uint32_t follow(group *g, const rvm_decoded *d, const uint32_t *ips);
+
+int rvm_lockstep_run(rvm_lockstep *ls) {
+    ls->results = calloc(ls->lanes ? ls->lanes : 1, sizeof(rvm_cpu_state));
+    if(!ls->results) return -1;
+    ls->lockstep_steps = ls->scalar_lanes = 0;
+
+    rvm_context ctx[RVM_LANES];
+    for(uint32_t l = 0; l < RVM_LANES; l ++) {
+        if(rvm_context_init(ctx + l, ls->prog, ls->engine, ls->stack_size,
+            ls->heap_size)) {
+
+            while(l --) rvm_context_free(ctx + l);
+            return -1;
+        }
+    }
+
+    double start = rvm_now();
+    for(uint32_t first = 0; first < ls->lanes; first += RVM_LANES) {
+        uint32_t count = ls->lanes - first;
+        if(count > RVM_LANES) count = RVM_LANES;
+        if(first) {
+            for(uint32_t l = 0; l < count; l ++) rvm_context_reset(ctx + l);
+        }
+        run_group(ls, ctx, first, count);
+    }
+    ls->time = rvm_now() - start;
+
+    for(uint32_t l = 0; l < RVM_LANES; l ++) rvm_context_free(ctx + l);
+    return 0;
+}
+
+void rvm_lockstep_free(rvm_lockstep *ls) {
+    free(ls->results);
+}
+
+static void run_group(rvm_lockstep *ls, rvm_context *ctx, uint32_t first,
+    uint32_t count) {
+
+    group g;
+    memset(&g, 0, sizeof(g));
+    g.prog = ls->prog;
+    g.ctx = ctx;
+    for(uint32_t l = 0; l < RVM_LANES; l ++) {
+        g.stack[l] = ctx[l].stack.contents;
+        g.heap[l] = ctx[l].heap.contents;
+    }
+    g.stack_words = ctx[0].stack.size / 4;
+    g.heap_words = ctx[0].heap.size / 4;
+    g.active = (1u << count) - 1;
+    for(uint32_t l = 0; l < count; l ++) {
+        for(int r = 0; r < 8; r ++) {
+            ctx[l].cpu.regs[r] = ls->regs[(first + l) * 8 + r];
+            g.regs[r][l] = ctx[l].cpu.regs[r];
+        }
+    }
+
+    lockstep(&g);
+    ls->lockstep_steps += g.steps;
+
+    // whatever didn't halt in lockstep finishes on its own.
+    for(uint32_t l = 0; l < count; l ++) {
+        if(!ctx[l].cpu.halted) {
+            rvm_context_run(ctx + l);
+            ls->scalar_lanes ++;
+        }
+        ls->results[first + l] = ctx[l].cpu;
+    }
+}
+
+// built for AVX2 as well, picked at load time where the CPU has it.
+__attribute__((target_clones("avx2", "default")))
+static void lockstep(group *g) {
+    const rvm_program *prog = g->prog;
+    uint32_t ip = prog->index[prog->entry];
+
+    while(g->active) {
+        const rvm_decoded *d = prog->code + ip;
+        // superinstructions run as their first instruction, as in rvm_step.
+        uint8_t dop = d->op;
+        if(dop >= RVM_DEC_CMP_JE && dop <= RVM_DEC_POP_PUSH) dop = d->type;
+
+        addresses at[3];
+        if(d->shape == RVM_SHAPE_GENERIC && dop < RVM_INST_COUNT) {
+            resolve(g, d, at);
+            // lanes whose memory operands are out of bounds leave before
+            // the instruction, to fault on their own.
+            if(!g->active) break;
+        }
+        g->steps ++;
+        uint32_t ips[RVM_LANES];
+
+        switch(dop) {
+        case RVM_INST_HLT:
+            for(uint32_t l = 0; l < RVM_LANES; l ++) {
+                if(!(g->active & (1u << l))) continue;
+                leave(g, l, d->next_pc);
+                g->ctx[l].cpu.halted = true;
+            }
+            break;
+
+#define ARITH(type, expr) \
+        case type: { \
+            lanes a, b, r; \
+            load(g, d, at, 0, &a); \
+            load(g, d, at, 1, &b); \
+            r = expr; \
+            store(g, d, at, d->optype[2] != RVM_OP_ABSENT ? 2 : 0, &r); \
+            ip ++; \
+            break; \
+        }
+        ARITH(RVM_INST_ADD, a + b)
+        ARITH(RVM_INST_SUB, a - b)
+        ARITH(RVM_INST_MUL, a * b)
+        ARITH(RVM_INST_OR, a | b)
+        ARITH(RVM_INST_AND, a & b)
+        ARITH(RVM_INST_XOR, a ^ b)
+        // as x86 does for the scalar engines
+        ARITH(RVM_INST_SHL, a << (b & 31))
+        ARITH(RVM_INST_SHR, a >> (b & 31))
+#undef ARITH
+
+        case RVM_INST_DIV: {
+            // no vector divide; lanes dividing by zero leave, to fault scalar.
+            lanes a, b, q;
+            load(g, d, at, 0, &a);
+            load(g, d, at, 1, &b);
+            q = a;
+            for(uint32_t l = 0; l < RVM_LANES; l ++) {
+                if(!(g->active & (1u << l))) continue;
+                if(b[l]) q[l] = a[l] / b[l];
+                else leave(g, l, d->pc);
+            }
+            store(g, d, at, d->optype[2] != RVM_OP_ABSENT ? 2 : 0, &q);
+            ip ++;
+            break;
+        }
+        case RVM_INST_NOT: {
+            lanes a;
+            load(g, d, at, 0, &a);
+            a = ~a;
+            store(g, d, at, d->optype[1] != RVM_OP_ABSENT ? 1 : 0, &a);
+            ip ++;
+            break;
+        }
+        case RVM_INST_CMP: {
+            lanes a, b, r;
+            load(g, d, at, 0, &a);
+            load(g, d, at, 1, &b);
+            r = a - b;
+            g->zflag = (lane_mask)(r == 0);
+            g->nflag = (lane_mask)r < 0;
+            ip ++;
+            break;
+        }
+        case RVM_INST_SWAP: {
+            lanes a, b;
+            load(g, d, at, 0, &a);
+            load(g, d, at, 1, &b);
+            store(g, d, at, 0, &b);
+            store(g, d, at, 1, &a);
+            ip ++;
+            break;
+        }
+        case RVM_INST_ENTRY:
+            ip ++;
+            break;
+
+        case RVM_INST_JMP:
+        case RVM_INST_JE:
+        case RVM_INST_JL:
+        case RVM_INST_JLE:
+        case RVM_INST_JNE:
+        case RVM_INST_JNL:
+        case RVM_INST_JNLE: {
+            uint32_t taken = taken_lanes(g, dop);
+            if(d->target != RVM_DEC_NONE && (!taken || taken == g->active)) {
+                // every lane going the same way, to a known target
+                ip = taken ? d->target : ip + 1;
+                break;
+            }
+            lanes target;
+            load(g, d, at, 0, &target);
+            for(uint32_t l = 0; l < RVM_LANES; l ++) {
+                if(!(taken & (1u << l))) ips[l] = ip + 1;
+                else if(d->target != RVM_DEC_NONE) ips[l] = d->target;
+                else ips[l] = rvm_program_jump(prog, d->pc + target[l]);
+            }
+            ip = follow(g, d, ips);
+            break;
+        }
+        case RVM_INST_CALL: {
+            if(g->sp >= g->stack_words) {
+                leave_all(g, d->pc);
+                break;
+            }
+            uint32_t next = d->target;
+            if(next == RVM_DEC_NONE) {
+                // lanes going elsewhere redo the call on their own.
+                lanes target;
+                load(g, d, at, 0, &target);
+                for(uint32_t l = 0; l < RVM_LANES; l ++)
+                    ips[l] = rvm_program_jump(prog, d->pc + target[l]);
+                next = follow(g, d, ips);
+            }
+            for(uint32_t l = 0; l < RVM_LANES; l ++) {
+                if(g->active & (1u << l))
+                    g->stack[l][g->sp] = d->next_pc;
+            }
+            g->sp ++;
+            ip = next;
+            break;
+        }
+        case RVM_INST_RET:
+            if(g->sp == 0) {
+                leave_all(g, d->pc);
+                break;
+            }
+            for(uint32_t l = 0; l < RVM_LANES; l ++) {
+                if(!(g->active & (1u << l))) continue;
+                ips[l] = rvm_program_return(prog,
+                    g->stack[l][g->sp - 1]);
+            }
+            ip = follow(g, d, ips);
+            g->sp --;
+            break;
+        case RVM_INST_PUSH: {
+            if(g->sp >= g->stack_words) {
+                leave_all(g, d->pc);
+                break;
+            }
+            lanes v;
+            load(g, d, at, 0, &v);
+            for(uint32_t l = 0; l < RVM_LANES; l ++) {
+                if(g->active & (1u << l))
+                    g->stack[l][g->sp] = v[l];
+            }
+            g->sp ++;
+            ip ++;
+            break;
+        }
+        case RVM_INST_POP: {
+            if(g->sp == 0) {
+                leave_all(g, d->pc);
+                break;
+            }
+            lanes v = {0};
+            g->sp --;
+            for(uint32_t l = 0; l < RVM_LANES; l ++) {
+                if(g->active & (1u << l))
+                    v[l] = g->stack[l][g->sp];
+            }
+            store(g, d, at, 0, &v);
+            ip ++;
+            break;
+        }
+        case RVM_INST_ALLOC: {
+            // a failed alloc leaves the allocator as it was, so the lane can
+            // redo it on its own to fail there.
+            lanes size, address = {0};
+            load(g, d, at, 0, &size);
+            for(uint32_t l = 0; l < RVM_LANES; l ++) {
+                if(!(g->active & (1u << l))) continue;
+                address[l] = rvm_alloc_block(&g->ctx[l].heap.alloc, size[l]);
+                if(!address[l]) leave(g, l, d->pc);
+            }
+            store(g, d, at, 1, &address);
+            ip ++;
+            break;
+        }
+        case RVM_INST_FREE: {
+            lanes address;
+            load(g, d, at, 1, &address);
+            for(uint32_t l = 0; l < RVM_LANES; l ++) {
+                if(!(g->active & (1u << l))) continue;
+                if(rvm_alloc_free(&g->ctx[l].heap.alloc, address[l]))
+                    leave(g, l, d->pc);
+            }
+            ip ++;
+            break;
+        }
+        default:
+            // faults, and anything else the scalar engines know better.
+            leave_all(g, d->pc);
+            break;
+        }
+    }
+}
+
+// writes lane's state back to its context, to carry on from pc.
+static void leave(group *g, uint32_t lane, uint32_t pc) {
+    rvm_cpu_state *cpu = &g->ctx[lane].cpu;
+    for(int r = 0; r < 8; r ++) cpu->regs[r] = g->regs[r][lane];
+    cpu->sp = g->sp;
+    cpu->zflag = g->zflag[lane] != 0;
+    cpu->nflag = g->nflag[lane] != 0;
+    cpu->pc = pc;
+    g->active &= ~(1u << lane);
+}
+
+static void leave_all(group *g, uint32_t pc) {
+    for(uint32_t l = 0; l < RVM_LANES; l ++) {
+        if(g->active & (1u << l)) leave(g, l, pc);
+    }
+}
+
+static inline void resolve(group *g, const rvm_decoded *d, addresses *a) {
+    for(int i = 0; i < 3; i ++) {
+        uint8_t type = d->optype[i];
+        uint32_t value = d->opval[i];
+        if(type == RVM_OP_ABSENT || type == RVM_OP_VALUE_SCONST
+            || type == RVM_OP_VALUE_REG) continue;
+
+        for(uint32_t l = 0; l < RVM_LANES; l ++) {
+            if(!(g->active & (1u << l))) continue;
+            uint64_t address;
+            switch(type) {
+            case RVM_OP_STACK_SCONST:
+                address = (uint64_t)value + g->sp;
+                break;
+            case RVM_OP_STACK_REG:
+                address = (uint64_t)g->regs[value][l] + g->sp;
+                break;
+            case RVM_OP_HEAP_SCONST:
+                address = value;
+                break;
+            default:
+                address = g->regs[value][l];
+                break;
+            }
+            a[i].lane[l] = address;
+            if(address >= g->heap_words) leave(g, l, d->pc);
+        }
+    }
+}
+
+static inline void load(const group *g, const rvm_decoded *d,
+    const addresses *a, int i, lanes *v) {
+
+    switch(d->optype[i]) {
+    case RVM_OP_VALUE_SCONST:
+        *v = (lanes){0} + d->opval[i];
+        break;
+    case RVM_OP_VALUE_REG:
+        *v = g->regs[d->opval[i]];
+        break;
+    case RVM_OP_ABSENT:
+        *v = (lanes){0};
+        break;
+    default:
+        *v = (lanes){0};
+        for(uint32_t l = 0; l < RVM_LANES; l ++) {
+            if(g->active & (1u << l))
+                (*v)[l] = g->heap[l][a[i].lane[l]];
+        }
+        break;
+    }
+}
+
+static inline void store(group *g, const rvm_decoded *d,
+    const addresses *a, int i, const lanes *v) {
+
+    switch(d->optype[i]) {
+    case RVM_OP_VALUE_REG:
+        g->regs[d->opval[i]] = *v;
+        break;
+    case RVM_OP_VALUE_SCONST:
+    case RVM_OP_ABSENT:
+        // a constant destination takes the result nowhere.
+        break;
+    default:
+        for(uint32_t l = 0; l < RVM_LANES; l ++) {
+            if(g->active & (1u << l))
+                g->heap[l][a[i].lane[l]] = (*v)[l];
+        }
+        break;
+    }
+}
+
+// active lanes taking a branch of type.
+static inline uint32_t taken_lanes(const group *g, uint8_t type) {
+    lane_mask z = g->zflag, n = g->nflag, taken;
+    switch(type) {
+    case RVM_INST_JE: taken = z; break;
+    case RVM_INST_JL: taken = n; break;
+    case RVM_INST_JLE: taken = n | z; break;
+    case RVM_INST_JNE: taken = ~z; break;
+    case RVM_INST_JNL: taken = ~n; break;
+    case RVM_INST_JNLE: taken = ~(n | z); break;
+    default: return g->active;
+    }
+    uint32_t bits = 0;
+    for(uint32_t l = 0; l < RVM_LANES; l ++) {
+        if(taken[l]) bits |= 1u << l;
+    }
+    return bits & g->active;
+}
+
+// next decoded index by lane; keeps the most lanes going the same way in
+// lockstep, and has the rest leave to redo d on their own.
+static uint32_t follow(group *g, const rvm_decoded *d, const uint32_t *ips) {
+    uint32_t first = __builtin_ctz(g->active), same = 0;
+    // only active lanes' ips are set.
+    for(uint32_t l = 0; l < RVM_LANES; l ++) {
+        if((g->active & (1u << l)) && ips[l] == ips[first]) same |= 1u << l;
+    }
+    if(same == g->active) return ips[first];
+
+    uint32_t best = 0, best_count = 0;
+    for(uint32_t l = 0; l < RVM_LANES; l ++) {
+        if(!(g->active & (1u << l))) continue;
+        uint32_t n = 0;
+        for(uint32_t m = 0; m < RVM_LANES; m ++) {
+            if((g->active & (1u << m)) && ips[m] == ips[l]) n ++;
+        }
+        if(n > best_count) {
+            best = ips[l];
+            best_count = n;
+        }
+    }
+    for(uint32_t l = 0; l < RVM_LANES; l ++) {
+        if((g->active & (1u << l)) && ips[l] != best) leave(g, l, d->pc);
+    }
+    return best;
+}
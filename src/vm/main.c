@@ -7,314 +7,671 @@
 #include <unistd.h>
 #include <sys/mman.h>
 
-#include "common/inst.h"
+#include "rvm.h"
 
-uint32_t *program;
-uint32_t program_size;
+// a client of librvm: maps program files and hands them to rvm_vm_load.
 
-typedef struct rvm_cpu_state {
-    uint32_t pc, sp;
-    uint32_t regs[8];
-    bool zflag;
-    bool nflag;
+typedef struct image {
+    void *words;
+    size_t size; // in bytes
+} image;
 
-    bool jumped;
-    bool halted;
-} rvm_cpu_state;
+static void map_image(image *img, const char *filename);
+static void load(rvm_vm *vm, const image *img, const char *filename);
+static void run_batch(rvm_vm **vms, char **filenames, uint32_t count,
+    const rvm_config *config, uint32_t jobs, uint32_t threads,
+    const rvm_snapshot *snapshot);
+static void run_sched(rvm_vm **vms, char **filenames, uint32_t count,
+    const rvm_config *config, uint32_t jobs, uint64_t quantum,
+    bool priorities);
+static void run_lockstep(rvm_vm *vm, uint32_t lanes, const uint32_t *regs);
+static void summarize(rvm_vm **vms, char **filenames, uint32_t count,
+    const rvm_cpu_state *results, uint32_t jobs);
+static void write_profile(const rvm_profile *profile, const char *path);
+static void snapshot_failed(uint8_t error, const char *path);
+static int open_stream(const char *path, bool output);
+static bool same_state(const rvm_cpu_state *a, const rvm_cpu_state *b);
+static void dump_cpu_state(const rvm_cpu_state *cpu);
 
-typedef struct rvm_mem {
-    uint32_t *contents;
-    uint32_t size;
-} rvm_mem;
+static void parse_regs(const char *arg, uint32_t *regs);
+static size_t parse_size(const char *arg);
+static void usage(const char *argv0);
 
-static void rvm_mem_add_page(rvm_mem *mem);
+int main(int argc, char *argv[]) {
+    rvm_config config;
+    rvm_config_default(&config);
+    uint32_t jobs = 0, threads = 1, lanes = 0;
+    uint64_t budget = 0, quantum = 0, interval = 97;
+    bool sched = false, priorities = false;
+    uint32_t regs[8];
+    bool set_regs = false;
+    const char *save_path = NULL, *restore_path = NULL, *object_path = NULL;
+    const char *profile_path = NULL, *metrics_path = NULL;
+    const char *trace_path = NULL;
+    const char *in_path = NULL, *out_path = NULL;
+    uint32_t trace_records = 1 << 20;
 
-static void sim_loop(rvm_cpu_state *cpu, rvm_mem *stack, rvm_mem *heap);
+    int opt;
+    while((opt = getopt(argc, argv, "e:Ft:vS:H:j:b:l:r:q:Pk:s:R:o:p:i:M:T:n:"
+        "I:O:")) != -1) {
 
-static void dump_cpu_state(rvm_cpu_state *cpu);
+        switch(opt) {
+        case 'e': {
+            int engine = rvm_engine_parse(optarg);
+            if(engine < 0) {
+                printf("Unknown engine \"%s\"\n", optarg);
+                exit(1);
+            }
+            config.engine = engine;
+            break;
+        }
+        case 'F':
+            config.report = true;
+            break;
+        case 't':
+            config.threshold = strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            config.verify = true;
+            break;
+        case 'S':
+            config.stack_size = parse_size(optarg);
+            break;
+        case 'H':
+            config.heap_size = parse_size(optarg);
+            break;
+        case 'j':
+            threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            jobs = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            budget = strtoull(optarg, NULL, 0);
+            break;
+        case 'r':
+            parse_regs(optarg, regs);
+            set_regs = true;
+            break;
+        case 'q':
+            quantum = strtoull(optarg, NULL, 0);
+            sched = true;
+            config.preempt = true;
+            break;
+        case 'P':
+            priorities = true;
+            break;
+        case 'k':
+            lanes = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            save_path = optarg;
+            break;
+        case 'R':
+            restore_path = optarg;
+            break;
+        case 'o':
+            object_path = optarg;
+            break;
+        case 'p':
+            profile_path = optarg;
+            break;
+        case 'i':
+            interval = strtoull(optarg, NULL, 0);
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'n':
+            trace_records = strtoul(optarg, NULL, 0);
+            break;
+        case 'I':
+            in_path = optarg;
+            break;
+        case 'O':
+            out_path = optarg;
+            break;
+        case 'M':
+#ifdef RVM_METRICS
+            metrics_path = optarg;
+            break;
+#else
+            printf("Built without metrics; configure with -DRVM_METRICS=ON."
+                "\n");
+            exit(1);
+#endif
+        default:
+            usage(argv[0]);
+        }
+    }
+    uint32_t count = argc - optind;
+    if(count == 0 || (count > 1 && !jobs) || (sched && !jobs)
+        || (lanes && jobs) || (save_path && (jobs || lanes))
+        || (restore_path && (sched || lanes || count > 1))
+        || (object_path && count > 1)
+        || (profile_path && (jobs || lanes || budget || !interval))
+        || (metrics_path && (jobs || lanes || budget || profile_path))
+        || (trace_path && (jobs || lanes || budget || profile_path
+            || metrics_path))
+        || ((in_path || out_path) && (jobs || lanes)))
+        usage(argv[0]);
+    if(!set_regs) memset(regs, 0, sizeof(regs));
 
-int main(int argc, char *argv[]) {
-    if(argc != 2) {
-        printf("Usage: %s program\n", argv[0]);
+    // the tiered engine rewrites the program as it runs, so it can't be
+    // shared between threads; run what it would tier up to instead.
+    if(jobs && !sched && config.engine == RVM_ENGINE_TIERED)
+        config.engine = RVM_ENGINE_FUSED;
+
+    image *images = calloc(count, sizeof(image));
+    rvm_vm **vms = calloc(count, sizeof(rvm_vm *));
+    if(!images || !vms) {
+        printf("Couldn't allocate programs.\n");
         exit(1);
     }
+    if(config.stack_size > RVM_MEM_MAX || config.heap_size > RVM_MEM_MAX) {
+        printf("Memory size is over the maximum of %zu.\n",
+            (size_t)RVM_MEM_MAX);
+        exit(1);
+    }
+    for(uint32_t i = 0; i < count; i ++) {
+        vms[i] = rvm_vm_create(&config);
+        if(!vms[i]) {
+            printf("Couldn't reserve memory: %m\n");
+            exit(1);
+        }
+        map_image(images + i, argv[optind + i]);
+        load(vms[i], images + i, argv[optind + i]);
+    }
+
+    if(object_path) {
+        switch(rvm_vm_save(vms[0], object_path)) {
+        case RVM_SAVE_OK:
+            break;
+        case RVM_SAVE_MEMORY:
+            printf("Couldn't allocate the cache section.\n");
+            exit(1);
+        default:
+            printf("Couldn't write \"%s\": %m\n", object_path);
+            exit(1);
+        }
+        printf("Wrote \"%s\"\n", object_path);
+        rvm_vm_destroy(vms[0]);
+        if(images[0].words) munmap(images[0].words, images[0].size);
+        free(vms);
+        free(images);
+        return 0;
+    }
 
-    int fd = open(argv[1], O_RDONLY);
+    rvm_snapshot snapshot;
+    if(restore_path) {
+        uint8_t error = rvm_snapshot_open(&snapshot, restore_path);
+        // restoring once up front checks it's for this program.
+        if(!error) error = rvm_vm_restore(vms[0], &snapshot, NULL);
+        if(error) snapshot_failed(error, restore_path);
+    }
+
+    if(sched) {
+        run_sched(vms, argv + optind, count, &config, jobs, quantum,
+            priorities);
+    }
+    else if(jobs) {
+        run_batch(vms, argv + optind, count, &config, jobs, threads,
+            restore_path ? &snapshot : NULL);
+    }
+    else if(lanes) run_lockstep(vms[0], lanes, regs);
+    else {
+        rvm_vm *vm = vms[0];
+        if(restore_path) {
+            double start = rvm_now();
+            uint8_t error = rvm_vm_restore(vm, &snapshot,
+                set_regs ? regs : NULL);
+            if(error) snapshot_failed(error, restore_path);
+            printf("Restored snapshot in %.1fus\n", (rvm_now() - start) * 1e6);
+        }
+        else rvm_vm_reset(vm, regs);
+        rvm_io io;
+        bool streams = in_path || out_path;
+        if(streams) {
+            if(rvm_io_init(&io, open_stream(in_path, false),
+                open_stream(out_path, true))) {
+
+                printf("Couldn't allocate the output buffer.\n");
+                exit(1);
+            }
+            rvm_vm_set_io(vm, &io);
+        }
+#ifdef RVM_METRICS
+        if(metrics_path) {
+            if(rvm_vm_metrics(vm, metrics_path)) {
+                printf("Couldn't write metrics to \"%s\": %m\n",
+                    metrics_path);
+                exit(1);
+            }
+            if(rvm_vm_state(vm)->error) {
+                rvm_vm_print_error(vm);
+                exit(1);
+            }
+            printf("Wrote metrics to \"%s\"\n", metrics_path);
+        }
+        else
+#endif
+        if(trace_path) {
+            rvm_trace trace;
+            if(rvm_trace_open(&trace, trace_path, trace_records,
+                rvm_vm_program(vm))) {
+
+                printf("Couldn't create trace \"%s\": %m\n", trace_path);
+                exit(1);
+            }
+            uint8_t error = rvm_vm_trace(vm, &trace);
+            printf("Traced %llu instructions to \"%s\"\n",
+                (unsigned long long)trace.header->head, trace_path);
+            rvm_trace_close(&trace, rvm_vm_state(vm));
+            if(error) {
+                rvm_vm_print_error(vm);
+                exit(1);
+            }
+        }
+        else if(profile_path) {
+            rvm_profile profile;
+            uint8_t error = rvm_vm_profile(vm, &profile, interval);
+            // a profile up to a fault is still worth having.
+            write_profile(&profile, profile_path);
+            rvm_profile_free(&profile);
+            if(error) {
+                rvm_vm_print_error(vm);
+                exit(1);
+            }
+        }
+        else if(rvm_vm_run(vm, budget)) {
+            rvm_vm_print_error(vm);
+            exit(1);
+        }
+        // guest output goes before the state, if they share stdout.
+        if(streams && (rvm_io_flush(&io) || io.errors)) {
+            printf("Host call input or output failed.\n");
+            exit(1);
+        }
+        if(config.report) rvm_vm_report(vm);
+        if(config.report && streams) rvm_io_report(&io);
+        dump_cpu_state(rvm_vm_state(vm));
+
+        if(save_path) {
+            rvm_snapshot saved;
+            double start = rvm_now();
+            uint8_t error = rvm_vm_snapshot(vm, &saved);
+            if(!error) error = rvm_snapshot_save(&saved, save_path);
+            if(error) snapshot_failed(error, save_path);
+            printf("Saved snapshot to \"%s\" in %.1fus\n", save_path,
+                (rvm_now() - start) * 1e6);
+            rvm_snapshot_close(&saved);
+        }
+        if(streams) {
+            if(rvm_vm_set_io(vm, NULL)) {
+                printf("Couldn't reset memory: %m\n");
+                exit(1);
+            }
+            rvm_io_free(&io);
+            if(io.in > 2) close(io.in);
+            if(io.out > 2) close(io.out);
+        }
+    }
+    if(restore_path) rvm_snapshot_close(&snapshot);
+
+    for(uint32_t i = 0; i < count; i ++) {
+        rvm_vm_destroy(vms[i]);
+        if(images[i].words) munmap(images[i].words, images[i].size);
+    }
+    free(vms);
+    free(images);
+
+    return 0;
+}
+
+static void map_image(image *img, const char *filename) {
+    int fd = open(filename, O_RDONLY);
     if(fd < 0) {
-        printf("Cannot open file \"%s\": %m\n", argv[1]);
+        printf("Cannot open file \"%s\": %m\n", filename);
         exit(1);
     }
     struct stat fds;
     fstat(fd, &fds);
 
-    program_size = fds.st_size;
-    if(program_size % 4 != 0) {
+    img->size = fds.st_size;
+    img->words = NULL;
+    if(img->size == 0) {
+        close(fd);
+        return;
+    }
+    img->words = mmap(NULL, (img->size+0xfff)&~0xfff, PROT_READ,
+        MAP_PRIVATE, fd, 0);
+
+    if(img->words == MAP_FAILED) {
+        printf("Failed to map program memory: %m\n");
+        exit(1);
+    }
+    close(fd);
+}
+
+static void load(rvm_vm *vm, const image *img, const char *filename) {
+    switch(rvm_vm_load(vm, img->words, img->size)) {
+    case RVM_LOAD_OK:
+        break;
+    case RVM_LOAD_SIZE:
         printf("Program size must be multiple of 4!\n");
         exit(1);
+    case RVM_LOAD_UNVERIFIED:
+        printf("Program failed verification.\n");
+        exit(1);
+    case RVM_LOAD_FORMAT:
+        printf("\"%s\" isn't a valid object file.\n", filename);
+        exit(1);
+    case RVM_LOAD_VERSION:
+        printf("\"%s\" is from a later version.\n", filename);
+        exit(1);
+    case RVM_LOAD_MEMORY:
+        printf("Couldn't allocate decoded program.\n");
+        exit(1);
+    default:
+        printf("Couldn't load \"%s\".\n", filename);
+        exit(1);
     }
+    // the engine asked for might not have been able to take the program.
+    uint8_t engine = rvm_vm_config(vm)->engine;
+    if(rvm_vm_engine_kind(vm) == engine) return;
+    if(engine == RVM_ENGINE_JIT)
+        printf("Couldn't compile program, interpreting instead.\n");
+    else printf("Couldn't allocate tier state, interpreting instead.\n");
+}
 
-    program = mmap(NULL, (program_size+0xfff)&~0xfff, PROT_READ, MAP_PRIVATE,
-        fd, 0);
+static void run_batch(rvm_vm **vms, char **filenames, uint32_t count,
+    const rvm_config *config, uint32_t jobs, uint32_t threads,
+    const rvm_snapshot *snapshot) {
 
-    if(!program) {
-        printf("Failed to map program memory: %m\n");
+    const rvm_program **progs = calloc(count, sizeof(rvm_program *));
+    rvm_engine *engines = calloc(count, sizeof(rvm_engine));
+    if(!progs || !engines) {
+        printf("Couldn't allocate programs.\n");
         exit(1);
     }
+    for(uint32_t i = 0; i < count; i ++) {
+        progs[i] = rvm_vm_program(vms[i]);
+        engines[i] = rvm_vm_engine(vms[i]);
+    }
 
-    rvm_mem stack, heap;
-    stack.size = 0;
-    stack.contents = NULL;
-    heap.size = 0;
-    heap.contents = NULL;
-
-    rvm_cpu_state cpu;
-    cpu.pc = 0;
-    cpu.sp = 0;
-    cpu.zflag = false; cpu.nflag = false;
-    cpu.halted = false;
-    cpu.jumped = false;
-    memset(cpu.regs, 0, sizeof(cpu.regs));
+    rvm_batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.progs = progs;
+    batch.engines = engines;
+    batch.prog_count = count;
+    batch.stack_size = config->stack_size;
+    batch.heap_size = config->heap_size;
+    batch.jobs = jobs;
+    batch.threads = threads;
+    batch.snapshot = snapshot;
+    if(rvm_batch_run(&batch)) {
+        printf("Couldn't run every job.\n");
+        exit(1);
+    }
 
-    sim_loop(&cpu, &stack, &heap);
+    printf("Batch: %u jobs on %u threads in %.6fs, %.1f jobs/s\n",
+        batch.jobs, batch.threads, batch.time, batch.jobs / batch.time);
+    for(uint32_t t = 0; t < batch.threads; t ++) {
+        printf("\tthread %u: %u jobs, %u stolen\n", t, batch.thread_jobs[t],
+            batch.thread_steals[t]);
+    }
 
-    close(fd);
+    summarize(vms, filenames, count, batch.results, jobs);
 
-    return 0;
+    rvm_batch_free(&batch);
+    free(progs);
+    free(engines);
 }
 
-static void rvm_mem_add_page(rvm_mem *mem) {
-    mem->contents = realloc(mem->contents, mem->size += 0x1000);
-    if(!mem->contents) {
-        printf("Couldn't resize memory.\n");
+// jobs contexts as green threads on this thread; with priorities, the jobs
+// of each program file run before those of the files after it.
+static void run_sched(rvm_vm **vms, char **filenames, uint32_t count,
+    const rvm_config *config, uint32_t jobs, uint64_t quantum,
+    bool priorities) {
+
+    rvm_context *contexts = calloc(jobs, sizeof(rvm_context));
+    rvm_context **tasks = calloc(jobs, sizeof(rvm_context *));
+    uint8_t *priority = calloc(jobs, 1);
+    rvm_cpu_state *results = calloc(jobs, sizeof(rvm_cpu_state));
+    if(!contexts || !tasks || !priority || !results) {
+        printf("Couldn't allocate tasks.\n");
         exit(1);
     }
-}
+    for(uint32_t j = 0; j < jobs; j ++) {
+        rvm_vm *vm = vms[j % count];
+        if(rvm_context_init(contexts + j, rvm_vm_program(vm),
+            rvm_vm_engine(vm), config->stack_size, config->heap_size)) {
 
-static void sim_loop(rvm_cpu_state *cpu, rvm_mem *stack, rvm_mem *heap) {
-    uint32_t heap_top = 0;
-    rvm_inst inst;
-    while(!cpu->halted) {
-        uint32_t ni;
-        uint32_t following[3];
-        uint32_t opfollow[3];
-        uint32_t following_count = 0;
-        if(cpu->pc*4 >= program_size) {
-            printf("Tried to execute past end of program.\n");
+            printf("Couldn't reserve memory: %m\n");
             exit(1);
         }
+        tasks[j] = contexts + j;
+        priority[j] = j % count;
+        if(priority[j] >= RVM_SCHED_LEVELS) priority[j] = RVM_SCHED_LEVELS - 1;
+    }
 
-        uint32_t old_pc = cpu->pc;
-        ni = program[cpu->pc++];
-        rvm_inst_to_struct(ni, &inst);
-        for(int i = 0; i < 3; i ++) {
-            if(inst.optype[i] % 3 == 1) { // lconst
-                opfollow[i] = following_count;
-                if(cpu->pc*4 >= program_size) {
-                    printf("Instruction extends past end of program\n");
-                    exit(1);
-                }
-                following[following_count++] = program[cpu->pc++];
-            }
-        }
+    rvm_sched sched;
+    memset(&sched, 0, sizeof(sched));
+    sched.tasks = tasks;
+    sched.priority = priorities ? priority : NULL;
+    sched.count = jobs;
+    sched.quantum = quantum;
+    if(rvm_sched_run(&sched)) {
+        printf("Couldn't allocate scheduler state.\n");
+        exit(1);
+    }
+    rvm_sched_report(&sched);
 
-        if(cpu->jumped && inst.type != RVM_INST_ENTRY) {
-            printf("Jumped to non-entry instruction!\n");
-            exit(1);
-        }
-        else if(cpu->jumped) cpu->jumped = false;
+    for(uint32_t j = 0; j < jobs; j ++) {
+        results[j] = contexts[j].cpu;
+        rvm_context_free(contexts + j);
+    }
+    summarize(vms, filenames, count, results, jobs);
 
-        if(rvm_inst_check_valid(&inst)) {
-            printf("Invalid %s instruction!\n",
-                rvm_inst_type_strings[inst.type]);
-            exit(1);
-        }
-        // as an optimization, skip the operand parsing for entry.
-        if(inst.type == RVM_INST_ENTRY) continue;
-
-        // constants, if a target for *op is needed
-        uint32_t opc[3];
-        uint32_t *op[3];
-        for(int i = 0; i < 3; i ++) {
-            if(inst.optype[i] == RVM_OP_ABSENT) {
-                op[i] = NULL;
-                continue;
-            }
-            switch(inst.optype[i] % 3) {
-            case 0: // sconst
-                opc[i] = inst.opval[i];
-                op[i] = opc + i;
-                break;
-            case 1: // lconst
-                op[i] = following + opfollow[i];
-                break;
-            case 2: // reg
-                op[i] = cpu->regs + inst.opval[i];
-                break;
-            }
+    rvm_sched_free(&sched);
+    free(contexts);
+    free(tasks);
+    free(priority);
+    free(results);
+}
 
-            switch(inst.optype[i] / 3) {
-            case 0: // value
-                break;
-            case 1: // stack
-                // todo: check for over/underflow
-                // todo: check if within stack frame
-                op[i] = heap->contents + *op[i] + cpu->sp;
-                break;
-            case 2: // heap
-                op[i] = heap->contents + *op[i];
-                break;
-            }
-        }
+// lanes copies of the program, lane i starting with regs but for r0 + i, in
+// lockstep, then again one at a time to check against and compare with.
+static void run_lockstep(rvm_vm *vm, uint32_t lanes, const uint32_t *regs) {
+    uint32_t *lane_regs = malloc((size_t)(lanes ? lanes : 1) * 8
+        * sizeof(uint32_t));
+    if(!lane_regs) {
+        printf("Couldn't allocate lanes.\n");
+        exit(1);
+    }
+    for(uint32_t i = 0; i < lanes; i ++) {
+        memcpy(lane_regs + i * 8, regs, 8 * sizeof(uint32_t));
+        lane_regs[i * 8] += i;
+    }
 
-        switch(inst.type) {
-        case RVM_INST_HLT:
-            cpu->halted = true;
-            break;
-        case RVM_INST_ADD:
-            if(op[2]) *op[2] = *op[0] + *op[1];
-            else *op[0] += *op[1];
-            break;
-        case RVM_INST_SUB:
-            if(op[2]) *op[2] = *op[0] - *op[1];
-            else *op[0] -= *op[1];
-            break;
-        case RVM_INST_MUL:
-            if(op[2]) *op[2] = *op[0] * *op[1];
-            else *op[0] *= *op[1];
-            break;
-        case RVM_INST_DIV:
-            if(op[2]) *op[2] = *op[0] / *op[1];
-            else *op[0] /= *op[1];
-            break;
-        case RVM_INST_OR:
-            if(op[2]) *op[2] = *op[0] | *op[1];
-            else *op[0] |= *op[1];
-            break;
-        case RVM_INST_AND:
-            if(op[2]) *op[2] = *op[0] & *op[1];
-            else *op[0] &= *op[1];
-            break;
-        case RVM_INST_NOT:
-            if(op[1]) *op[1] = ~ *op[0];
-            else *op[0] = ~*op[0];
-            break;
-        case RVM_INST_XOR:
-            if(op[2]) *op[2] = *op[0] ^ *op[1];
-            else *op[0] ^= *op[1];
-            break;
-        case RVM_INST_SHL:
-            if(op[2]) *op[2] = *op[0] << *op[1];
-            else *op[0] <<= *op[1];
-            break;
-        case RVM_INST_SHR:
-            if(op[2]) *op[2] = *op[0] >> *op[1];
-            else *op[0] >>= *op[1];
-            break;
-        case RVM_INST_CMP: {
-            uint32_t result = *op[0] - *op[1];
-            if(result == 0) cpu->zflag = true;
-            else cpu->zflag = false;
-            if(result & (1<<31)) cpu->nflag = true;
-            else cpu->nflag = false;
-            break;
-        }
-        case RVM_INST_ENTRY: // naught to do.
-            break;
-        case RVM_INST_JMP:
-            cpu->pc += *op[0] - 1;
-            cpu->jumped = true;
-            break;
-        case RVM_INST_JE:
-            if(cpu->zflag) {
-                cpu->pc = old_pc + *op[0];
-                cpu->jumped = true;
-            }
-            break;
-        case RVM_INST_JL:
-            if(cpu->nflag) {
-                cpu->pc = old_pc + *op[0];
-                cpu->jumped = true;
-            }
-            break;
-        case RVM_INST_JLE:
-            if(cpu->nflag && cpu->zflag) {
-                cpu->pc = old_pc + *op[0];
-                cpu->jumped = true;
-            }
-            break;
-        case RVM_INST_JNE:
-            if(!cpu->zflag) {
-                cpu->pc = old_pc + *op[0];
-                cpu->jumped = true;
-            }
-            break;
-        case RVM_INST_JNL:
-            if(!cpu->nflag) {
-                cpu->pc = old_pc + *op[0];
-                cpu->jumped = true;
-            }
-            break;
-        case RVM_INST_JNLE:
-            if(!cpu->nflag && !cpu->zflag) {
-                cpu->pc = old_pc + *op[0];
-                cpu->jumped = true;
-            }
-            break;
-        case RVM_INST_CALL:
-            // TODO: establish new frame
-            if(cpu->sp * 4 + 4 >= stack->size) rvm_mem_add_page(stack);
-            stack->contents[cpu->sp ++] = cpu->pc;
-            cpu->pc = old_pc + *op[0];
-            cpu->jumped = true;
+    rvm_lockstep ls;
+    memset(&ls, 0, sizeof(ls));
+    ls.prog = rvm_vm_program(vm);
+    ls.engine = rvm_vm_engine(vm);
+    ls.stack_size = rvm_vm_config(vm)->stack_size;
+    ls.heap_size = rvm_vm_config(vm)->heap_size;
+    ls.lanes = lanes;
+    ls.regs = lane_regs;
+    if(rvm_lockstep_run(&ls)) {
+        printf("Couldn't set up lockstep lanes: %m\n");
+        exit(1);
+    }
 
-            break;
-        case RVM_INST_RET:
-            // TODO: remove old frame
-            cpu->pc = stack->contents[-- cpu->sp];
-            cpu->jumped = false; // returns are always to valid targets due to frame system
+    printf("Lockstep: %u lanes in %.6fs, %.1f lanes/s\n", lanes, ls.time,
+        lanes / ls.time);
+    printf("\t%llu instructions in lockstep, %u lanes finished alone\n",
+        (unsigned long long)ls.lockstep_steps, ls.scalar_lanes);
 
-            break;
-        case RVM_INST_PUSH:
-            if(cpu->sp * 4 + 4 >= stack->size) rvm_mem_add_page(stack);
-            stack->contents[cpu->sp ++] = *op[0];
-            break;
-        case RVM_INST_POP:
-            // TODO: check frame limits
-            if(cpu->sp == 0) {
-                 printf("Stack underflow!\n");
-                 exit(1);
-            }
-            *op[0] = stack->contents[-- cpu->sp];
-            break;
-        case RVM_INST_SWAP: {
-            uint32_t t = *op[0];
-            *op[0] = *op[1];
-            *op[1] = t;
-            break;
-        }
-        case RVM_INST_ALLOC: {
-            // watermark allocator . . . sigh.
-            while(heap_top + *op[0] >= heap->size) {
-                heap->size += 0x1000;
-                rvm_mem_add_page(heap);
-            }
-            *op[1] = heap_top;
-            heap_top += *op[0];
-            break;
+    uint32_t mismatches = 0;
+    double start = rvm_now();
+    for(uint32_t i = 0; i < lanes; i ++) {
+        rvm_vm_reset(vm, lane_regs + i * 8);
+        rvm_vm_run(vm, 0);
+        if(!same_state(rvm_vm_state(vm), ls.results + i)) {
+            if(!mismatches) printf("Lane %u differs from a separate run.\n", i);
+            mismatches ++;
         }
-        case RVM_INST_FREE:
-            // TODO
-            break;
-        default:
-            printf("Instruction NYI.\n");
-            break;
+    }
+    double time = rvm_now() - start;
+    printf("Separately: %u lanes in %.6fs, %.1f lanes/s\n", lanes, time,
+        lanes / time);
+    printf("%u of %u lanes match separate runs\n", lanes - mismatches, lanes);
+
+    if(lanes) {
+        rvm_context first;
+        first.prog = ls.prog;
+        first.cpu = ls.results[0];
+        if(first.cpu.error) rvm_context_print_error(&first);
+        else dump_cpu_state(&first.cpu);
+    }
+
+    rvm_lockstep_free(&ls);
+    free(lane_regs);
+}
+
+// per program file, whether all its jobs ended the same way, and how.
+static void summarize(rvm_vm **vms, char **filenames, uint32_t count,
+    const rvm_cpu_state *results, uint32_t jobs) {
+
+    for(uint32_t i = 0; i < count && i < jobs; i ++) {
+        uint32_t runs = 0, errors = 0;
+        bool consistent = true;
+        for(uint32_t j = i; j < jobs; j += count) {
+            runs ++;
+            if(results[j].error) errors ++;
+            if(!same_state(results + j, results + i)) consistent = false;
         }
+        printf("%s: %u runs, %u errors, %s\n", filenames[i], runs, errors,
+            consistent ? "all results match" : "results differ");
+
+        rvm_context first;
+        first.prog = rvm_vm_program(vms[i]);
+        first.cpu = results[i];
+        if(first.cpu.error) rvm_context_print_error(&first);
+        else dump_cpu_state(&first.cpu);
     }
+}
+
+static void write_profile(const rvm_profile *profile, const char *path) {
+    FILE *out = fopen(path, "w");
+    int failed = !out || rvm_profile_write(profile, out);
+    if(out && fclose(out)) failed = 1;
+    if(failed) {
+        printf("Couldn't write profile to \"%s\": %m\n", path);
+        exit(1);
+    }
+    rvm_profile_report(profile);
+    printf("Wrote profile to \"%s\"\n", path);
+}
+
+static void snapshot_failed(uint8_t error, const char *path) {
+    switch(error) {
+    case RVM_SNAPSHOT_IO:
+        printf("Couldn't use snapshot \"%s\": %m\n", path);
+        break;
+    case RVM_SNAPSHOT_FORMAT:
+        printf("\"%s\" isn't a snapshot from this version.\n", path);
+        break;
+    case RVM_SNAPSHOT_MISMATCH:
+        printf("Snapshot \"%s\" is of another program or memory size.\n",
+            path);
+        break;
+    default:
+        printf("Couldn't use snapshot \"%s\".\n", path);
+        break;
+    }
+    exit(1);
+}
+
+// path opened for host calls, "-" being stdin or stdout, or -1 for none.
+static int open_stream(const char *path, bool output) {
+    if(!path) return -1;
+    if(!strcmp(path, "-")) {
+        // anything printed so far goes before what the program writes.
+        if(output) fflush(stdout);
+        return output ? 1 : 0;
+    }
+    int fd = output ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+        : open(path, O_RDONLY);
+    if(fd < 0) {
+        printf("Cannot open file \"%s\": %m\n", path);
+        exit(1);
+    }
+    return fd;
+}
+
+static bool same_state(const rvm_cpu_state *a, const rvm_cpu_state *b) {
+    // after a guard page fault, the rest of the state is wherever the engine
+    // last wrote it back, which depends on how the run got there.
+    if(a->error >= RVM_ERR_STACK_OVERFLOW && a->error <= RVM_ERR_HEAP_BOUNDS)
+        return a->error == b->error;
+    return a->pc == b->pc && a->sp == b->sp && a->zflag == b->zflag
+        && a->nflag == b->nflag && a->error == b->error
+        && !memcmp(a->regs, b->regs, sizeof(a->regs));
+}
+
+// up to 8 comma-separated values, for r0 onwards; the rest are zeroed.
+static void parse_regs(const char *arg, uint32_t *regs) {
+    memset(regs, 0, 8 * sizeof(uint32_t));
+    const char *p = arg;
+    for(int i = 0; i < 8; i ++) {
+        char *end;
+        regs[i] = strtoul(p, &end, 0);
+        if(end == p || (*end && *end != ',')) break;
+        if(!*end) return;
+        p = end + 1;
+    }
+    printf("Unknown registers \"%s\"\n", arg);
+    exit(1);
+}
+
+// bytes, with an optional k, m or g suffix.
+static size_t parse_size(const char *arg) {
+    char *end;
+    size_t size = strtoull(arg, &end, 0);
+    switch(*end) {
+    case 'k': case 'K': size <<= 10; end ++; break;
+    case 'm': case 'M': size <<= 20; end ++; break;
+    case 'g': case 'G': size <<= 30; end ++; break;
+    default: break;
+    }
+    if(end == arg || *end) {
+        printf("Unknown size \"%s\"\n", arg);
+        exit(1);
+    }
+    return size;
+}
 
-    dump_cpu_state(cpu);
+static void usage(const char *argv0) {
+    printf("Usage: %s [-e tiered|switch|threaded|fused|jit] [-t threshold] "
+        "[-S stack-size] [-H heap-size] [-l budget] [-r r0,r1,...] [-F] [-v] "
+        "[-R snapshot] [-s snapshot] [-I input] [-O output] program\n",
+        argv0);
+    printf("       %s -b jobs [-j threads] [options] program...\n", argv0);
+    printf("       %s -b jobs [-j threads] -R snapshot [options] program\n",
+        argv0);
+    printf("       %s -b jobs -q quantum [-P] [options] program...\n", argv0);
+    printf("       %s -k lanes [options] program\n", argv0);
+    printf("       %s -o object [-v] program\n", argv0);
+    printf("       %s -p profile [-i interval] [options] program\n", argv0);
+    printf("       %s -T trace [-n records] [options] program\n", argv0);
+#ifdef RVM_METRICS
+    printf("       %s -M metrics.json [options] program\n", argv0);
+#endif
+    exit(1);
 }
 
-static void dump_cpu_state(rvm_cpu_state *cpu) {
+static void dump_cpu_state(const rvm_cpu_state *cpu) {
     printf("\tCPU state:\n");
     printf("\t\tPC: %x\n", cpu->pc);
     printf("\t\tSP: %x\n", cpu->sp);
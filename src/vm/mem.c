@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "vm.h"
+
+// every region reserves enough address space that no uint32_t word index,
+// even with sp added on top, can reach past it; only the first size bytes
+// are accessible, and the rest faults.
+#define RESERVE ((size_t)1 << 35)
+// a popped or returned-through sp of 0 wraps around to index 0xffffffff,
+// which lands up here; overflows land just past size.
+#define UNDERFLOW_OFFSET ((size_t)1 << 33)
+
+#define MAX_REGIONS 4096
+
+static rvm_mem *regions[MAX_REGIONS];
+
+static void fault_handler(int sig, siginfo_t *info, void *context);
+
+int rvm_mem_reserve(rvm_mem *mem, size_t size, uint8_t kind) {
+    mem->contents = NULL;
+    mem->size = 0;
+    mem->fd = -1;
+    if(size > RVM_MEM_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    size = (size + 0xfff) & ~(size_t)0xfff;
+
+    void *contents = mmap(NULL, RESERVE, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(contents == MAP_FAILED) return -1;
+    // pages are only backed once touched.
+    if(size && mprotect(contents, size, PROT_READ | PROT_WRITE)) {
+        munmap(contents, RESERVE);
+        return -1;
+    }
+    mem->contents = contents;
+    mem->size = size;
+    mem->kind = kind;
+    mem->offset = 0;
+    rvm_alloc_init(&mem->alloc, mem->contents, size / 4);
+
+    int i;
+    for(i = 0; i < MAX_REGIONS; i ++) {
+        if(__sync_bool_compare_and_swap(regions + i, NULL, mem)) break;
+    }
+    if(i == MAX_REGIONS) {
+        rvm_mem_release(mem);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    static int installed;
+    if(__sync_bool_compare_and_swap(&installed, 0, 1)) {
+        struct sigaction sa;
+        sa.sa_sigaction = fault_handler;
+        // SIGSEGV stays unblocked in the handler, so jumping out of it
+        // leaves the signal mask as it was.
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGSEGV, &sa, NULL);
+    }
+    return 0;
+}
+
+void rvm_mem_release(rvm_mem *mem) {
+    for(int i = 0; i < MAX_REGIONS; i ++) {
+        if(regions[i] == mem) regions[i] = NULL;
+    }
+    if(mem->contents) munmap(mem->contents, RESERVE);
+    if(mem->fd >= 0) close(mem->fd);
+    mem->fd = -1;
+    mem->contents = NULL;
+    mem->size = 0;
+}
+
+int rvm_mem_reset(rvm_mem *mem) {
+    if(mem->fd >= 0) {
+        // dropping the pages would only bring back the snapshot's, so
+        // swap in fresh anonymous memory.
+        if(mmap(mem->contents, mem->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0)
+            == MAP_FAILED) return -1;
+        close(mem->fd);
+        mem->fd = -1;
+    }
+    // drops the pages, so they read as zero again when next touched.
+    else if(mem->size && madvise(mem->contents, mem->size, MADV_DONTNEED))
+        return -1;
+    rvm_alloc_init(&mem->alloc, mem->contents, mem->size / 4);
+    return 0;
+}
+
+int rvm_mem_map(rvm_mem *mem, int fd, size_t offset) {
+    int dup_fd = dup(fd);
+    if(dup_fd < 0) return -1;
+    if(mem->size && mmap(mem->contents, mem->size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+
+        close(dup_fd);
+        return -1;
+    }
+    if(mem->fd >= 0) close(mem->fd);
+    mem->fd = dup_fd;
+    mem->offset = offset;
+    return 0;
+}
+
+uint32_t rvm_mem_alloc(rvm_mem *heap, uint32_t size, rvm_cpu_state *cpu) {
+    uint32_t address = rvm_alloc_block(&heap->alloc, size);
+    if(!address) {
+        cpu->error = RVM_ERR_OUT_OF_MEMORY;
+        cpu->halted = true;
+    }
+    return address;
+}
+
+void rvm_mem_free(rvm_mem *heap, uint32_t address, rvm_cpu_state *cpu) {
+    if(rvm_alloc_free(&heap->alloc, address)) {
+        cpu->error = RVM_ERR_INVALID_FREE;
+        cpu->halted = true;
+    }
+}
+
+void rvm_mem_report(const rvm_mem *heap) {
+    const rvm_alloc *a = &heap->alloc;
+    printf("Heap report:\n");
+    printf("\tallocs: %llu, frees: %llu\n", (unsigned long long)a->allocs,
+        (unsigned long long)a->frees);
+    printf("\tlive: %llu bytes\n", (unsigned long long)a->live * 4);
+    printf("\tfootprint: %llu bytes\n", (unsigned long long)a->top * 4);
+    printf("\thigh-water mark: %llu bytes\n",
+        (unsigned long long)a->high_water * 4);
+    // headers, unused class space and free blocks below the top
+    double fragmentation = 0;
+    if(a->top) fragmentation = 1 - (double)a->live / a->top;
+    printf("\tfragmentation: %.1f%%\n", fragmentation * 100);
+}
+
+static void fault_handler(int sig, siginfo_t *info, void *context) {
+    uint8_t *address = info->si_addr;
+    for(int i = 0; i < MAX_REGIONS; i ++) {
+        rvm_mem *mem = regions[i];
+        if(!mem) continue;
+        uint8_t *base = (uint8_t *)mem->contents;
+        if(address < base || address >= base + RESERVE) continue;
+
+        // the fault is always on a guest access from engine code, so
+        // jumping back out of it to the running context is safe.
+        size_t offset = address - base;
+        if(mem->kind == RVM_MEM_HEAP) rvm_context_fault(RVM_ERR_HEAP_BOUNDS);
+        else if(offset >= UNDERFLOW_OFFSET)
+            rvm_context_fault(RVM_ERR_STACK_UNDERFLOW);
+        else rvm_context_fault(RVM_ERR_STACK_OVERFLOW);
+        // only back here with no context running.
+        break;
+    }
+
+    // not ours, or nothing to go back to; crash as usual.
+    signal(SIGSEGV, SIG_DFL);
+}
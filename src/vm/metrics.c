@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "vm.h"
+
+#ifdef RVM_METRICS
+
+#define PAGE 4096
+#define SLICE (1 << 20) // instructions between checks for SIGUSR1
+
+static const char *optype_names[RVM_OP_TYPES] = {
+    "sconst", "lconst", "reg",
+    "stack_sconst", "stack_lconst", "stack_reg",
+    "heap_sconst", "heap_lconst", "heap_reg",
+    "absent",
+};
+
+static const char *error_names[] = {
+    [RVM_OK] = "ok",
+    [RVM_ERR_END] = "end",
+    [RVM_ERR_TRUNCATED] = "truncated",
+    [RVM_ERR_INVALID] = "invalid",
+    [RVM_ERR_BADJUMP] = "badjump",
+    [RVM_ERR_BADRET] = "badret",
+    [RVM_ERR_STACK_OVERFLOW] = "stack_overflow",
+    [RVM_ERR_STACK_UNDERFLOW] = "stack_underflow",
+    [RVM_ERR_HEAP_BOUNDS] = "heap_bounds",
+    [RVM_ERR_OUT_OF_MEMORY] = "out_of_memory",
+    [RVM_ERR_INVALID_FREE] = "invalid_free",
+    [RVM_ERR_BUDGET] = "budget",
+    [RVM_ERR_FUEL] = "fuel",
+    [RVM_ERR_DIV_ZERO] = "div_zero",
+    [RVM_ERR_HOST_IO] = "host_io",
+    [RVM_ERR_HOST_MEMORY] = "host_memory",
+};
+
+static volatile sig_atomic_t dump_requested;
+
+static void grew(rvm_metrics *m, uint8_t kind);
+static int dump(const rvm_metrics *m, const rvm_context *ctx,
+    const char *path);
+static void request_dump(int sig);
+
+int rvm_metrics_init(rvm_metrics *metrics, const rvm_program *prog) {
+    rvm_metrics *m = metrics;
+    memset(m, 0, sizeof(*m));
+    m->prog = prog;
+    m->shape = calloc(prog->count + 3, sizeof(uint16_t));
+    m->growth = malloc(sizeof(rvm_metrics_growth) * RVM_METRICS_MAX_GROWTH);
+    if(!m->shape || !m->growth) return 1;
+    // decoding folds lconsts into sconsts; the encoding is what's wanted.
+    for(uint32_t i = 0; i < prog->count; i ++) {
+        rvm_inst inst;
+        rvm_inst_to_struct(prog->words[prog->code[i].pc], &inst);
+        m->shape[i] = inst.optype[0] * 100 + inst.optype[1] * 10
+            + inst.optype[2];
+    }
+    return 0;
+}
+
+void rvm_metrics_free(rvm_metrics *metrics) {
+    free(metrics->shape);
+    free(metrics->growth);
+}
+
+void rvm_metrics_count(rvm_metrics *metrics, const rvm_context *ctx,
+    uint32_t ip) {
+
+    rvm_metrics *m = metrics;
+    const rvm_cpu_state *cpu = &ctx->cpu;
+    if(cpu->error) return;
+    const rvm_decoded *d = m->prog->code + ip;
+    uint8_t type = d->type;
+    if(type >= RVM_INST_COUNT) return;
+
+    m->instructions ++;
+    m->types[type] ++;
+    m->shapes[m->shape[ip]] ++;
+    switch(type) {
+    case RVM_INST_JE: case RVM_INST_JL: case RVM_INST_JLE:
+    case RVM_INST_JNE: case RVM_INST_JNL: case RVM_INST_JNLE: {
+        // flags are as the branch saw them, as it doesn't set them.
+        bool z = cpu->zflag, n = cpu->nflag, taken;
+        switch(type) {
+        case RVM_INST_JE: taken = z; break;
+        case RVM_INST_JL: taken = n; break;
+        case RVM_INST_JLE: taken = n || z; break;
+        case RVM_INST_JNE: taken = !z; break;
+        case RVM_INST_JNL: taken = !n; break;
+        default: taken = !n && !z; break;
+        }
+        if(taken) m->taken[type] ++;
+        else m->not_taken[type] ++;
+        break;
+    }
+    case RVM_INST_CALL:
+        m->calls ++;
+        if(++ m->depth > m->max_depth) m->max_depth = m->depth;
+        break;
+    case RVM_INST_RET:
+        m->returns ++;
+        // returning through an address pushed some other way
+        if(m->depth) m->depth --;
+        break;
+    }
+
+    uint64_t stack = ((uint64_t)cpu->sp * 4 + PAGE - 1) / PAGE * PAGE;
+    if(stack > m->stack_size) {
+        m->stack_size = stack;
+        grew(m, RVM_MEM_STACK);
+    }
+    uint64_t heap = ((uint64_t)ctx->heap.alloc.top * 4 + PAGE - 1) / PAGE
+        * PAGE;
+    if(heap > m->heap_size) {
+        m->heap_size = heap;
+        grew(m, RVM_MEM_HEAP);
+    }
+}
+
+int rvm_metrics_run(rvm_metrics *metrics, rvm_context *ctx,
+    const char *path) {
+
+    struct sigaction sa, old;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_dump;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, &old);
+    dump_requested = 0;
+
+    metrics->start = rvm_now();
+    ctx->metrics = metrics;
+    ctx->fuel = 0;
+    for(;;) {
+        ctx->budget = SLICE;
+        uint8_t error = rvm_context_run(ctx);
+        ctx->budget = 0;
+        if(error != RVM_ERR_BUDGET) break;
+        ctx->cpu.error = RVM_OK;
+        ctx->cpu.halted = false;
+        if(dump_requested) {
+            dump_requested = 0;
+            dump(metrics, ctx, path);
+        }
+    }
+    ctx->metrics = NULL;
+    sigaction(SIGUSR1, &old, NULL);
+
+    return dump(metrics, ctx, path);
+}
+
+int rvm_metrics_write(const rvm_metrics *metrics, const rvm_context *ctx,
+    FILE *out) {
+
+    const rvm_metrics *m = metrics;
+    const rvm_cpu_state *cpu = &ctx->cpu;
+    double seconds = rvm_now() - m->start;
+    uint8_t error = cpu->error;
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"program\": {\"size\": %u, \"hash\": %u},\n",
+        m->prog->size, m->prog->hash);
+    fprintf(out, "  \"running\": %s,\n", cpu->halted ? "false" : "true");
+    fprintf(out, "  \"error\": \"%s\",\n",
+        error < sizeof(error_names) / sizeof(*error_names)
+        ? error_names[error] : "unknown");
+    fprintf(out, "  \"instructions\": %llu,\n",
+        (unsigned long long)m->instructions);
+    fprintf(out, "  \"seconds\": %.6f,\n", seconds);
+    fprintf(out, "  \"mips\": %.3f,\n",
+        seconds > 0 ? m->instructions / seconds / 1e6 : 0);
+
+    fprintf(out, "  \"types\": {");
+    const char *sep = "";
+    for(int t = 0; t < RVM_INST_COUNT; t ++) {
+        if(!m->types[t]) continue;
+        fprintf(out, "%s\n    \"%s\": %llu", sep, rvm_inst_type_strings[t],
+            (unsigned long long)m->types[t]);
+        sep = ",";
+    }
+    fprintf(out, "\n  },\n");
+
+    // as "first,second,third" operand types
+    fprintf(out, "  \"shapes\": {");
+    sep = "";
+    for(int s = 0; s < RVM_METRICS_SHAPES; s ++) {
+        if(!m->shapes[s]) continue;
+        fprintf(out, "%s\n    \"%s,%s,%s\": %llu", sep,
+            optype_names[s / 100], optype_names[s / 10 % 10],
+            optype_names[s % 10], (unsigned long long)m->shapes[s]);
+        sep = ",";
+    }
+    fprintf(out, "\n  },\n");
+
+    fprintf(out, "  \"branches\": {");
+    sep = "";
+    uint64_t taken = 0, not_taken = 0;
+    for(int t = RVM_INST_JE; t <= RVM_INST_JNLE; t ++) {
+        uint64_t runs = m->taken[t] + m->not_taken[t];
+        taken += m->taken[t];
+        not_taken += m->not_taken[t];
+        if(!runs) continue;
+        fprintf(out, "%s\n    \"%s\": {\"taken\": %llu, \"not_taken\": %llu, "
+            "\"taken_ratio\": %.6f}", sep, rvm_inst_type_strings[t],
+            (unsigned long long)m->taken[t],
+            (unsigned long long)m->not_taken[t],
+            (double)m->taken[t] / runs);
+        sep = ",";
+    }
+    fprintf(out, "%s\n    \"all\": {\"taken\": %llu, \"not_taken\": %llu, "
+        "\"taken_ratio\": %.6f}\n  },\n", sep, (unsigned long long)taken,
+        (unsigned long long)not_taken,
+        taken + not_taken ? (double)taken / (taken + not_taken) : 0);
+
+    fprintf(out, "  \"calls\": {\"calls\": %llu, \"returns\": %llu, "
+        "\"max_depth\": %u},\n", (unsigned long long)m->calls,
+        (unsigned long long)m->returns, m->max_depth);
+
+    fprintf(out, "  \"memory\": {\n");
+    fprintf(out, "    \"stack_size\": %llu,\n",
+        (unsigned long long)m->stack_size);
+    fprintf(out, "    \"heap_size\": %llu,\n",
+        (unsigned long long)m->heap_size);
+    fprintf(out, "    \"growth_events\": %llu,\n",
+        (unsigned long long)m->growth_events);
+    fprintf(out, "    \"growth\": [");
+    for(uint32_t i = 0; i < m->growth_count; i ++) {
+        const rvm_metrics_growth *g = m->growth + i;
+        fprintf(out, "%s\n      {\"instruction\": %llu, \"region\": \"%s\", "
+            "\"stack_size\": %llu, \"heap_size\": %llu}", i ? "," : "",
+            (unsigned long long)g->instruction,
+            g->kind == RVM_MEM_STACK ? "stack" : "heap",
+            (unsigned long long)g->stack_size,
+            (unsigned long long)g->heap_size);
+    }
+    fprintf(out, "%s]\n  }\n}\n", m->growth_count ? "\n    " : "");
+    return ferror(out);
+}
+
+// the region of kind has reached a page it hadn't before.
+static void grew(rvm_metrics *m, uint8_t kind) {
+    m->growth_events ++;
+    if(m->growth_count == RVM_METRICS_MAX_GROWTH) return;
+    rvm_metrics_growth *g = m->growth + m->growth_count ++;
+    g->instruction = m->instructions;
+    g->kind = kind;
+    g->stack_size = m->stack_size;
+    g->heap_size = m->heap_size;
+}
+
+// writes the metrics through a temporary file renamed over path, so readers
+// never see half of them.
+static int dump(const rvm_metrics *m, const rvm_context *ctx,
+    const char *path) {
+
+    size_t length = strlen(path);
+    char *temp = malloc(length + 5);
+    if(!temp) return 1;
+    sprintf(temp, "%s.tmp", path);
+    FILE *out = fopen(temp, "w");
+    int failed = !out || rvm_metrics_write(m, ctx, out);
+    if(out && fclose(out)) failed = 1;
+    if(!failed && rename(temp, path)) failed = 1;
+    if(failed) remove(temp);
+    free(temp);
+    return failed;
+}
+
+static void request_dump(int sig) {
+    dump_requested = 1;
+}
+
+#endif
@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+
+#define NO_STACK 0xffffffff
+
+typedef struct label {
+    uint32_t address;
+    uint32_t order; // of definition, to break ties
+    const char *name;
+} label;
+
+static uint32_t label_of(const rvm_profile *p, uint32_t pc);
+static void capture(rvm_profile *p, const rvm_context *ctx);
+static int commit(rvm_profile *p, uint64_t weight);
+static uint32_t find_stack(rvm_profile *p, const uint32_t *frames,
+    uint32_t depth, uint32_t hash);
+static int grow_table(rvm_profile *p);
+static int by_address(const void *a, const void *b);
+
+int rvm_profile_init(rvm_profile *profile, const rvm_program *prog,
+    const rvm_object *obj) {
+
+    rvm_profile *p = profile;
+    memset(p, 0, sizeof(*p));
+    p->prog = prog;
+
+    // labels from the symbols, or failing that, one per entry.
+    uint32_t count = 0;
+    label *labels;
+    if(obj && obj->symbol_count) {
+        labels = malloc(sizeof(label) * obj->symbol_count);
+        if(!labels) return 1;
+        for(uint32_t i = 0; i < obj->symbol_count; i ++) {
+            const char *name = rvm_object_symbol_name(obj, i);
+            if(!name || obj->symbols[i].value > prog->size) continue;
+            labels[count].address = obj->symbols[i].value;
+            labels[count].order = count;
+            labels[count ++].name = name;
+        }
+    }
+    else {
+        uint32_t entries = 0;
+        for(uint32_t i = 0; i < prog->count; i ++)
+            entries += prog->code[i].type == RVM_INST_ENTRY;
+        labels = malloc(sizeof(label) * (entries + 1));
+        p->name_pool = malloc(12 * (entries + 1));
+        if(!labels || !p->name_pool) {
+            free(labels);
+            return 1;
+        }
+        for(uint32_t i = 0; i < prog->count; i ++) {
+            if(prog->code[i].type != RVM_INST_ENTRY) continue;
+            char *name = p->name_pool + 12 * count;
+            sprintf(name, "0x%x", prog->code[i].pc);
+            labels[count].address = prog->code[i].pc;
+            labels[count].order = count;
+            labels[count ++].name = name;
+        }
+    }
+    // of labels at one address, the first defined names it.
+    qsort(labels, count, sizeof(label), by_address);
+    uint32_t kept = 0;
+    for(uint32_t i = 0; i < count; i ++) {
+        if(kept && labels[kept - 1].address == labels[i].address) continue;
+        labels[kept ++] = labels[i];
+    }
+
+    p->label_count = kept;
+    p->addresses = malloc(sizeof(uint32_t) * (kept + 1));
+    p->names = malloc(sizeof(char *) * (kept + 1));
+    if(!p->addresses || !p->names) {
+        free(labels);
+        return 1;
+    }
+    for(uint32_t i = 0; i < kept; i ++) {
+        p->addresses[i] = labels[i].address;
+        p->names[i] = labels[i].name;
+    }
+    p->names[kept] = "[unknown]";
+    free(labels);
+
+    p->self = calloc(kept + 1, sizeof(uint64_t));
+    p->total = calloc(kept + 1, sizeof(uint64_t));
+    p->seen = calloc(kept + 1, sizeof(uint64_t));
+    p->returns = calloc(prog->size + 1, 1);
+    p->frames = malloc(sizeof(uint32_t) * (RVM_PROFILE_MAX_FRAMES + 1));
+    if(!p->self || !p->total || !p->seen || !p->returns || !p->frames)
+        return 1;
+    for(uint32_t i = 0; i < prog->count; i ++) {
+        if(prog->code[i].type == RVM_INST_CALL)
+            p->returns[prog->code[i].next_pc] = 1;
+    }
+    return grow_table(p);
+}
+
+void rvm_profile_free(rvm_profile *profile) {
+    free(profile->addresses);
+    free(profile->names);
+    free(profile->name_pool);
+    free(profile->self);
+    free(profile->total);
+    free(profile->seen);
+    free(profile->returns);
+    free(profile->stacks);
+    free(profile->table);
+    free(profile->frame_pool);
+    free(profile->frames);
+}
+
+uint8_t rvm_profile_run(rvm_profile *profile, rvm_context *ctx,
+    uint64_t interval) {
+
+    ctx->fuel = 0;
+    for(;;) {
+        // sampled before the slice, so the pc is that of the first
+        // instruction it runs, and with an interval of 1 the only one.
+        capture(profile, ctx);
+        ctx->budget = interval;
+        uint8_t error = rvm_context_run(ctx);
+        // a fault doesn't get back to update the budget; its slice is lost.
+        int lost = commit(profile, interval - ctx->budget);
+        ctx->budget = 0;
+        if(lost && (error == RVM_ERR_BUDGET || error == RVM_OK)) {
+            ctx->cpu.error = error = RVM_ERR_HOST_MEMORY;
+            ctx->cpu.halted = true;
+        }
+        if(error != RVM_ERR_BUDGET) return error;
+        ctx->cpu.error = RVM_OK;
+        ctx->cpu.halted = false;
+    }
+}
+
+int rvm_profile_write(const rvm_profile *profile, FILE *out) {
+    const rvm_profile *p = profile;
+    for(uint32_t i = 0; i < p->stack_count; i ++) {
+        const rvm_profile_stack *s = p->stacks + i;
+        const uint32_t *frames = p->frame_pool + s->frames;
+        for(uint32_t f = 0; f < s->depth; f ++) {
+            if(fprintf(out, f ? ";%s" : "%s", p->names[frames[f]]) < 0)
+                return 1;
+        }
+        if(fprintf(out, " %llu\n", (unsigned long long)s->weight) < 0)
+            return 1;
+    }
+    return 0;
+}
+
+static const rvm_profile *report_profile;
+
+static int by_self(const void *a, const void *b) {
+    const rvm_profile *p = report_profile;
+    uint64_t x = p->self[*(const uint32_t *)a];
+    uint64_t y = p->self[*(const uint32_t *)b];
+    if(x != y) return x < y ? 1 : -1;
+    x = p->total[*(const uint32_t *)a];
+    y = p->total[*(const uint32_t *)b];
+    if(x != y) return x < y ? 1 : -1;
+    return *(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1;
+}
+
+void rvm_profile_report(const rvm_profile *profile) {
+    const rvm_profile *p = profile;
+    printf("Profile report:\n");
+    printf("\t%llu instructions in %llu samples, %u distinct stacks\n",
+        (unsigned long long)p->instructions,
+        (unsigned long long)p->samples, p->stack_count);
+    if(p->truncated) {
+        printf("\t%llu samples truncated to %u frames\n",
+            (unsigned long long)p->truncated, RVM_PROFILE_MAX_FRAMES);
+    }
+
+    uint32_t *order = malloc(sizeof(uint32_t) * (p->label_count + 1));
+    if(!order) return;
+    uint32_t used = 0;
+    for(uint32_t i = 0; i <= p->label_count; i ++)
+        if(p->total[i]) order[used ++] = i;
+    report_profile = p;
+    qsort(order, used, sizeof(uint32_t), by_self);
+
+    double scale = p->instructions ? 100.0 / p->instructions : 0;
+    printf("\t%14s %7s %14s %7s  label\n", "self", "", "total", "");
+    for(uint32_t i = 0; i < used; i ++) {
+        uint32_t l = order[i];
+        printf("\t%14llu %6.2f%% %14llu %6.2f%%  %s\n",
+            (unsigned long long)p->self[l], p->self[l] * scale,
+            (unsigned long long)p->total[l], p->total[l] * scale,
+            p->names[l]);
+    }
+    free(order);
+}
+
+// the label at or before pc, or label_count if there's none.
+static uint32_t label_of(const rvm_profile *p, uint32_t pc) {
+    uint32_t lo = 0, hi = p->label_count;
+    while(lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(p->addresses[mid] <= pc) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo ? lo - 1 : p->label_count;
+}
+
+// the stack ctx is at into frames, leaf first.
+static void capture(rvm_profile *p, const rvm_context *ctx) {
+    const rvm_cpu_state *cpu = &ctx->cpu;
+    const uint32_t *stack = ctx->stack.contents;
+    uint32_t size = p->prog->size;
+
+    p->depth = 0;
+    p->frames[p->depth ++] = label_of(p, cpu->pc);
+
+    // sp can be past the end after a stack overflow.
+    uint32_t sp = cpu->sp;
+    if(sp > ctx->stack.size / 4) sp = ctx->stack.size / 4;
+    uint32_t bottom = sp > RVM_PROFILE_MAX_SCAN ? sp - RVM_PROFILE_MAX_SCAN
+        : 0;
+    uint32_t slot = sp;
+    while(slot > bottom && p->depth <= RVM_PROFILE_MAX_FRAMES) {
+        uint32_t ret = stack[-- slot];
+        // the call is the instruction just before where it returns to.
+        if(ret <= size && p->returns[ret] && ret > 0)
+            p->frames[p->depth ++] = label_of(p, ret - 1);
+    }
+    if(slot > 0) {
+        p->truncated ++;
+        if(p->depth > RVM_PROFILE_MAX_FRAMES)
+            p->depth = RVM_PROFILE_MAX_FRAMES;
+    }
+}
+
+// adds weight to the stack capture took; returns nonzero if there was no
+// memory for a new stack, which leaves it out.
+static int commit(rvm_profile *p, uint64_t weight) {
+    if(!weight) return 0;
+    p->samples ++;
+    p->instructions += weight;
+
+    // root first, as the stacks are kept.
+    uint32_t *frames = p->frames;
+    uint32_t depth = p->depth;
+    for(uint32_t i = 0; i < depth / 2; i ++) {
+        uint32_t t = frames[i];
+        frames[i] = frames[depth - 1 - i];
+        frames[depth - 1 - i] = t;
+    }
+
+    p->self[frames[depth - 1]] += weight;
+    // recursion mustn't count a label's instructions more than once.
+    uint32_t hash = 2166136261u;
+    for(uint32_t i = 0; i < depth; i ++) {
+        uint32_t l = frames[i];
+        if(p->seen[l] != p->samples) {
+            p->seen[l] = p->samples;
+            p->total[l] += weight;
+        }
+        hash = (hash ^ l) * 16777619u;
+    }
+
+    uint32_t in = find_stack(p, frames, depth, hash);
+    if(in == NO_STACK) {
+        if((p->stack_count + 1) * 2 > p->table_size && grow_table(p))
+            return 1;
+        if(p->stack_count == p->stack_capacity) {
+            uint32_t capacity = p->stack_capacity ? p->stack_capacity * 2
+                : 256;
+            rvm_profile_stack *stacks = realloc(p->stacks,
+                sizeof(rvm_profile_stack) * capacity);
+            if(!stacks) return 1;
+            p->stacks = stacks;
+            p->stack_capacity = capacity;
+        }
+        if(p->frame_count + depth > p->frame_capacity) {
+            size_t capacity = p->frame_capacity;
+            while(p->frame_count + depth > capacity)
+                capacity = capacity ? capacity * 2 : 4096;
+            uint32_t *pool = realloc(p->frame_pool,
+                sizeof(uint32_t) * capacity);
+            if(!pool) return 1;
+            p->frame_pool = pool;
+            p->frame_capacity = capacity;
+        }
+        in = p->stack_count ++;
+        rvm_profile_stack *s = p->stacks + in;
+        s->hash = hash;
+        s->depth = depth;
+        s->frames = p->frame_count;
+        s->weight = 0;
+        memcpy(p->frame_pool + p->frame_count, frames,
+            sizeof(uint32_t) * depth);
+        p->frame_count += depth;
+
+        uint32_t slot = hash & (p->table_size - 1);
+        while(p->table[slot] != NO_STACK)
+            slot = (slot + 1) & (p->table_size - 1);
+        p->table[slot] = in;
+    }
+    p->stacks[in].weight += weight;
+    return 0;
+}
+
+// index of the stack with these frames, or NO_STACK.
+static uint32_t find_stack(rvm_profile *p, const uint32_t *frames,
+    uint32_t depth, uint32_t hash) {
+
+    uint32_t slot = hash & (p->table_size - 1);
+    for(;; slot = (slot + 1) & (p->table_size - 1)) {
+        uint32_t in = p->table[slot];
+        if(in == NO_STACK) return NO_STACK;
+        const rvm_profile_stack *s = p->stacks + in;
+        if(s->hash == hash && s->depth == depth && !memcmp(frames,
+            p->frame_pool + s->frames, sizeof(uint32_t) * depth)) return in;
+    }
+}
+
+static int grow_table(rvm_profile *p) {
+    uint32_t size = p->table_size ? p->table_size * 2 : 1024;
+    uint32_t *table = malloc(sizeof(uint32_t) * size);
+    if(!table) return 1;
+    memset(table, 0xff, sizeof(uint32_t) * size);
+    for(uint32_t i = 0; i < p->stack_count; i ++) {
+        uint32_t slot = p->stacks[i].hash & (size - 1);
+        while(table[slot] != NO_STACK) slot = (slot + 1) & (size - 1);
+        table[slot] = i;
+    }
+    free(p->table);
+    p->table = table;
+    p->table_size = size;
+    return 0;
+}
+
+static int by_address(const void *a, const void *b) {
+    const label *x = a, *y = b;
+    if(x->address != y->address) return x->address < y->address ? -1 : 1;
+    return x->order < y->order ? -1 : 1;
+}
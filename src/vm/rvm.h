@@ -0,0 +1,137 @@
+#ifndef RVM_VM_RVM_H
+#define RVM_VM_RVM_H
+
+// librvm: loading and running programs from inside another process, without
+// going through the vm executable.
+//
+//     rvm_config config;
+//     rvm_config_default(&config);
+//     rvm_vm *vm = rvm_vm_create(&config);
+//     if(rvm_vm_load(vm, image, size)) ...
+//     for(...) {
+//         rvm_vm_reset(vm, regs);
+//         if(rvm_vm_run(vm, budget)) rvm_vm_print_error(vm);
+//         ... rvm_vm_state(vm)->regs ...
+//     }
+//     rvm_vm_destroy(vm);
+
+#include "vm.h"
+#include "common/object.h"
+
+typedef enum rvm_engine_kind {
+    RVM_ENGINE_TIERED,
+    RVM_ENGINE_SWITCH,
+    RVM_ENGINE_THREADED,
+    RVM_ENGINE_FUSED,
+    RVM_ENGINE_JIT,
+} rvm_engine_kind;
+
+typedef struct rvm_config {
+    uint8_t engine; // rvm_engine_kind
+    uint32_t threshold; // for the tiered engine
+    bool verify; // reject programs failing rvm_verify_program
+    bool report; // print verify/fuse/JIT reports on load
+    // programs will run on fuel; keeps the fused engine from branching past
+    // the entries fuel is checked at.
+    bool preempt;
+    size_t stack_size, heap_size; // in bytes
+} rvm_config;
+
+// why rvm_vm_load failed
+typedef enum rvm_load_error {
+    RVM_LOAD_OK,
+    RVM_LOAD_SIZE, // not a whole number of words
+    RVM_LOAD_UNVERIFIED, // failed verification
+    RVM_LOAD_FORMAT, // a damaged object file, or an entry mid-instruction
+    RVM_LOAD_VERSION, // an object file from a later version
+    RVM_LOAD_MEMORY, // no memory for the decoded program
+} rvm_load_error;
+
+// why rvm_vm_save failed
+typedef enum rvm_save_error {
+    RVM_SAVE_OK,
+    RVM_SAVE_UNLOADED, // no program to save
+    RVM_SAVE_IO, // errno says why
+    RVM_SAVE_MEMORY, // no memory for the cache section
+} rvm_save_error;
+
+typedef struct rvm_vm rvm_vm;
+
+// the defaults the vm executable uses.
+void rvm_config_default(rvm_config *config);
+// engine by the name vm -e takes, or -1 if there's none.
+int rvm_engine_parse(const char *name);
+
+// reserves the stack and heap; returns NULL if config is unusable or they
+// couldn't be reserved, with errno set in that case.
+rvm_vm *rvm_vm_create(const rvm_config *config);
+void rvm_vm_destroy(rvm_vm *vm);
+
+// decodes size bytes of object file or raw image, replacing any program
+// already loaded, and resets. A cache section made by this build stands in
+// for decoding, and for verification if it says the program passed. The
+// image isn't copied: it must be word-aligned and stay unchanged until the
+// next load or rvm_vm_destroy. Returns an rvm_load_error.
+uint8_t rvm_vm_load(rvm_vm *vm, const void *image, size_t size);
+// writes the loaded program to path as an object file with a cache section,
+// keeping its entry and symbols. Returns an rvm_save_error.
+uint8_t rvm_vm_save(const rvm_vm *vm, const char *path);
+// the object file the program was loaded from, or NULL if there's none.
+const rvm_object *rvm_vm_object(const rvm_vm *vm);
+// back to the initial state, with the registers set from regs, or zeroed if
+// regs is NULL.
+void rvm_vm_reset(rvm_vm *vm, const uint32_t *regs);
+// runs until hlt, an error, or budget instructions have run if budget isn't
+// 0, returning the rvm_error; RVM_ERR_BUDGET if the budget ran out. Budgeted
+// runs go one instruction at a time, whatever the engine.
+uint8_t rvm_vm_run(rvm_vm *vm, uint64_t budget);
+// runs on the engine until hlt, an error, or fuel entries have been passed,
+// returning RVM_ERR_FUEL in that case; running again resumes. Needs
+// config.preempt with the fused engine.
+uint8_t rvm_vm_run_fuel(rvm_vm *vm, uint64_t fuel);
+// runs to hlt or an error like rvm_vm_run with no budget, sampling the pc
+// and call stack every interval instructions into profile, which this sets
+// up and rvm_profile_free frees. Runs go through rvm_step as budgeted ones
+// do, whatever the engine.
+uint8_t rvm_vm_profile(rvm_vm *vm, rvm_profile *profile, uint64_t interval);
+// runs to hlt or an error like rvm_vm_run with no budget, recording each
+// instruction into trace, opened for this vm's program and still to be
+// closed. Runs go through rvm_step, whatever the engine.
+uint8_t rvm_vm_trace(rvm_vm *vm, rvm_trace *trace);
+#ifdef RVM_METRICS
+// runs like rvm_vm_profile, counting what runs; see rvm_metrics_run for
+// where the counts go. Returns nonzero, with errno set, if they couldn't be
+// counted or written; the run's rvm_error is in rvm_vm_state.
+int rvm_vm_metrics(rvm_vm *vm, const char *path);
+#endif
+// the streams host calls read and write, or none if io is NULL; io has to
+// stay set up until it's replaced. Heap still mapping the old io's input
+// reads as zero after. Returns nonzero, keeping the old io, if that heap
+// couldn't be put back.
+int rvm_vm_set_io(rvm_vm *vm, rvm_io *io);
+const rvm_cpu_state *rvm_vm_state(const rvm_vm *vm);
+// snapshots the vm's state, to restore any number of vms running the same
+// program from; see rvm_snapshot_* for writing one out and reading it back.
+// Both return an rvm_snapshot_error.
+uint8_t rvm_vm_snapshot(const rvm_vm *vm, rvm_snapshot *snap);
+// puts the vm in snap's state, with the registers set from regs unless it's
+// NULL; a snapshot taken at hlt carries on after it when run. Memory is
+// shared with the snapshot until written, so this costs about the same
+// whatever the heap holds.
+uint8_t rvm_vm_restore(rvm_vm *vm, const rvm_snapshot *snap,
+    const uint32_t *regs);
+// prints the message for the error the last run stopped with.
+void rvm_vm_print_error(const rvm_vm *vm);
+// tier-up and heap reports for the last run.
+void rvm_vm_report(const rvm_vm *vm);
+
+// the loaded program and the engine it runs on, for rvm_batch.
+const rvm_program *rvm_vm_program(const rvm_vm *vm);
+rvm_engine rvm_vm_engine(const rvm_vm *vm);
+const rvm_config *rvm_vm_config(const rvm_vm *vm);
+// the rvm_engine_kind the loaded program runs on; the config's, unless the
+// JIT couldn't take the program and it's threaded instead, or the tiered
+// engine had no memory for its counts and it's switch.
+uint8_t rvm_vm_engine_kind(const rvm_vm *vm);
+
+#endif
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vm.h"
+
+// ready tasks of one priority level, in the order they'll run
+typedef struct ring {
+    uint32_t *items;
+    uint32_t head, len;
+} ring;
+
+static void percentiles(const char *name, const double *values,
+    uint32_t count);
+static int compare_doubles(const void *a, const void *b);
+
+int rvm_sched_run(rvm_sched *sched) {
+    uint32_t count = sched->count;
+    sched->slices = 0;
+    sched->run_time = 0;
+    sched->finish = calloc(count, sizeof(double));
+    sched->max_wait = calloc(count, sizeof(double));
+    // when each task last stopped running
+    double *ready = calloc(count, sizeof(double));
+    bool allocated = sched->finish && sched->max_wait && ready;
+    ring levels[RVM_SCHED_LEVELS];
+    for(int l = 0; l < RVM_SCHED_LEVELS; l ++) {
+        levels[l].items = malloc(count * sizeof(uint32_t));
+        levels[l].head = levels[l].len = 0;
+        if(!levels[l].items) allocated = false;
+    }
+    if(!allocated) {
+        for(int l = 0; l < RVM_SCHED_LEVELS; l ++) free(levels[l].items);
+        free(ready);
+        return -1;
+    }
+
+    double start = rvm_now();
+    for(uint32_t i = 0; i < count; i ++) {
+        ring *r = levels + (sched->priority ? sched->priority[i] : 0);
+        r->items[r->len ++] = i;
+        ready[i] = start;
+        sched->tasks[i]->fuel = sched->quantum;
+    }
+
+    for(;;) {
+        ring *r = levels;
+        while(r < levels + RVM_SCHED_LEVELS && !r->len) r ++;
+        if(r == levels + RVM_SCHED_LEVELS) break;
+
+        uint32_t task = r->items[r->head];
+        r->head = (r->head + 1) % count;
+        r->len --;
+
+        double t = rvm_now();
+        if(t - ready[task] > sched->max_wait[task])
+            sched->max_wait[task] = t - ready[task];
+        uint8_t error = rvm_context_run(sched->tasks[task]);
+        ready[task] = rvm_now();
+        sched->run_time += ready[task] - t;
+        sched->slices ++;
+
+        if(error == RVM_ERR_FUEL) {
+            r->items[(r->head + r->len) % count] = task;
+            r->len ++;
+        }
+        else sched->finish[task] = ready[task] - start;
+    }
+    sched->time = rvm_now() - start;
+
+    for(int l = 0; l < RVM_SCHED_LEVELS; l ++) free(levels[l].items);
+    free(ready);
+    return 0;
+}
+
+void rvm_sched_report(const rvm_sched *sched) {
+    printf("Scheduler report:\n");
+    printf("\t%u tasks, %llu slices of %llu fuel in %.6fs\n", sched->count,
+        (unsigned long long)sched->slices,
+        (unsigned long long)sched->quantum, sched->time);
+    if(sched->slices) {
+        printf("\tmean slice: %.3fus, switch overhead: %.3fus\n",
+            sched->run_time / sched->slices * 1e6,
+            (sched->time - sched->run_time) / sched->slices * 1e6);
+    }
+    percentiles("finish", sched->finish, sched->count);
+    percentiles("max wait", sched->max_wait, sched->count);
+}
+
+void rvm_sched_free(rvm_sched *sched) {
+    free(sched->finish);
+    free(sched->max_wait);
+}
+
+static void percentiles(const char *name, const double *values,
+    uint32_t count) {
+
+    if(!count) return;
+    double *sorted = malloc(count * sizeof(double));
+    if(!sorted) return;
+    for(uint32_t i = 0; i < count; i ++) sorted[i] = values[i];
+    qsort(sorted, count, sizeof(double), compare_doubles);
+
+    static const double ps[] = {0.5, 0.9, 0.99, 0.999};
+    printf("\t%s:", name);
+    for(int i = 0; i < 4; i ++) {
+        printf(" p%g %.3fms,", ps[i] * 100,
+            sorted[(uint32_t)(ps[i] * (count - 1))] * 1e3);
+    }
+    printf(" max %.3fms\n", sorted[count - 1] * 1e3);
+    free(sorted);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
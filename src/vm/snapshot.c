@@ -0,0 +1,279 @@
+#define _GNU_SOURCE // memfd_create, SEEK_DATA and SEEK_HOLE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vm.h"
+
+#define PAGE RVM_SNAPSHOT_PAGE
+
+// /proc/self/pagemap entry bits
+#define PAGEMAP_PRESENT ((uint64_t)1 << 63)
+#define PAGEMAP_SWAPPED ((uint64_t)1 << 62)
+#define PAGEMAP_FILE ((uint64_t)1 << 61) // page cache, not a private copy
+
+static int copy_region(const rvm_mem *mem, int fd, size_t offset);
+static int copy_mapped(const rvm_mem *mem, int fd, size_t offset);
+static int copy_streamed(const rvm_context *ctx, int fd, size_t offset);
+static int copy_pages(const uint8_t *from, size_t count, int fd,
+    size_t offset);
+static int write_all(int fd, const uint8_t *from, size_t size,
+    size_t offset);
+static bool is_zero(const uint8_t *page);
+static size_t snapshot_size(const rvm_snapshot_header *h);
+
+uint8_t rvm_snapshot_take(rvm_snapshot *snap, const rvm_context *ctx) {
+    rvm_snapshot_header *h = &snap->header;
+    memset(h, 0, sizeof(*h));
+    h->magic = RVM_SNAPSHOT_MAGIC;
+    h->version = RVM_SNAPSHOT_VERSION;
+    h->header_size = sizeof(*h);
+    h->program_size = ctx->prog->size;
+    h->program_hash = ctx->prog->hash;
+    h->stack_size = ctx->stack.size;
+    h->heap_size = ctx->heap.size;
+    h->cpu = ctx->cpu;
+    h->alloc = ctx->heap.alloc;
+    h->alloc.words = NULL;
+
+    snap->fd = memfd_create("rvm-snapshot", MFD_CLOEXEC);
+    if(snap->fd < 0) return RVM_SNAPSHOT_IO;
+    if(ftruncate(snap->fd, snapshot_size(h))
+        || write_all(snap->fd, (const uint8_t *)h, sizeof(*h), 0)
+        || copy_region(&ctx->stack, snap->fd, PAGE)
+        || copy_region(&ctx->heap, snap->fd, PAGE + h->stack_size)
+        || copy_streamed(ctx, snap->fd, PAGE + h->stack_size)) {
+
+        int saved = errno;
+        close(snap->fd);
+        snap->fd = -1;
+        errno = saved;
+        return RVM_SNAPSHOT_IO;
+    }
+    return RVM_SNAPSHOT_OK;
+}
+
+uint8_t rvm_snapshot_save(const rvm_snapshot *snap, const char *path) {
+    size_t size = snapshot_size(&snap->header);
+    char *temp = malloc(strlen(path) + 5);
+    if(!temp) return RVM_SNAPSHOT_IO;
+    sprintf(temp, "%s.tmp", path);
+
+    int out = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(out < 0) {
+        free(temp);
+        return RVM_SNAPSHOT_IO;
+    }
+    const uint8_t *map = mmap(NULL, size, PROT_READ, MAP_SHARED, snap->fd, 0);
+    int failed = map == MAP_FAILED || ftruncate(out, size);
+
+    // only the ranges with data, so the holes stay holes.
+    off_t data = 0;
+    while(!failed) {
+        data = lseek(snap->fd, data, SEEK_DATA);
+        if(data < 0) {
+            failed = errno != ENXIO;
+            break;
+        }
+        off_t hole = lseek(snap->fd, data, SEEK_HOLE);
+        if(hole < 0 || write_all(out, map + data, hole - data, data))
+            failed = 1;
+        data = hole;
+    }
+
+    int saved = errno;
+    if(map != MAP_FAILED) munmap((void *)map, size);
+    if(close(out)) failed = 1;
+    if(!failed && rename(temp, path)) failed = 1;
+    if(failed) {
+        saved = errno;
+        unlink(temp);
+    }
+    free(temp);
+    errno = saved;
+    return failed ? RVM_SNAPSHOT_IO : RVM_SNAPSHOT_OK;
+}
+
+uint8_t rvm_snapshot_open(rvm_snapshot *snap, const char *path) {
+    rvm_snapshot_header *h = &snap->header;
+    snap->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(snap->fd < 0) return RVM_SNAPSHOT_IO;
+
+    struct stat st;
+    if(fstat(snap->fd, &st)) {
+        int saved = errno;
+        rvm_snapshot_close(snap);
+        errno = saved;
+        return RVM_SNAPSHOT_IO;
+    }
+    ssize_t got = pread(snap->fd, h, sizeof(*h), 0);
+    if(got != sizeof(*h) || h->magic != RVM_SNAPSHOT_MAGIC
+        || h->version != RVM_SNAPSHOT_VERSION
+        || h->header_size != sizeof(*h)
+        || h->stack_size > RVM_MEM_MAX || h->heap_size > RVM_MEM_MAX
+        || h->stack_size % PAGE || h->heap_size % PAGE
+        || (size_t)st.st_size < snapshot_size(h)
+        || h->cpu.sp > h->stack_size / 4
+        || h->alloc.limit != h->heap_size / 4
+        || h->alloc.top > h->alloc.limit
+        || h->cpu.error >= RVM_ERR_COUNT) {
+
+        int saved = errno;
+        rvm_snapshot_close(snap);
+        errno = saved;
+        return got < 0 ? RVM_SNAPSHOT_IO : RVM_SNAPSHOT_FORMAT;
+    }
+    return RVM_SNAPSHOT_OK;
+}
+
+uint8_t rvm_snapshot_restore(const rvm_snapshot *snap, rvm_context *ctx) {
+    const rvm_snapshot_header *h = &snap->header;
+    if(h->program_size != ctx->prog->size
+        || h->program_hash != ctx->prog->hash
+        || h->stack_size != ctx->stack.size
+        || h->heap_size != ctx->heap.size) return RVM_SNAPSHOT_MISMATCH;
+    // the engines index by pc without checking it.
+    if(h->cpu.pc > ctx->prog->size || (h->cpu.pc < ctx->prog->size
+        && ctx->prog->index[h->cpu.pc] == RVM_DEC_NONE))
+        return RVM_SNAPSHOT_FORMAT;
+
+    if(rvm_mem_map(&ctx->stack, snap->fd, PAGE)
+        || rvm_mem_map(&ctx->heap, snap->fd, PAGE + h->stack_size))
+        return RVM_SNAPSHOT_IO;
+    ctx->cpu = h->cpu;
+    ctx->heap.alloc = h->alloc;
+    ctx->heap.alloc.words = ctx->heap.contents;
+    if(ctx->cpu.error == RVM_OK) ctx->cpu.halted = false;
+    return RVM_SNAPSHOT_OK;
+}
+
+void rvm_snapshot_close(rvm_snapshot *snap) {
+    if(snap->fd >= 0) close(snap->fd);
+    snap->fd = -1;
+}
+
+// copies whatever in mem isn't zero to fd at offset. Only pages that have
+// been written can be, and the kernel knows those: they're present or
+// swapped out, and for a region mapping a snapshot, not still that
+// snapshot's, which copy_mapped takes care of.
+static int copy_region(const rvm_mem *mem, int fd, size_t offset) {
+    const uint8_t *base = (const uint8_t *)mem->contents;
+    if(mem->fd >= 0 && copy_mapped(mem, fd, offset)) return -1;
+
+    int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if(pagemap < 0) return -1;
+
+    size_t pages = mem->size / PAGE, first = (uintptr_t)base / PAGE;
+    size_t start = 0; // of the run of written pages so far
+    uint64_t entries[512];
+    int failed = 0;
+    for(size_t p = 0; p < pages && !failed; p += 512) {
+        size_t count = pages - p < 512 ? pages - p : 512;
+        if(pread(pagemap, entries, count * 8, (first + p) * 8)
+            != (ssize_t)(count * 8)) {
+
+            failed = 1;
+            break;
+        }
+        for(size_t i = 0; i < count; i ++) {
+            uint64_t e = entries[i];
+            if((e & PAGEMAP_SWAPPED)
+                || ((e & PAGEMAP_PRESENT) && !(e & PAGEMAP_FILE))) continue;
+            size_t page = p + i;
+            if(page > start && copy_pages(base + start * PAGE, page - start,
+                fd, offset + start * PAGE)) {
+
+                failed = 1;
+                break;
+            }
+            start = page + 1;
+        }
+    }
+    if(!failed && pages > start) {
+        failed = copy_pages(base + start * PAGE, pages - start, fd,
+            offset + start * PAGE);
+    }
+
+    int saved = errno;
+    close(pagemap);
+    errno = saved;
+    return failed ? -1 : 0;
+}
+
+// the pages the snapshot mem maps has data in; read through the mapping, so
+// any written since come out as they are now.
+static int copy_mapped(const rvm_mem *mem, int fd, size_t offset) {
+    const uint8_t *base = (const uint8_t *)mem->contents;
+    off_t end = mem->offset + mem->size, data = mem->offset;
+    for(;;) {
+        data = lseek(mem->fd, data, SEEK_DATA);
+        if(data < 0) return errno == ENXIO ? 0 : -1;
+        if(data >= end) return 0;
+        off_t hole = lseek(mem->fd, data, SEEK_HOLE);
+        if(hole < 0) return -1;
+        if(hole > end) hole = end;
+
+        size_t from = (data - mem->offset) / PAGE;
+        size_t to = (hole - mem->offset + PAGE - 1) / PAGE;
+        if(copy_pages(base + from * PAGE, to - from, fd,
+            offset + from * PAGE)) return -1;
+        data = hole;
+    }
+}
+
+// heap pages mapping input for host calls; copy_region takes them for pages
+// never written, as they're the file's.
+static int copy_streamed(const rvm_context *ctx, int fd, size_t offset) {
+    const rvm_io *io = ctx->io;
+    if(!io || io->mapped_end <= io->mapped_start) return 0;
+    const uint8_t *base = (const uint8_t *)ctx->heap.contents;
+    return copy_pages(base + io->mapped_start,
+        (io->mapped_end - io->mapped_start) / PAGE, fd,
+        offset + io->mapped_start);
+}
+
+// writes count pages to fd at offset, leaving out those all zero.
+static int copy_pages(const uint8_t *from, size_t count, int fd,
+    size_t offset) {
+
+    size_t start = 0;
+    for(size_t i = 0; i <= count; i ++) {
+        if(i < count && !is_zero(from + i * PAGE)) continue;
+        if(i > start && write_all(fd, from + start * PAGE,
+            (i - start) * PAGE, offset + start * PAGE)) return -1;
+        start = i + 1;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const uint8_t *from, size_t size,
+    size_t offset) {
+
+    while(size) {
+        ssize_t written = pwrite(fd, from, size, offset);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        from += written;
+        offset += written;
+        size -= written;
+    }
+    return 0;
+}
+
+static bool is_zero(const uint8_t *page) {
+    const uint64_t *words = (const uint64_t *)page;
+    uint64_t any = 0;
+    for(size_t i = 0; i < PAGE / 8; i ++) any |= words[i];
+    return !any;
+}
+
+static size_t snapshot_size(const rvm_snapshot_header *h) {
+    return PAGE + h->stack_size + h->heap_size;
+}
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vm.h"
+
+static inline uint32_t step(const rvm_program *prog, rvm_cpu_state *cpu,
+    rvm_mem *stack, rvm_mem *heap, uint32_t ip);
+
+void rvm_sim_switch(const rvm_program *prog, rvm_cpu_state *cpu,
+    rvm_mem *stack, rvm_mem *heap) {
+
+    uint32_t ip = prog->index[cpu->pc];
+    while(!cpu->halted) ip = step(prog, cpu, stack, heap, ip);
+}
+
+uint32_t rvm_step(const rvm_program *prog, rvm_cpu_state *cpu,
+    rvm_mem *stack, rvm_mem *heap, uint32_t ip) {
+
+    return step(prog, cpu, stack, heap, ip);
+}
+
+static inline uint32_t step(const rvm_program *prog, rvm_cpu_state *cpu,
+    rvm_mem *stack, rvm_mem *heap, uint32_t ip) {
+
+    const rvm_decoded *d = prog->code + ip++;
+    // a superinstruction still decodes as its first instruction, and the
+    // rest of the run follows it, so stepping through fused programs works.
+    uint8_t dop = d->op;
+    if(dop >= RVM_DEC_CMP_JE && dop <= RVM_DEC_POP_PUSH) dop = d->type;
+
+    // constants, if a target for *op is needed
+    uint32_t opc[3];
+    uint32_t *op[3];
+    // as an optimization, skip the operand lookup for entry.
+    if(dop != RVM_INST_ENTRY && dop < RVM_INST_COUNT) {
+        for(int i = 0; i < 3; i ++)
+            op[i] = rvm_operand(d, i, opc, cpu, heap);
+    }
+
+    switch(dop) {
+    case RVM_INST_HLT:
+        cpu->pc = d->next_pc;
+        cpu->halted = true;
+        break;
+    case RVM_INST_ADD:
+        if(op[2]) *op[2] = *op[0] + *op[1];
+        else *op[0] += *op[1];
+        break;
+    case RVM_INST_SUB:
+        if(op[2]) *op[2] = *op[0] - *op[1];
+        else *op[0] -= *op[1];
+        break;
+    case RVM_INST_MUL:
+        if(op[2]) *op[2] = *op[0] * *op[1];
+        else *op[0] *= *op[1];
+        break;
+    case RVM_INST_DIV:
+        if(!*op[1]) {
+            rvm_div_zero(d, cpu);
+            break;
+        }
+        if(op[2]) *op[2] = *op[0] / *op[1];
+        else *op[0] /= *op[1];
+        break;
+    case RVM_INST_OR:
+        if(op[2]) *op[2] = *op[0] | *op[1];
+        else *op[0] |= *op[1];
+        break;
+    case RVM_INST_AND:
+        if(op[2]) *op[2] = *op[0] & *op[1];
+        else *op[0] &= *op[1];
+        break;
+    case RVM_INST_NOT:
+        if(op[1]) *op[1] = ~ *op[0];
+        else *op[0] = ~*op[0];
+        break;
+    case RVM_INST_XOR:
+        if(op[2]) *op[2] = *op[0] ^ *op[1];
+        else *op[0] ^= *op[1];
+        break;
+    case RVM_INST_SHL:
+        if(op[2]) *op[2] = *op[0] << *op[1];
+        else *op[0] <<= *op[1];
+        break;
+    case RVM_INST_SHR:
+        if(op[2]) *op[2] = *op[0] >> *op[1];
+        else *op[0] >>= *op[1];
+        break;
+    case RVM_INST_CMP: {
+        uint32_t result = *op[0] - *op[1];
+        if(result == 0) cpu->zflag = true;
+        else cpu->zflag = false;
+        if(result & (1<<31)) cpu->nflag = true;
+        else cpu->nflag = false;
+        break;
+    }
+    case RVM_INST_ENTRY:
+        if(!-- cpu->fuel) rvm_out_of_fuel(d, cpu);
+        break;
+    // constant targets were resolved at load time; anything else has to be
+    // looked up now.
+#define TARGET(d, op) \
+((d)->target != RVM_DEC_NONE ? (d)->target \
+    : rvm_program_jump(prog, (d)->pc + *(op)[0]))
+    case RVM_INST_JMP:
+        ip = TARGET(d, op);
+        break;
+    case RVM_INST_JE:
+        if(cpu->zflag) ip = TARGET(d, op);
+        break;
+    case RVM_INST_JL:
+        if(cpu->nflag) ip = TARGET(d, op);
+        break;
+    case RVM_INST_JLE:
+        if(cpu->nflag || cpu->zflag) ip = TARGET(d, op);
+        break;
+    case RVM_INST_JNE:
+        if(!cpu->zflag) ip = TARGET(d, op);
+        break;
+    case RVM_INST_JNL:
+        if(!cpu->nflag) ip = TARGET(d, op);
+        break;
+    case RVM_INST_JNLE:
+        if(!cpu->nflag && !cpu->zflag) ip = TARGET(d, op);
+        break;
+    case RVM_INST_CALL:
+        // TODO: establish new frame
+        stack->contents[cpu->sp ++] = d->next_pc;
+        ip = TARGET(d, op);
+        break;
+#undef TARGET
+    case RVM_INST_RET:
+        // TODO: remove old frame
+        // returns are always to valid targets due to frame system
+        ip = rvm_program_return(prog, stack->contents[-- cpu->sp]);
+        break;
+    case RVM_INST_PUSH:
+        stack->contents[cpu->sp ++] = *op[0];
+        break;
+    case RVM_INST_POP:
+        // TODO: check frame limits
+        *op[0] = stack->contents[-- cpu->sp];
+        break;
+    case RVM_INST_SWAP: {
+        uint32_t t = *op[0];
+        *op[0] = *op[1];
+        *op[1] = t;
+        break;
+    }
+    case RVM_INST_ALLOC:
+        *op[1] = rvm_mem_alloc(heap, *op[0], cpu);
+        break;
+    case RVM_INST_FREE:
+        // the size operand isn't needed, as blocks know their own.
+        rvm_mem_free(heap, *op[1], cpu);
+        break;
+    case RVM_INST_EXP0:
+    case RVM_INST_EXP1:
+    case RVM_INST_EXP2:
+    case RVM_INST_EXP3:
+    case RVM_INST_EXP4:
+        rvm_host_call(d, op, cpu, heap);
+        break;
+    case RVM_DEC_END:
+    case RVM_DEC_TRUNCATED:
+    case RVM_DEC_INVALID:
+    case RVM_DEC_BADJUMP:
+    case RVM_DEC_BADRET:
+        rvm_decoded_fault(d, cpu);
+        break;
+    default:
+        printf("Instruction NYI.\n");
+        break;
+    }
+    return ip;
+}
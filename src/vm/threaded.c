@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "vm.h"
+
+// arithmetic instructions, all of which take the same operand shapes, and
+// whether a zero second operand faults
+#define ARITH_OPS(X) \
+    X(ADD, add, +, 0) \
+    X(SUB, sub, -, 0) \
+    X(MUL, mul, *, 0) \
+    X(DIV, div, /, 1) \
+    X(OR, or, |, 0) \
+    X(AND, and, &, 0) \
+    X(XOR, xor, ^, 0) \
+    X(SHL, shl, <<, 0) \
+    X(SHR, shr, >>, 0)
+
+// conditional branches, as conditions on zf and nf
+#define BRANCH_OPS(X) \
+    X(JE, je, zf) \
+    X(JL, jl, nf) \
+    X(JLE, jle, nf || zf) \
+    X(JNE, jne, !zf) \
+    X(JNL, jnl, !nf) \
+    X(JNLE, jnle, !nf && !zf)
+
+static const void *const (*handler_table)[RVM_SHAPE_COUNT];
+static pthread_once_t handler_once = PTHREAD_ONCE_INIT;
+
+static void get_handlers(void);
+
+void rvm_threaded_prepare(rvm_program *prog) {
+    for(uint32_t i = 0; i < prog->count + 3; i ++)
+        rvm_threaded_prepare_one(prog->code + i);
+}
+
+void rvm_threaded_prepare_one(rvm_decoded *d) {
+    // programs are prepared on any thread, batch workers' included.
+    pthread_once(&handler_once, get_handlers);
+
+    d->handler = handler_table[d->op][d->shape];
+    if(!d->handler) d->handler = handler_table[d->op][RVM_SHAPE_GENERIC];
+}
+
+// the handler addresses are only visible inside the engine, so have it hand
+// them out.
+static void get_handlers(void) {
+    rvm_sim_threaded(NULL, NULL, NULL, NULL);
+}
+
+void rvm_sim_threaded(const rvm_program *prog, rvm_cpu_state *cpu,
+    rvm_mem *stack, rvm_mem *heap) {
+
+#define GENERIC(op, name) [op][RVM_SHAPE_GENERIC] = &&op_##name
+#define SHAPED(op, name, shape) [op][RVM_SHAPE_##shape] = &&op_##name##_##shape
+#define ARITH_HANDLERS(NAME, name, o, checked) \
+    GENERIC(RVM_INST_##NAME, name), \
+    SHAPED(RVM_INST_##NAME, name, RRR), \
+    SHAPED(RVM_INST_##NAME, name, RCR), \
+    SHAPED(RVM_INST_##NAME, name, CRR), \
+    SHAPED(RVM_INST_##NAME, name, CCR), \
+    SHAPED(RVM_INST_##NAME, name, RR), \
+    SHAPED(RVM_INST_##NAME, name, RC),
+#define BRANCH_HANDLERS(NAME, name, cond) \
+    GENERIC(RVM_INST_##NAME, name), \
+    SHAPED(RVM_INST_##NAME, name, C), \
+    GENERIC(RVM_DEC_CMP_##NAME, cmp_##name), \
+    SHAPED(RVM_DEC_CMP_##NAME, cmp_##name, RR), \
+    SHAPED(RVM_DEC_CMP_##NAME, cmp_##name, RC), \
+    SHAPED(RVM_DEC_CMP_##NAME, cmp_##name, CR),
+
+    // handlers by op and operand shape; shapes left out fall back to the
+    // generic handler.
+    static const void *const handlers[RVM_DEC_OP_COUNT][RVM_SHAPE_COUNT] = {
+        GENERIC(RVM_INST_HLT, hlt),
+        ARITH_OPS(ARITH_HANDLERS)
+        GENERIC(RVM_INST_NOT, not),
+        SHAPED(RVM_INST_NOT, not, R),
+        SHAPED(RVM_INST_NOT, not, RR),
+        GENERIC(RVM_INST_CMP, cmp),
+        SHAPED(RVM_INST_CMP, cmp, RR),
+        SHAPED(RVM_INST_CMP, cmp, RC),
+        SHAPED(RVM_INST_CMP, cmp, CR),
+        GENERIC(RVM_INST_ENTRY, entry),
+        GENERIC(RVM_INST_JMP, jmp),
+        SHAPED(RVM_INST_JMP, jmp, C),
+        BRANCH_OPS(BRANCH_HANDLERS)
+        GENERIC(RVM_INST_CALL, call),
+        SHAPED(RVM_INST_CALL, call, C),
+        GENERIC(RVM_INST_RET, ret),
+        GENERIC(RVM_INST_PUSH, push),
+        SHAPED(RVM_INST_PUSH, push, R),
+        SHAPED(RVM_INST_PUSH, push, C),
+        GENERIC(RVM_INST_POP, pop),
+        SHAPED(RVM_INST_POP, pop, R),
+        GENERIC(RVM_INST_SWAP, swap),
+        SHAPED(RVM_INST_SWAP, swap, RR),
+        GENERIC(RVM_INST_ALLOC, alloc),
+        GENERIC(RVM_INST_FREE, free),
+        GENERIC(RVM_INST_EXP0, host),
+        GENERIC(RVM_INST_EXP1, host),
+        GENERIC(RVM_INST_EXP2, host),
+        GENERIC(RVM_INST_EXP3, host),
+        GENERIC(RVM_INST_EXP4, host),
+        GENERIC(RVM_DEC_END, fault),
+        GENERIC(RVM_DEC_TRUNCATED, fault),
+        GENERIC(RVM_DEC_INVALID, fault),
+        GENERIC(RVM_DEC_BADJUMP, fault),
+        GENERIC(RVM_DEC_BADRET, fault),
+        GENERIC(RVM_DEC_PUSH_CALL, push_call),
+        SHAPED(RVM_DEC_PUSH_CALL, push_call, R),
+        SHAPED(RVM_DEC_PUSH_CALL, push_call, C),
+        GENERIC(RVM_DEC_POP_PUSH, pop_push),
+        SHAPED(RVM_DEC_POP_PUSH, pop_push, RR),
+        SHAPED(RVM_DEC_POP_PUSH, pop_push, RC),
+        GENERIC(RVM_DEC_COLD, cold),
+    };
+
+#undef GENERIC
+#undef SHAPED
+#undef ARITH_HANDLERS
+#undef BRANCH_HANDLERS
+
+    if(!cpu) {
+        handler_table = handlers;
+        return;
+    }
+
+    const rvm_decoded *d = prog->code + prog->index[cpu->pc];
+    // constants, if a target for an operand pointer is needed
+    uint32_t opc[3];
+
+#define DISPATCH() goto *d->handler
+#define NEXT() do { d ++; DISPATCH(); } while(0)
+#define JUMP(i) do { d = prog->code + (i); DISPATCH(); } while(0)
+#define OP(i) rvm_operand(d, i, opc, cpu, heap)
+    // constant targets were resolved at load time; anything else has to be
+    // looked up now.
+#define TARGET() \
+    (d->target != RVM_DEC_NONE ? d->target \
+        : rvm_program_jump(prog, d->pc + *OP(0)))
+    // operand values for the specialized handlers
+#define R(i) regs[d->opval[i]]
+#define C(i) d->opval[i]
+#define ARITH(NAME, name, o, checked) \
+    op_##name: { \
+        uint32_t *a = OP(0), *b = OP(1), *c = OP(2); \
+        if(checked && !*b) goto op_div_zero; \
+        if(c) *c = *a o *b; \
+        else *a o##= *b; \
+        NEXT(); \
+    } \
+    op_##name##_RRR: \
+        if(checked && !R(1)) goto op_div_zero; \
+        R(2) = R(0) o R(1); \
+        NEXT(); \
+    op_##name##_RCR: \
+        if(checked && !C(1)) goto op_div_zero; \
+        R(2) = R(0) o C(1); \
+        NEXT(); \
+    op_##name##_CRR: \
+        if(checked && !R(1)) goto op_div_zero; \
+        R(2) = C(0) o R(1); \
+        NEXT(); \
+    op_##name##_CCR: \
+        if(checked && !C(1)) goto op_div_zero; \
+        R(2) = C(0) o C(1); \
+        NEXT(); \
+    op_##name##_RR: \
+        if(checked && !R(1)) goto op_div_zero; \
+        R(0) o##= R(1); \
+        NEXT(); \
+    op_##name##_RC: \
+        if(checked && !C(1)) goto op_div_zero; \
+        R(0) o##= C(1); \
+        NEXT();
+#define FLAGS(result) do { \
+        uint32_t flags_result = (result); \
+        cpu->zflag = flags_result == 0; \
+        cpu->nflag = (flags_result & (1<<31)) != 0; \
+    } while(0)
+    // a fused cmp+jcc only writes the flags on the ways out they are live on.
+#define CMP_BRANCH(result, cond) do { \
+        uint32_t cmp_result = (result); \
+        bool zf = cmp_result == 0, nf = (cmp_result & (1<<31)) != 0; \
+        (void)zf; (void)nf; \
+        if(cond) { \
+            if(d->flags_live & RVM_FLAGS_TAKEN) FLAGS(cmp_result); \
+            JUMP(d->target); \
+        } \
+        if(d->flags_live & RVM_FLAGS_NOT_TAKEN) FLAGS(cmp_result); \
+        d += 2; \
+        DISPATCH(); \
+    } while(0)
+#define BRANCH(NAME, name, cond) \
+    op_##name: { \
+        bool zf = cpu->zflag, nf = cpu->nflag; \
+        (void)zf; (void)nf; \
+        if(cond) JUMP(TARGET()); \
+        NEXT(); \
+    } \
+    op_##name##_C: { \
+        bool zf = cpu->zflag, nf = cpu->nflag; \
+        (void)zf; (void)nf; \
+        if(cond) JUMP(d->target); \
+        NEXT(); \
+    } \
+    op_cmp_##name: { \
+        uint32_t *a = OP(0), *b = OP(1); \
+        CMP_BRANCH(*a - *b, cond); \
+    } \
+    op_cmp_##name##_RR: CMP_BRANCH(R(0) - R(1), cond); \
+    op_cmp_##name##_RC: CMP_BRANCH(R(0) - C(1), cond); \
+    op_cmp_##name##_CR: CMP_BRANCH(C(0) - R(1), cond);
+    // overflow and underflow run into the guard region past the stack.
+#define PUSH(value) do { \
+        stack->contents[cpu->sp ++] = (value); \
+    } while(0)
+#define POP(dest) do { \
+        (dest) = stack->contents[-- cpu->sp]; \
+    } while(0)
+
+    uint32_t *regs = cpu->regs;
+
+    DISPATCH();
+
+op_hlt:
+    cpu->pc = d->next_pc;
+    cpu->halted = true;
+    return;
+
+    ARITH_OPS(ARITH)
+
+op_not: {
+    uint32_t *a = OP(0), *b = OP(1);
+    if(b) *b = ~*a;
+    else *a = ~*a;
+    NEXT();
+}
+op_not_R:
+    R(0) = ~R(0);
+    NEXT();
+op_not_RR:
+    R(1) = ~R(0);
+    NEXT();
+
+op_cmp:
+    FLAGS(*OP(0) - *OP(1));
+    NEXT();
+op_cmp_RR:
+    FLAGS(R(0) - R(1));
+    NEXT();
+op_cmp_RC:
+    FLAGS(R(0) - C(1));
+    NEXT();
+op_cmp_CR:
+    FLAGS(C(0) - R(1));
+    NEXT();
+
+op_entry:
+    if(!-- cpu->fuel) {
+        rvm_out_of_fuel(d, cpu);
+        return;
+    }
+    NEXT();
+
+op_jmp:
+    JUMP(TARGET());
+op_jmp_C:
+    JUMP(d->target);
+
+    BRANCH_OPS(BRANCH)
+
+op_call:
+    // TODO: establish new frame
+    PUSH(d->next_pc);
+    JUMP(TARGET());
+op_call_C:
+    PUSH(d->next_pc);
+    JUMP(d->target);
+
+op_ret:
+    // TODO: remove old frame
+    JUMP(rvm_program_return(prog, stack->contents[-- cpu->sp]));
+
+op_push: {
+    uint32_t value = *OP(0);
+    PUSH(value);
+    NEXT();
+}
+op_push_R:
+    PUSH(R(0));
+    NEXT();
+op_push_C:
+    PUSH(C(0));
+    NEXT();
+
+op_pop: {
+    // TODO: check frame limits
+    // the operand address uses sp from before the pop.
+    uint32_t *a = OP(0);
+    POP(*a);
+    NEXT();
+}
+op_pop_R:
+    POP(R(0));
+    NEXT();
+
+op_push_call: {
+    uint32_t value = *OP(0);
+    PUSH(value);
+    PUSH(d->next_pc);
+    JUMP(d->target);
+}
+op_push_call_R:
+    PUSH(R(0));
+    PUSH(d->next_pc);
+    JUMP(d->target);
+op_push_call_C:
+    PUSH(C(0));
+    PUSH(d->next_pc);
+    JUMP(d->target);
+
+    // the pushed value takes the popped slot.
+op_pop_push: {
+    uint32_t *a = OP(0);
+    POP(*a);
+    stack->contents[cpu->sp ++] = *OP(1);
+    d += 2;
+    DISPATCH();
+}
+op_pop_push_RR:
+    POP(R(0));
+    stack->contents[cpu->sp ++] = R(1);
+    d += 2;
+    DISPATCH();
+op_pop_push_RC:
+    POP(R(0));
+    stack->contents[cpu->sp ++] = C(1);
+    d += 2;
+    DISPATCH();
+
+op_swap: {
+    uint32_t *a = OP(0), *b = OP(1);
+    uint32_t t = *a;
+    *a = *b;
+    *b = t;
+    NEXT();
+}
+op_swap_RR: {
+    uint32_t t = R(0);
+    R(0) = R(1);
+    R(1) = t;
+    NEXT();
+}
+
+op_alloc: {
+    uint32_t *a = OP(0), *b = OP(1);
+    *b = rvm_mem_alloc(heap, *a, cpu);
+    if(cpu->halted) return;
+    NEXT();
+}
+
+op_free:
+    // the size operand isn't needed, as blocks know their own.
+    rvm_mem_free(heap, *OP(1), cpu);
+    if(cpu->halted) return;
+    NEXT();
+
+op_host: {
+    uint32_t *ops[3] = {OP(0), OP(1), OP(2)};
+    rvm_host_call(d, ops, cpu, heap);
+    if(cpu->halted) return;
+    NEXT();
+}
+
+op_fault:
+    rvm_decoded_fault(d, cpu);
+    return;
+
+op_div_zero:
+    rvm_div_zero(d, cpu);
+    return;
+
+op_cold:
+    cpu->pc = d->pc;
+    return;
+
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+#undef OP
+#undef TARGET
+#undef R
+#undef C
+#undef ARITH
+#undef BRANCH
+#undef FLAGS
+#undef CMP_BRANCH
+#undef PUSH
+#undef POP
+}
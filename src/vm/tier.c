@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+
+enum { TIER_INTERP, TIER_BUILD, TIER_HOT, TIER_COUNT };
+
+static const char *const tier_names[TIER_COUNT] = {
+    [TIER_INTERP] = "interpreter",
+    [TIER_BUILD] = "building optimized tier",
+    [TIER_HOT] = "optimized",
+};
+
+struct rvm_tier {
+    uint32_t threshold;
+    uint32_t *runs; // decoded index -> runs of the entry there, while cold
+
+    // fused and threaded copy of the program, sharing the index with the
+    // original; its entries are RVM_DEC_COLD until promoted.
+    rvm_program hot;
+    bool built;
+    rvm_fuse_stats fuse_stats;
+
+    // promoted entries, as decoded indices, and when they were promoted
+    uint32_t *promoted;
+    double *promoted_at;
+    uint32_t promotions;
+
+    uint32_t switches; // transitions between tiers
+    double time[TIER_COUNT];
+};
+
+static int build_hot(rvm_program *prog);
+static void promote(struct rvm_tier *tier, uint32_t ip, double at);
+
+int rvm_tier_prepare(rvm_program *prog, uint32_t threshold) {
+    struct rvm_tier *tier = calloc(1, sizeof(*tier));
+    if(!tier) return 1;
+    prog->tier = tier;
+    tier->runs = calloc(prog->count + 3, sizeof(uint32_t));
+    tier->promoted = malloc(sizeof(uint32_t) * (prog->count + 3));
+    tier->promoted_at = malloc(sizeof(double) * (prog->count + 3));
+    if(!tier->runs || !tier->promoted || !tier->promoted_at) {
+        rvm_tier_free(prog);
+        return 1;
+    }
+    tier->threshold = threshold;
+    return 0;
+}
+
+void rvm_tier_free(rvm_program *prog) {
+    struct rvm_tier *tier = prog->tier;
+    if(!tier) return;
+    // the index belongs to the original program.
+    free(tier->hot.code);
+    free(tier->runs);
+    free(tier->promoted);
+    free(tier->promoted_at);
+    free(tier);
+    prog->tier = NULL;
+}
+
+void rvm_tier_report(const rvm_program *prog) {
+    const struct rvm_tier *tier = prog->tier;
+    printf("Tier report:\n");
+    printf("\tthreshold: %u\n", tier->threshold);
+    printf("\ttier-ups: %u\n", tier->promotions);
+    for(uint32_t i = 0; i < tier->promotions; i ++) {
+        printf("\t\tentry at %x, after %.6fs\n",
+            prog->code[tier->promoted[i]].pc, tier->promoted_at[i]);
+    }
+    printf("\ttier switches: %u\n", tier->switches);
+    for(int t = 0; t < TIER_COUNT; t ++)
+        printf("\t%s: %.6fs\n", tier_names[t], tier->time[t]);
+    if(tier->built) rvm_fuse_report(&tier->fuse_stats);
+}
+
+void rvm_sim_tiered(const rvm_program *prog, rvm_cpu_state *cpu,
+    rvm_mem *stack, rvm_mem *heap) {
+
+    struct rvm_tier *tier = prog->tier;
+    double start = rvm_now(), last = start;
+    uint32_t ip = prog->index[cpu->pc];
+
+    while(!cpu->halted) {
+        const rvm_decoded *d = prog->code + ip;
+        if(d->op != RVM_INST_ENTRY) {
+            ip = rvm_step(prog, cpu, stack, heap, ip);
+            continue;
+        }
+
+        if(!tier->built || tier->hot.code[ip].op == RVM_DEC_COLD) {
+            if(++ tier->runs[ip] < tier->threshold) {
+                ip = rvm_step(prog, cpu, stack, heap, ip);
+                continue;
+            }
+
+            double t = rvm_now();
+            tier->time[TIER_INTERP] += t - last;
+            last = t;
+            if(!tier->built) {
+                // with no memory for the optimized tier, this entry stays
+                // cold for another threshold runs.
+                if(build_hot((rvm_program *)prog)) {
+                    tier->runs[ip] = 0;
+                    ip = rvm_step(prog, cpu, stack, heap, ip);
+                    continue;
+                }
+                t = rvm_now();
+                tier->time[TIER_BUILD] += t - last;
+                last = t;
+            }
+            promote(tier, ip, t - start);
+        }
+        else {
+            double t = rvm_now();
+            tier->time[TIER_INTERP] += t - last;
+            last = t;
+        }
+
+        // run optimized until halting or reaching a cold entry.
+        cpu->pc = d->pc;
+        rvm_sim_threaded(&tier->hot, cpu, stack, heap);
+        double t = rvm_now();
+        tier->time[TIER_HOT] += t - last;
+        last = t;
+        tier->switches ++;
+
+        ip = prog->index[cpu->pc];
+    }
+
+    tier->time[TIER_INTERP] += rvm_now() - last;
+}
+
+static int build_hot(rvm_program *prog) {
+    struct rvm_tier *tier = prog->tier;
+    rvm_program *hot = &tier->hot;
+
+    *hot = *prog;
+    hot->jit = NULL;
+    hot->tier = NULL;
+    hot->code = malloc(sizeof(rvm_decoded) * (prog->count + 3));
+    if(!hot->code) return 1;
+    memcpy(hot->code, prog->code, sizeof(rvm_decoded) * (prog->count + 3));
+
+    // entries stay in place, so that the cold ones can send execution back.
+    rvm_fuse_program(hot, &tier->fuse_stats);
+    for(uint32_t i = 0; i < hot->count; i ++) {
+        if(hot->code[i].op == RVM_INST_ENTRY) hot->code[i].op = RVM_DEC_COLD;
+    }
+    rvm_threaded_prepare(hot);
+    tier->built = true;
+    return 0;
+}
+
+static void promote(struct rvm_tier *tier, uint32_t ip, double at) {
+    rvm_decoded *d = tier->hot.code + ip;
+    d->op = RVM_INST_ENTRY;
+    rvm_threaded_prepare_one(d);
+    tier->promoted_at[tier->promotions] = at;
+    tier->promoted[tier->promotions ++] = ip;
+}
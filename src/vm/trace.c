@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "vm.h"
+
+int rvm_trace_open(rvm_trace *trace, const char *path, uint32_t capacity,
+    const rvm_program *prog) {
+
+    uint32_t records = 1;
+    while(records < capacity && records < (1u << 31)) records <<= 1;
+    size_t size = RVM_TRACE_PAGE + sizeof(rvm_trace_record) * records;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return 1;
+    if(ftruncate(fd, size)) {
+        close(fd);
+        return 1;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) return 1;
+
+    rvm_trace_header *h = p;
+    h->magic = RVM_TRACE_MAGIC;
+    h->version = RVM_TRACE_VERSION;
+    h->record_size = sizeof(rvm_trace_record);
+    h->capacity = records;
+    h->head = 0;
+    h->program_size = prog->size;
+    h->program_hash = prog->hash;
+
+    trace->header = h;
+    trace->records = (rvm_trace_record *)((uint8_t *)p + RVM_TRACE_PAGE);
+    trace->mask = records - 1;
+    trace->size = size;
+    return 0;
+}
+
+uint32_t rvm_trace_step(rvm_trace *trace, rvm_context *ctx, uint32_t ip) {
+    const rvm_program *prog = ctx->prog;
+    rvm_cpu_state *cpu = &ctx->cpu;
+    const rvm_decoded *d = prog->code + ip;
+
+    rvm_trace_record *r = trace->records + (trace->header->head & trace->mask);
+    r->pc = d->pc;
+    r->word = d->pc < prog->size ? prog->words[d->pc] : 0;
+    r->flags = 0;
+    trace->header->head ++;
+
+    // where the result will be, found before the instruction can move sp or
+    // change a register an address comes from.
+    uint8_t type = d->type;
+    int dest = -1;
+    switch(type) {
+    case RVM_INST_ADD: case RVM_INST_SUB: case RVM_INST_MUL:
+    case RVM_INST_DIV: case RVM_INST_OR: case RVM_INST_AND:
+    case RVM_INST_XOR: case RVM_INST_SHL: case RVM_INST_SHR:
+        dest = d->optype[2] != RVM_OP_ABSENT ? 2 : 0;
+        break;
+    case RVM_INST_NOT:
+        dest = d->optype[1] != RVM_OP_ABSENT ? 1 : 0;
+        break;
+    case RVM_INST_POP:
+    case RVM_INST_SWAP:
+        dest = 0;
+        break;
+    case RVM_INST_ALLOC:
+    case RVM_INST_EXP3:
+        dest = 1;
+        break;
+    case RVM_INST_EXP0:
+        dest = 2;
+        break;
+    case RVM_INST_EXP4:
+        dest = 0;
+        break;
+    }
+    uint32_t opc[3];
+    uint32_t *value = dest >= 0 ? rvm_operand(d, dest, opc, cpu, &ctx->heap)
+        : NULL;
+
+    ip = rvm_step(prog, cpu, &ctx->stack, &ctx->heap, ip);
+
+    uint8_t flags = (cpu->zflag ? RVM_TRACE_ZF : 0)
+        | (cpu->nflag ? RVM_TRACE_NF : 0);
+    if(!cpu->error) flags |= RVM_TRACE_DONE;
+    if(value) {
+        r->value = *value;
+        flags |= RVM_TRACE_WROTE;
+    }
+    else if((type == RVM_INST_PUSH || type == RVM_INST_CALL) && cpu->sp) {
+        r->value = ctx->stack.contents[cpu->sp - 1];
+        flags |= RVM_TRACE_WROTE;
+    }
+    else if(type == RVM_INST_RET) {
+        r->value = ctx->stack.contents[cpu->sp];
+        flags |= RVM_TRACE_WROTE;
+    }
+    else if(type == RVM_INST_CMP) {
+        r->value = *rvm_operand(d, 0, opc, cpu, &ctx->heap)
+            - *rvm_operand(d, 1, opc, cpu, &ctx->heap);
+        flags |= RVM_TRACE_WROTE;
+    }
+    r->flags = flags;
+    return ip;
+}
+
+void rvm_trace_close(rvm_trace *trace, const rvm_cpu_state *cpu) {
+    rvm_trace_header *h = trace->header;
+    h->halted = cpu->halted;
+    h->error = cpu->error;
+    h->closed = 1;
+    // the kernel writes the pages back from here.
+    munmap(h, trace->size);
+    trace->header = NULL;
+    trace->records = NULL;
+}
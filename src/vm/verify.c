@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vm.h"
+
+static int can_fall_through(uint8_t type);
+
+// the decoder already turns each of these conditions into a fault op that
+// only fires when reached, so the engines never check for them per step;
+// this rejects the program up front instead, reporting all of them.
+uint32_t rvm_verify_program(const rvm_program *prog,
+    rvm_verify_stats *stats) {
+
+    double start = rvm_now();
+    uint32_t errors = 0;
+
+    for(uint32_t i = 0; i < prog->count; i ++) {
+        const rvm_decoded *d = prog->code + i;
+        const char *error = NULL;
+
+        if(d->op == RVM_DEC_TRUNCATED)
+            error = "instruction extends past end of program";
+        else if(d->op == RVM_DEC_INVALID) error = "invalid instruction";
+        else if(d->target == RVM_PROGRAM_END(prog))
+            error = "branch past end of program";
+        else if(d->target == RVM_PROGRAM_BADJUMP(prog))
+            error = "branch to non-entry instruction";
+        else if(i + 1 == prog->count && can_fall_through(d->type))
+            error = "execution can run past end of program";
+
+        if(!error) continue;
+        printf("Verify: %x: %s: %s\n", d->pc, rvm_inst_type_strings[d->type],
+            error);
+        errors ++;
+    }
+    if(prog->count == 0) {
+        printf("Verify: empty program\n");
+        errors ++;
+    }
+
+    stats->instructions = prog->count;
+    stats->errors = errors;
+    stats->time = rvm_now() - start;
+    return errors;
+}
+
+void rvm_verify_report(const rvm_verify_stats *stats) {
+    printf("Verified %u instructions in %.6fs, %u errors\n",
+        stats->instructions, stats->time, stats->errors);
+}
+
+static int can_fall_through(uint8_t type) {
+    switch(type) {
+    case RVM_INST_HLT:
+    case RVM_INST_JMP:
+    case RVM_INST_RET:
+        return 0;
+    default:
+        return 1;
+    }
+}
@@ -0,0 +1,681 @@
+#ifndef RVM_VM_VM_H
+#define RVM_VM_VM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <stddef.h>
+#include <setjmp.h>
+
+#include "common/inst.h"
+#include "common/alloc.h"
+#include "common/object.h"
+#include "common/trace.h"
+
+typedef struct rvm_cpu_state {
+    uint32_t pc, sp;
+    uint32_t regs[8];
+    bool zflag;
+    bool nflag;
+
+    bool halted;
+    // rvm_error; when set, halted is too. For the errors found by decoding,
+    // pc is that of the faulting instruction.
+    uint8_t error;
+
+    // entries left to pass before yielding with RVM_ERR_FUEL; every branch
+    // lands on an entry, so checking there is enough to stop any loop.
+    uint64_t fuel;
+} rvm_cpu_state;
+
+// why a program stopped, other than by hlt
+typedef enum rvm_error {
+    RVM_OK,
+    RVM_ERR_END, // ran past the end of the program
+    RVM_ERR_TRUNCATED, // lconst words extend past the end of the program
+    RVM_ERR_INVALID, // rejected by rvm_inst_check_valid
+    RVM_ERR_BADJUMP, // branch to a non-entry instruction
+    RVM_ERR_BADRET, // return into the middle of an instruction
+    RVM_ERR_STACK_OVERFLOW,
+    RVM_ERR_STACK_UNDERFLOW,
+    RVM_ERR_HEAP_BOUNDS, // heap access past the heap size
+    RVM_ERR_OUT_OF_MEMORY, // alloc past the heap size
+    RVM_ERR_INVALID_FREE,
+    RVM_ERR_BUDGET, // ran out of instruction budget
+    RVM_ERR_FUEL, // ran out of fuel; running again resumes
+    RVM_ERR_DIV_ZERO, // div by zero
+    RVM_ERR_HOST_IO, // heap mapping host call input couldn't be put back
+    RVM_ERR_HOST_MEMORY, // the host couldn't empty or allocate memory
+    RVM_ERR_COUNT
+} rvm_error;
+
+typedef struct rvm_mem {
+    uint32_t *contents;
+    size_t size; // accessible bytes; anything past this faults
+    uint8_t kind; // RVM_MEM_*, for reporting faults
+    rvm_alloc alloc; // for the heap
+    // the snapshot file contents map copy-on-write, or -1
+    int fd;
+    size_t offset; // of contents in fd
+} rvm_mem;
+
+#define RVM_MEM_STACK 0
+#define RVM_MEM_HEAP 1
+
+// largest stack or heap size, in bytes
+#define RVM_MEM_MAX ((size_t)1 << 32)
+
+// execution ops past the real instruction types; these stand in for the
+// conditions the fetch loop used to detect on every step.
+typedef enum rvm_dec_op {
+    RVM_DEC_END = RVM_INST_COUNT, // ran past the end of the program
+    RVM_DEC_TRUNCATED, // lconst words extend past the end of the program
+    RVM_DEC_INVALID, // rejected by rvm_inst_check_valid
+    RVM_DEC_BADJUMP, // branch to a non-entry instruction
+    RVM_DEC_BADRET, // return into the middle of an instruction
+    // superinstructions from rvm_fuse_program; the first instruction of the
+    // run is rewritten, the rest stay in place for anything landing on them.
+    RVM_DEC_CMP_JE,
+    RVM_DEC_CMP_JL,
+    RVM_DEC_CMP_JLE,
+    RVM_DEC_CMP_JNE,
+    RVM_DEC_CMP_JNL,
+    RVM_DEC_CMP_JNLE,
+    RVM_DEC_PUSH_CALL,
+    RVM_DEC_POP_PUSH,
+    // entry not yet promoted by the tiered engine; leaves the threaded engine
+    // with cpu->pc at the entry, without halting.
+    RVM_DEC_COLD,
+    RVM_DEC_OP_COUNT
+} rvm_dec_op;
+
+// flags_live bits of a fused cmp+jcc: whether zflag/nflag can be read before
+// being overwritten on either way out.
+#define RVM_FLAGS_TAKEN 1
+#define RVM_FLAGS_NOT_TAKEN 2
+
+// operand shapes that get specialized handlers, as the kinds of the three
+// operands after decoding; C is a constant, R a register.
+#define RVM_SHAPES(X) \
+    X(RRR, RVM_OP_VALUE_REG, RVM_OP_VALUE_REG, RVM_OP_VALUE_REG) \
+    X(RCR, RVM_OP_VALUE_REG, RVM_OP_VALUE_SCONST, RVM_OP_VALUE_REG) \
+    X(CRR, RVM_OP_VALUE_SCONST, RVM_OP_VALUE_REG, RVM_OP_VALUE_REG) \
+    X(CCR, RVM_OP_VALUE_SCONST, RVM_OP_VALUE_SCONST, RVM_OP_VALUE_REG) \
+    X(RR, RVM_OP_VALUE_REG, RVM_OP_VALUE_REG, RVM_OP_ABSENT) \
+    X(RC, RVM_OP_VALUE_REG, RVM_OP_VALUE_SCONST, RVM_OP_ABSENT) \
+    X(CR, RVM_OP_VALUE_SCONST, RVM_OP_VALUE_REG, RVM_OP_ABSENT) \
+    X(CC, RVM_OP_VALUE_SCONST, RVM_OP_VALUE_SCONST, RVM_OP_ABSENT) \
+    X(R, RVM_OP_VALUE_REG, RVM_OP_ABSENT, RVM_OP_ABSENT) \
+    X(C, RVM_OP_VALUE_SCONST, RVM_OP_ABSENT, RVM_OP_ABSENT)
+
+typedef enum rvm_shape {
+#define X(name, a, b, c) RVM_SHAPE_##name,
+    RVM_SHAPES(X)
+#undef X
+    RVM_SHAPE_GENERIC, // anything with a stack or heap operand
+    RVM_SHAPE_COUNT
+} rvm_shape;
+
+typedef struct rvm_decoded {
+    const void *handler; // used by the threaded engine
+    uint8_t op; // rvm_inst_type, or rvm_dec_op
+    uint8_t type; // instruction type as encoded
+    // lconst operand types are folded into the matching sconst types, as the
+    // value is held in opval either way.
+    uint8_t optype[3];
+    uint8_t shape; // rvm_shape
+    uint8_t flags_live; // RVM_FLAGS_* for fused cmp+jcc
+    uint32_t opval[3]; // constant value or register index
+    uint32_t target; // decoded index of a constant branch target
+    uint32_t pc; // word address of the instruction
+    uint32_t next_pc; // word address of the instruction after it
+} rvm_decoded;
+
+#define RVM_DEC_NONE 0xffffffff
+
+typedef struct rvm_program {
+    const uint32_t *words;
+    uint32_t size; // in words
+    uint32_t hash; // FNV-1a of words, to tell programs apart
+    uint32_t entry; // word address runs start at
+
+    // count decoded instructions, followed by END, BADJUMP and BADRET
+    // sentinels.
+    rvm_decoded *code;
+    uint32_t count;
+    // word address -> decoded index, or RVM_DEC_NONE for words inside an
+    // instruction; has an extra entry for size, mapping to the END sentinel.
+    uint32_t *index;
+
+    struct rvm_jit *jit; // native code, from rvm_jit_compile
+    struct rvm_tier *tier; // tiered engine state, from rvm_tier_prepare
+} rvm_program;
+
+#define RVM_PROGRAM_END(prog) ((prog)->count)
+#define RVM_PROGRAM_BADJUMP(prog) ((prog)->count + 1)
+#define RVM_PROGRAM_BADRET(prog) ((prog)->count + 2)
+
+// returns nonzero, leaving prog unset, if there's no memory for it.
+int rvm_decode_program(rvm_program *prog, const uint32_t *words,
+    uint32_t size);
+
+// the decoded program, as an object file's cache section: loading through it
+// skips decoding, and verification if RVM_CACHE_VERIFIED is set. It's only
+// good for the same words on a VM laying out rvm_decoded the same way, which
+// loading checks.
+#define RVM_CACHE_VERSION 2 // bump on any change to what decoding produces
+#define RVM_CACHE_VERIFIED 1 // passed rvm_verify_program
+
+// builds the cache for prog, which must be as rvm_decode_program left it,
+// into a malloc'd buffer, returning its size; 0, with cache NULL, if there's
+// no memory for it.
+size_t rvm_cache_build(const rvm_program *prog, bool verified, void **cache);
+// sets prog up from cache rather than decoding words, with verified from the
+// flag; returns nonzero if cache isn't for them or there's no memory for
+// the program, leaving prog unset.
+int rvm_cache_load(rvm_program *prog, const uint32_t *words, uint32_t size,
+    const void *cache, size_t cache_size, bool *verified);
+void rvm_program_free(rvm_program *prog);
+uint8_t rvm_shape_of(const uint8_t *optype);
+// halts cpu with the error behind one of the rvm_dec_op error ops.
+void rvm_decoded_fault(const rvm_decoded *d, rvm_cpu_state *cpu);
+
+// halts cpu at d, a div by zero.
+static inline void rvm_div_zero(const rvm_decoded *d, rvm_cpu_state *cpu) {
+    cpu->pc = d->pc;
+    cpu->error = RVM_ERR_DIV_ZERO;
+    cpu->halted = true;
+}
+
+// stops at entry d for running out of fuel, to resume just past it.
+static inline void rvm_out_of_fuel(const rvm_decoded *d, rvm_cpu_state *cpu) {
+    cpu->pc = d->next_pc;
+    cpu->error = RVM_ERR_FUEL;
+    cpu->halted = true;
+}
+
+// decoded index for a branch computed at run time.
+static inline uint32_t rvm_program_jump(const rvm_program *prog, uint32_t pc) {
+    if(pc >= prog->size) return RVM_PROGRAM_END(prog);
+    uint32_t i = prog->index[pc];
+    if(i == RVM_DEC_NONE || prog->code[i].type != RVM_INST_ENTRY)
+        return RVM_PROGRAM_BADJUMP(prog);
+    return i;
+}
+
+// decoded index for a return address popped off the stack.
+static inline uint32_t rvm_program_return(const rvm_program *prog,
+    uint32_t pc) {
+
+    if(pc >= prog->size) return RVM_PROGRAM_END(prog);
+    uint32_t i = prog->index[pc];
+    if(i == RVM_DEC_NONE) return RVM_PROGRAM_BADRET(prog);
+    return i;
+}
+
+// pointer to operand i of d; constants are copied into opc.
+static inline uint32_t *rvm_operand(const rvm_decoded *d, int i,
+    uint32_t *opc, rvm_cpu_state *cpu, rvm_mem *heap) {
+
+    switch(d->optype[i]) {
+    case RVM_OP_VALUE_SCONST:
+        opc[i] = d->opval[i];
+        return opc + i;
+    case RVM_OP_VALUE_REG:
+        return cpu->regs + d->opval[i];
+    case RVM_OP_STACK_SCONST:
+        // todo: check for over/underflow
+        // todo: check if within stack frame
+        return heap->contents + d->opval[i] + cpu->sp;
+    case RVM_OP_STACK_REG:
+        return heap->contents + cpu->regs[d->opval[i]] + cpu->sp;
+    case RVM_OP_HEAP_SCONST:
+        return heap->contents + d->opval[i];
+    case RVM_OP_HEAP_REG:
+        return heap->contents + cpu->regs[d->opval[i]];
+    default:
+        return NULL;
+    }
+}
+
+typedef struct rvm_fuse_stats {
+    uint32_t cmp_jcc;
+    uint32_t cmp_jcc_taken_elided; // no flag writes when taken
+    uint32_t cmp_jcc_not_taken_elided; // no flag writes when not taken
+    uint32_t push_call;
+    uint32_t pop_push;
+    uint32_t entry_skip; // constant branch targets moved past their entry
+} rvm_fuse_stats;
+
+// rewrites adjacent instruction runs into superinstructions, for the threaded
+// engine only.
+void rvm_fuse_program(rvm_program *prog, rvm_fuse_stats *stats);
+// moves constant branch targets past the entry they land on; done after
+// rvm_fuse_program, unless entries have to be seen, as in the tiered engine
+// or when running on fuel.
+void rvm_fuse_entries(rvm_program *prog, rvm_fuse_stats *stats);
+void rvm_fuse_report(const rvm_fuse_stats *stats);
+// per decoded instruction, whether the flags can be read before they are next
+// written once execution reaches it; the caller frees the result, which is
+// NULL if it couldn't be allocated.
+uint8_t *rvm_flags_liveness(const rvm_program *prog);
+
+typedef struct rvm_verify_stats {
+    uint32_t instructions;
+    uint32_t errors;
+    double time; // seconds
+} rvm_verify_stats;
+
+// checks the whole decoded program up front: every instruction is valid and
+// complete, every constant branch lands on an entry, and the last instruction
+// can't run past the end. Prints each problem found and returns how many
+// there were. Computed branches and returns are still checked as they run.
+uint32_t rvm_verify_program(const rvm_program *prog,
+    rvm_verify_stats *stats);
+void rvm_verify_report(const rvm_verify_stats *stats);
+
+// reserves address space for a stack or heap region, with the first size
+// bytes accessible and backed as they are touched. Accesses past that are
+// caught by a SIGSEGV handler, which stops the running context, so
+// pushes, pops and derefs need no bounds checks. Returns nonzero on failure,
+// with errno set and nothing to release.
+int rvm_mem_reserve(rvm_mem *mem, size_t size, uint8_t kind);
+void rvm_mem_release(rvm_mem *mem);
+// empties a region again, as if freshly reserved. Returns nonzero on
+// failure, with errno set.
+int rvm_mem_reset(rvm_mem *mem);
+// maps size bytes of fd from offset over the region, private, so that pages
+// are shared with fd until written. Returns nonzero on failure, with errno
+// set.
+int rvm_mem_map(rvm_mem *mem, int fd, size_t offset);
+// the alloc and free instructions, through the heap's allocator; on failure
+// cpu is halted with the error, and alloc returns 0.
+uint32_t rvm_mem_alloc(rvm_mem *heap, uint32_t size, rvm_cpu_state *cpu);
+void rvm_mem_free(rvm_mem *heap, uint32_t address, rvm_cpu_state *cpu);
+// allocator stats: live bytes, footprint, high-water mark and fragmentation.
+void rvm_mem_report(const rvm_mem *heap);
+
+// execution engines; each runs until hlt, starting from cpu->pc.
+typedef void (*rvm_engine)(const rvm_program *prog, rvm_cpu_state *cpu,
+    rvm_mem *stack, rvm_mem *heap);
+
+// reference engine, one switch over the decoded ops.
+void rvm_sim_switch(const rvm_program *prog, rvm_cpu_state *cpu,
+    rvm_mem *stack, rvm_mem *heap);
+// executes the single decoded instruction ip the way rvm_sim_switch would,
+// returning the index of the next one.
+uint32_t rvm_step(const rvm_program *prog, rvm_cpu_state *cpu,
+    rvm_mem *stack, rvm_mem *heap, uint32_t ip);
+// direct-threaded engine, using labels-as-values; the program must have been
+// through rvm_threaded_prepare first.
+void rvm_sim_threaded(const rvm_program *prog, rvm_cpu_state *cpu,
+    rvm_mem *stack, rvm_mem *heap);
+void rvm_threaded_prepare(rvm_program *prog);
+// sets up a single instruction, after its op changed.
+void rvm_threaded_prepare_one(rvm_decoded *d);
+
+// x86-64 JIT; returns nonzero if the program couldn't be compiled, leaving it
+// to the other engines. Instructions the JIT has no native code for are
+// handed to rvm_step one at a time.
+int rvm_jit_compile(rvm_program *prog);
+void rvm_jit_free(rvm_program *prog);
+void rvm_jit_report(const rvm_program *prog);
+void rvm_sim_jit(const rvm_program *prog, rvm_cpu_state *cpu,
+    rvm_mem *stack, rvm_mem *heap);
+
+// tiered engine; starts out in rvm_step, counting runs of each entry, and
+// moves an entry to fused threaded handlers once it has run threshold times.
+// The optimized copy of the program is only built on the first tier-up.
+// prepare returns nonzero if there's no memory for the counts.
+int rvm_tier_prepare(rvm_program *prog, uint32_t threshold);
+void rvm_tier_free(rvm_program *prog);
+void rvm_tier_report(const rvm_program *prog);
+void rvm_sim_tiered(const rvm_program *prog, rvm_cpu_state *cpu,
+    rvm_mem *stack, rvm_mem *heap);
+
+// everything one run of a program needs; any number of them can share a
+// program and run at once on different threads.
+typedef struct rvm_context {
+    const rvm_program *prog;
+    rvm_engine engine;
+    rvm_cpu_state cpu;
+    rvm_mem stack, heap;
+    // instructions rvm_context_run may still execute, or 0 for no limit
+    uint64_t budget;
+    // fuel for each rvm_context_run, or 0 for no limit
+    uint64_t fuel;
+    // where faults caught by the SIGSEGV handler resume
+    sigjmp_buf fault_jump;
+    // records every instruction budgeted runs step through, if set
+    struct rvm_trace *trace;
+    // the streams host calls read and write, if set
+    struct rvm_io *io;
+#ifdef RVM_METRICS
+    // counts every instruction budgeted runs step through, if set
+    struct rvm_metrics *metrics;
+#endif
+} rvm_context;
+
+// returns nonzero, with errno set and nothing to free, if the stack or heap
+// couldn't be reserved.
+int rvm_context_init(rvm_context *ctx, const rvm_program *prog,
+    rvm_engine engine, size_t stack_size, size_t heap_size);
+void rvm_context_free(rvm_context *ctx);
+// back to the initial state: cpu zeroed but for pc at the program's entry,
+// stack and heap empty. Memory that can't be emptied halts the cpu with
+// RVM_ERR_HOST_MEMORY.
+void rvm_context_reset(rvm_context *ctx);
+// runs until hlt, an error, the end of the budget or the end of the fuel,
+// returning the rvm_error. With a budget, instructions go one at a time
+// through rvm_step. After RVM_ERR_FUEL, running again picks up where it
+// stopped.
+uint8_t rvm_context_run(rvm_context *ctx);
+// prints the message for ctx->cpu.error.
+void rvm_context_print_error(const rvm_context *ctx);
+// the io of the context running on this thread, or NULL, for host calls.
+struct rvm_io *rvm_context_io(void);
+// called by the SIGSEGV handler on a guest memory fault; stops the context
+// running on this thread with error, and doesn't return. With no context
+// running it returns, leaving the handler to crash as for any other fault.
+void rvm_context_fault(uint8_t error);
+
+// a context's state at some point, to start runs from: cpu state, allocator,
+// stack and heap, in a file laid out
+//
+//     header | stack | heap
+//
+// at page offsets, so that restoring maps the memory back copy-on-write
+// rather than copying it. Any number of contexts can be restored from one
+// snapshot, sharing its pages until they write to them. Pages holding only
+// zeroes are left as holes.
+#define RVM_SNAPSHOT_MAGIC 0x534d5652 // "RVMS"
+#define RVM_SNAPSHOT_VERSION 1
+#define RVM_SNAPSHOT_PAGE 4096
+
+// the first page; structs are as the host lays them out, which header_size
+// and the version check.
+typedef struct rvm_snapshot_header {
+    uint32_t magic, version;
+    uint32_t header_size;
+    // the program it was taken running
+    uint32_t program_size, program_hash;
+    uint64_t stack_size, heap_size; // in bytes
+    rvm_cpu_state cpu;
+    rvm_alloc alloc; // but for words
+} rvm_snapshot_header;
+
+typedef struct rvm_snapshot {
+    int fd; // a memfd, or the file it was opened from
+    rvm_snapshot_header header;
+} rvm_snapshot;
+
+typedef enum rvm_snapshot_error {
+    RVM_SNAPSHOT_OK,
+    RVM_SNAPSHOT_IO, // a system call failed, and errno says why
+    RVM_SNAPSHOT_FORMAT, // not a snapshot, or from another version
+    RVM_SNAPSHOT_MISMATCH, // taken with another program or memory sizes
+} rvm_snapshot_error;
+
+// these return an rvm_snapshot_error.
+uint8_t rvm_snapshot_take(rvm_snapshot *snap, const rvm_context *ctx);
+// writes snap to path, through a temporary file renamed over it, so anything
+// still mapping an older snapshot there keeps its pages.
+uint8_t rvm_snapshot_save(const rvm_snapshot *snap, const char *path);
+uint8_t rvm_snapshot_open(rvm_snapshot *snap, const char *path);
+// puts ctx in snap's state, for the program ctx already has; a snapshot
+// taken at hlt carries on after it when run. On failure, ctx needs a reset.
+uint8_t rvm_snapshot_restore(const rvm_snapshot *snap, rvm_context *ctx);
+void rvm_snapshot_close(rvm_snapshot *snap);
+
+// runs jobs independent copies of programs, job i running
+// progs[i % prog_count] on engines[i % prog_count], on a work-stealing pool
+// of threads; each thread has one context it resets between jobs.
+typedef struct rvm_batch {
+    const rvm_program *const *progs;
+    const rvm_engine *engines;
+    uint32_t prog_count;
+    size_t stack_size, heap_size;
+    uint32_t jobs;
+    uint32_t threads;
+    // jobs start from this rather than from scratch, if not NULL; all of
+    // them must run the program it was taken with.
+    const rvm_snapshot *snapshot;
+
+    rvm_cpu_state *results; // by job
+    uint32_t *thread_jobs; // jobs run, by thread
+    uint32_t *thread_steals; // jobs stolen from other threads, by thread
+    double time; // wall time, in seconds
+} rvm_batch;
+
+// returns nonzero if some jobs couldn't be run, for want of memory or threads,
+// leaving their results zeroed.
+int rvm_batch_run(rvm_batch *batch);
+void rvm_batch_free(rvm_batch *batch);
+
+// runs lanes instances of one program that differ only in their initial
+// registers, RVM_LANES at a time in lockstep: one decode and dispatch per
+// instruction for all of them, with the arithmetic done on vectors. Lanes
+// that branch away from the rest, or would fault, leave lockstep and finish
+// on engine, so results are those of separate runs.
+#define RVM_LANES 8
+
+typedef struct rvm_lockstep {
+    const rvm_program *prog;
+    rvm_engine engine;
+    size_t stack_size, heap_size;
+    uint32_t lanes;
+    const uint32_t *regs; // initial registers, 8 per lane
+
+    rvm_cpu_state *results; // by lane
+    uint64_t lockstep_steps; // instructions run for a whole group at once
+    uint32_t scalar_lanes; // lanes that left lockstep
+    double time; // wall time, in seconds
+} rvm_lockstep;
+
+// returns nonzero, running nothing, if there's no memory for the lanes.
+int rvm_lockstep_run(rvm_lockstep *ls);
+void rvm_lockstep_free(rvm_lockstep *ls);
+
+// green threads: runs many contexts on the calling thread, a slice of
+// quantum fuel at a time, until all of them stop for good. The lowest
+// priority level with anything ready goes next, and contexts on the same
+// level take turns, so with equal priorities it's round robin.
+#define RVM_SCHED_LEVELS 8
+
+typedef struct rvm_sched {
+    rvm_context *const *tasks;
+    const uint8_t *priority; // by task, below RVM_SCHED_LEVELS, or NULL
+    uint32_t count;
+    uint64_t quantum; // fuel per slice
+
+    uint64_t slices;
+    double time; // wall time, in seconds
+    double run_time; // of that, spent inside slices
+    double *finish; // by task, time from the start until it stopped
+    double *max_wait; // by task, longest time spent ready but not running
+} rvm_sched;
+
+// returns nonzero if there's no memory to schedule with, running nothing.
+int rvm_sched_run(rvm_sched *sched);
+// switch cost, and percentiles of finish and wait times.
+void rvm_sched_report(const rvm_sched *sched);
+void rvm_sched_free(rvm_sched *sched);
+
+
+// a sampling profile: a context runs interval instructions at a time, and
+// before each slice its pc and guest call stack are taken as a sample,
+// weighted by the instructions the slice ran, so an interval of 1 counts
+// every instruction. Stacks are found by walking the guest stack for words a
+// call returns to, which data that happens to look like a return address
+// can add frames to. Frames go by the label at or before their pc: the
+// object's symbols, or without any, the program's entries.
+#define RVM_PROFILE_MAX_FRAMES 1024 // deeper stacks lose their outer frames
+#define RVM_PROFILE_MAX_SCAN 65536 // stack words looked at per sample
+
+typedef struct rvm_profile_stack {
+    uint32_t hash;
+    uint32_t depth, frames; // labels, root first, at frames in frame_pool
+    uint64_t weight;
+} rvm_profile_stack;
+
+typedef struct rvm_profile {
+    const rvm_program *prog;
+    // by address, and then one more label for pcs before all of them
+    uint32_t label_count;
+    uint32_t *addresses;
+    const char **names;
+    char *name_pool; // for names made up from entry addresses
+    uint64_t *self, *total; // instructions, by label
+    uint64_t *seen; // sample a label was last counted in total for
+    uint8_t *returns; // by word address: whether a call returns there
+
+    // distinct stacks, with an open addressing table of them by hash
+    rvm_profile_stack *stacks;
+    uint32_t stack_count, stack_capacity;
+    uint32_t *table;
+    uint32_t table_size;
+    uint32_t *frame_pool;
+    size_t frame_count, frame_capacity;
+    uint32_t *frames; // the stack being sampled, leaf first
+    uint32_t depth;
+
+    uint64_t samples, instructions;
+    uint64_t truncated; // samples with frames lost to the limits above
+} rvm_profile;
+
+// sets profile up for prog, with labels from obj if it has symbols. Returns
+// nonzero if there's no memory for it, leaving it to rvm_profile_free.
+int rvm_profile_init(rvm_profile *profile, const rvm_program *prog,
+    const rvm_object *obj);
+void rvm_profile_free(rvm_profile *profile);
+// runs ctx to hlt or an error, as rvm_context_run with no budget or fuel
+// would, sampling every interval instructions; returns the rvm_error.
+// A stack there's no memory to keep halts ctx with RVM_ERR_HOST_MEMORY.
+uint8_t rvm_profile_run(rvm_profile *profile, rvm_context *ctx,
+    uint64_t interval);
+// writes the stacks in collapsed form, a line of "root;...;leaf weight"
+// each, as flame graph tools take them; returns nonzero on failure.
+int rvm_profile_write(const rvm_profile *profile, FILE *out);
+// instructions in each label and in the labels under it, most first.
+void rvm_profile_report(const rvm_profile *profile);
+
+
+// an execution trace, written as budgeted runs step through instructions
+// with it set as their context's trace; see common/trace.h.
+typedef struct rvm_trace {
+    rvm_trace_header *header; // the mapped file
+    rvm_trace_record *records;
+    uint32_t mask; // capacity - 1
+    size_t size; // of the file
+} rvm_trace;
+
+// creates path as a trace of prog, holding the last capacity instructions,
+// rounded up to a power of two; returns nonzero, with errno set, on failure.
+int rvm_trace_open(rvm_trace *trace, const char *path, uint32_t capacity,
+    const rvm_program *prog);
+// rvm_step, recording the instruction at ip; it's recorded before it runs,
+// so one that faults is still there, without RVM_TRACE_DONE.
+uint32_t rvm_trace_step(rvm_trace *trace, rvm_context *ctx, uint32_t ip);
+// marks the trace finished with cpu's state, and unmaps it.
+void rvm_trace_close(rvm_trace *trace, const rvm_cpu_state *cpu);
+
+#ifdef RVM_METRICS
+// what a run executes, counted as budgeted runs step through it: built with
+// -DRVM_METRICS only, so that without it nothing is left of the counting.
+// Memory grows a page at a time as the stack and heap are first touched;
+// growth is tracked by the highest page the stack pointer and allocator have
+// reached.
+#define RVM_METRICS_SHAPES (RVM_OP_TYPES * RVM_OP_TYPES * RVM_OP_TYPES)
+#define RVM_METRICS_MAX_GROWTH 65536 // growth events kept; the rest counted
+
+typedef struct rvm_metrics_growth {
+    uint64_t instruction; // instructions retired, up to the one growing it
+    uint8_t kind; // RVM_MEM_*, of the region that grew
+    uint64_t stack_size, heap_size; // in bytes, after it
+} rvm_metrics_growth;
+
+typedef struct rvm_metrics {
+    const rvm_program *prog;
+    // by decoded index, the optype triple as encoded, o0 * 100 + o1 * 10 + o2
+    uint16_t *shape;
+
+    uint64_t instructions; // retired, so not counting one that faulted
+    uint64_t types[RVM_INST_COUNT];
+    uint64_t shapes[RVM_METRICS_SHAPES];
+    uint64_t taken[RVM_INST_COUNT], not_taken[RVM_INST_COUNT]; // by jcc
+    uint64_t calls, returns;
+    uint32_t depth, max_depth; // calls not yet returned from
+
+    uint64_t stack_size, heap_size; // touched, in bytes, rounded to pages
+    rvm_metrics_growth *growth;
+    uint32_t growth_count;
+    uint64_t growth_events; // including those past RVM_METRICS_MAX_GROWTH
+
+    double start; // of the run, for MIPS
+} rvm_metrics;
+
+// returns nonzero if there's no memory for the counts, leaving them to
+// rvm_metrics_free.
+int rvm_metrics_init(rvm_metrics *metrics, const rvm_program *prog);
+void rvm_metrics_free(rvm_metrics *metrics);
+// counts the instruction at ip, which rvm_step just ran on ctx.
+void rvm_metrics_count(rvm_metrics *metrics, const rvm_context *ctx,
+    uint32_t ip);
+// runs ctx to hlt or an error, counting into metrics, and writes them to path
+// as JSON at the end; SIGUSR1 writes them there as they are so far. Returns
+// nonzero, with errno set, if they couldn't be written at the end; the run
+// stops with its rvm_error in ctx->cpu.
+int rvm_metrics_run(rvm_metrics *metrics, rvm_context *ctx,
+    const char *path);
+// returns nonzero on failure.
+int rvm_metrics_write(const rvm_metrics *metrics, const rvm_context *ctx,
+    FILE *out);
+#endif
+
+// host calls: exp0-exp4 move bytes between the guest heap and the streams a
+// context's io has open, a chunk per call; see doc/hostcalls. Input from a
+// regular file maps into the heap, when the chunk and its place in the file
+// are page-aligned, so nothing is copied; otherwise, and for output, a chunk
+// costs a read or write. Small writes are gathered first.
+#define RVM_IO_PAGE 4096
+#define RVM_IO_BUFFER (1 << 16) // output gathered before it's written
+
+typedef struct rvm_io {
+    int in, out; // file descriptors, or -1 for none
+    bool mappable; // in is a regular file, read at consumed
+    uint64_t in_size; // of in, if mappable
+    uint64_t consumed; // input bytes read or skipped
+    // heap bytes [mapped_start, mapped_end) may map input
+    uint64_t mapped_start, mapped_end;
+    uint8_t *buffer;
+    uint32_t buffered;
+    // for rvm_io_report
+    uint64_t reads, mapped, copied, writes, written, calls, errors;
+} rvm_io;
+
+// sets io up on open descriptors, which stay the caller's to close; either
+// can be -1. Reading starts at in's current offset. Returns nonzero if the
+// output buffer couldn't be allocated.
+int rvm_io_init(rvm_io *io, int in, int out);
+// writes what's buffered out, and frees the buffer.
+void rvm_io_free(rvm_io *io);
+// writes what's buffered out; returns nonzero on failure.
+int rvm_io_flush(rvm_io *io);
+// puts anonymous memory back over any of heap mapping input; contexts do
+// this on reset, as dropping the pages would only bring the file's back.
+// Returns nonzero on failure.
+int rvm_io_unmap(rvm_io *io, rvm_mem *heap);
+void rvm_io_report(const rvm_io *io);
+// runs host call d, with operands op, on the running context's io. With
+// none, input is at its end and output goes nowhere.
+void rvm_host_call(const rvm_decoded *d, uint32_t *const *op,
+    rvm_cpu_state *cpu, rvm_mem *heap);
+
+// seconds on the monotonic clock, for timing reports.
+static inline double rvm_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif
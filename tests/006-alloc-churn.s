@@ -0,0 +1,24 @@
+;loop
+:main
+	or 0 0 r7
+:loop
+	alloc 3 r0
+	alloc 300 r1
+	alloc 20 r2
+	or r7 0 @r0
+	or r7 1 @r1
+	add @r0 @r1 @r2
+	free 3 r0
+	alloc 500 r3
+	free 300 r1
+	or @r2 0 @r3
+	free 20 r2
+	alloc 1 r4
+	free 500 r3
+	alloc 7000 r5
+	free 1 r4
+	free 7000 r5
+	add r7 1
+	cmp r7 100000
+	jl :loop
+	hlt
@@ -0,0 +1,16 @@
+# ret to a pushed address, landing on a jl that reads cmp's flags
+;neg
+;done
+:main
+	or 2 0 r0
+	push 6
+	cmp r0 3
+	je :done
+	ret
+	jl :neg
+	or 1 0 r3
+	hlt
+:neg
+	or 7 0 r3
+:done
+	hlt
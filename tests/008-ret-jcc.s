@@ -0,0 +1,16 @@
+# both ways out of a fused cmp+je return into a jl reading its flags
+;back
+;neg
+:main
+	or 2 0 r0
+	push 7
+	cmp r0 3
+	je :back
+:back
+	ret
+	jl :neg
+	or 1 0 r3
+	hlt
+:neg
+	or 7 0 r3
+	hlt
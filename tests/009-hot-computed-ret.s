@@ -0,0 +1,25 @@
+# a hot loop returning into a jl through a pushed address, so the tiered
+# engine promotes it and runs the ret from fused code
+;loop
+;back
+;neg
+;next
+:main
+	or 0 0 r1
+	or 0 0 r3
+:loop
+	push 9
+	cmp r1 500
+	je :back
+:back
+	ret
+	jl :neg
+	add r3 1 r3
+	jmp :next
+:neg
+	add r3 2 r3
+:next
+	add r1 1 r1
+	cmp r1 1000
+	jl :loop
+	hlt
@@ -0,0 +1,6 @@
+# frees a block after overwriting its header with a size no class has
+:main
+	alloc 3 r0
+	or 8000003 0 @0
+	free 3 r0
+	hlt
@@ -0,0 +1,11 @@
+# ret to a pushed address in the middle of a block, where r1 isn't the 2
+# falling through leaves in it; asm -O mustn't fold the add.
+;go
+	or 1 0 r1
+	push 4
+	jmp :go
+	or 2 0 r1
+	add r1 10 r2
+	hlt
+:go
+	ret
@@ -0,0 +1,11 @@
+# fills the default 64 MiB stack to its last word, which mustn't overflow,
+# then derefs the stack past 4G words, which mustn't wrap around to the
+# start of the heap; aot output has to fault where vm does.
+;loop
+:loop
+	add r0 1 r0
+	push r0
+	cmp r0 16777216
+	jl :loop
+	or 1 0 !4294967295
+	hlt